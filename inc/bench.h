@@ -0,0 +1,29 @@
+#ifndef KEI_BENCH_H
+#define KEI_BENCH_H
+
+#include <stddef.h>
+
+/*
+ * Benchmarks
+ *
+ * 'kei bench' times the capture and decode hot paths, sample access, the
+ * trigger-to-data latency of manual reads and, against the emulated
+ * instrument, the reading rate each output path sustains without losing
+ * readings. Results are printed one per line, for collection by scripts:
+ *
+ *   bench clock hz=<cycles per second>
+ *   bench <name> n=<runs> min=<min> mean=<mean> max=<max> unit=<cyc|us>
+ *   bench throughput rate=<Hz> got=<readings/s> <path>=<lost> ...
+ *   bench max_rate path=<path> hz=<Hz>
+ *
+ * Cycle counts are only meaningful on hardware; on native_posix, time does
+ * not advance while code runs, so only latency and throughput apply there.
+ */
+
+struct shell;
+/**
+ * @brief Handler for the 'kei bench' shell command
+ */
+int kei_bench_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
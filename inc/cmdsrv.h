@@ -0,0 +1,89 @@
+#ifndef KEI_CMDSRV_H
+#define KEI_CMDSRV_H
+
+#include <stdint.h>
+
+/*
+ * TCP command server
+ *
+ * Accepts newline (or semicolon) terminated SCPI-style commands, and answers
+ * every command with exactly one line, in order, so requests can be
+ * pipelined:
+ *
+ *   *IDN?             Identification
+ *   READ?             Get a reading, e.g. "+1.234500E-09", "+9.9E37" if overloaded.
+ *                     In manual trigger mode, a reading is triggered, and the
+ *                     answer follows once it came in, without holding up other
+ *                     clients
+ *   STAT?             Get statistics of the last completed window:
+ *                     "<window>,<count>,<mean>,<variance>,<min>,<max>"
+ *   FILT?             Get most recent output of the filter chain, as READ?
+ *   FILT:SPEC?        Get filter chain, e.g. "median:5,decim:4", see filter.h
+ *   FILT:SPEC <spec>  Set filter chain, "none" to disable
+ *   LOG:DUMP?         Get all pages held in the data log, oldest first, as
+ *                     definite length block "#<n><length><pages>", see datalog.h
+ *   EVENT?            Get event capture state: "<armed>,<events since boot>,
+ *                     <oldest held>,<held>"
+ *   EVENT:DUMP?       Get all event records held, oldest first, as definite
+ *                     length block "#<n><length><records>", see event.h
+ *   EVENT:TRIG?       Get trigger conditions, e.g. "rise:1.5E-9,overload"
+ *   EVENT:TRIG <spec> Set trigger conditions, "none" to disable
+ *   EVENT:ARM <0|1>   Disable/enable triggers
+ *   EVENT:FORCE 1     Fire on the next reading
+ *   EVENT:CLEAR 1     Discard all records held
+ *   PERF?             Get capture counters: "<cycles/s>,<captured>,<dropped>,
+ *                     <torn>,<retries>,<trigger timeouts>"
+ *   PERF:ISR?         Get PRINT ISR duration histogram, in cycles, as
+ *                     "<max>,<first bucket>,<count>,...", see perf.h
+ *   PERF:TRIG?        Get TRIGGER to PRINT histogram, as PERF:ISR?
+ *   PERF:AGE?         Get sample age at consumption histogram, as PERF:ISR?
+ *   PERF:RESET 1      Clear histograms and counters
+ *   NET:BOOT?         Get network bring-up times, in ms since boot, 0 if not
+ *                     yet reached: "<source>,<address>,<services>,<DHCP>,
+ *                     <first datagram>", source of the first address being
+ *                     N(one), C(ached lease), S(tatic) or D(HCP)
+ *   TIME:SYNC?        Get time discipline state: "<synced>,<offset ns>,
+ *                     <delay ns>,<frequency correction ppb>,<ms since update>"
+ *   MODE?             Get electrometer mode (N, V, O, C, A)
+ *   MODE <m>          Set electrometer mode (V, O, C, A)
+ *   TRIG:MODE?        Get trigger mode (F, P, M, C)
+ *   TRIG:MODE <m>     Set trigger mode (F, P, M, C)
+ *   TRIG:PER?         Get trigger period, in ms
+ *   TRIG:PER <ms>     Set trigger period, in ms
+ *
+ * Commands that do not return a value answer "OK", failures answer
+ * "ERR <reason>".
+ */
+
+typedef struct {
+    uint32_t accepted;      /**< Connections accepted */
+    uint32_t rejected;      /**< Connections refused, as all client slots were taken */
+    uint32_t commands;      /**< Commands executed */
+    uint32_t failed;        /**< Commands answered with an error */
+    uint32_t bytes;         /**< Response bytes sent */
+    uint32_t send_errors;   /**< Connections closed on a send failure */
+    uint32_t tx_hwm;        /**< High-water mark of a client's transmit buffer, in bytes */
+    uint32_t clients;       /**< Currently connected clients */
+} kei_cmdsrv_stats_t;
+
+/**
+ * @brief Open command server listening socket
+ */
+int kei_cmdsrv_init(void);
+
+/**
+ * @brief Service command server connections
+ *
+ * @param timeout_ms Maximum time to wait for activity, in milliseconds
+ */
+void kei_cmdsrv_poll(int timeout_ms);
+
+/**
+ * @brief Get command server counters
+ *
+ * @param stats Where to store counters
+ */
+void kei_cmdsrv_get_stats(kei_cmdsrv_stats_t *stats);
+
+#endif
+
@@ -0,0 +1,106 @@
+#ifndef KEI_CODEC_H
+#define KEI_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact sample block encoding
+ *
+ * Shared by the firmware and host tools, so this must not depend on Zephyr.
+ *
+ * A block starts with a fixed header:
+ *
+ *   u8   KEI_CODEC_VERSION
+ *   u8   flags (KEI_CODEC_FLAG_*)
+ *   u8   mode (kei_interface_mode_e)
+ *   u16  number of samples, little-endian
+ *
+ * followed, if there are any samples, by varint base time and base sequence
+ * number, then the samples. Each sample starts with a varint
+ *
+ *   (zigzag(value delta) << 2) | (seq gap << 1) | state change
+ *
+ * where the value delta is in units of 10^exp micro-units, relative to the
+ * previous sample, or to zero if the state changed. It is followed by:
+ *
+ *   state change: zigzag varint range, u8 flags, u8 (sensitivity << 4) | exp
+ *   seq gap:      varint sequence number delta, if not 1
+ *   always:       zigzag varint timestamp delta-of-delta, in microseconds
+ *
+ * Varints are LEB128, zigzag maps signed to unsigned as 0, -1, 1, -2, ...
+ * With a steady trigger rate and slowly changing readings this comes down to
+ * 2-3 bytes per sample.
+ */
+
+#define KEI_CODEC_VERSION 1
+
+#define KEI_CODEC_FLAG_UTC (1U << 0) /**< Times are UTC, rather than time since boot */
+
+#define KEI_CODEC_HDR_SIZE    5  /**< Size of fixed block header */
+#define KEI_CODEC_SAMPLE_MAX  40 /**< Maximum encoded size of a sample, including block base */
+
+/**< Sample, as encoded */
+typedef struct {
+    uint32_t seq;         /**< Sequence number */
+    uint64_t time;        /**< Timestamp, in microseconds */
+    int32_t  value;       /**< Value, in micro-units */
+    int8_t   range;       /**< Range (power) setting */
+    uint8_t  sensitivity; /**< Sensitivity setting, 0-15 */
+    uint8_t  flags;       /**< KEI_DATAFLAG_* */
+} kei_codec_sample_t;
+
+/**< Encoding/decoding state */
+typedef struct {
+    uint8_t  *buf;
+    size_t    size;
+    size_t    len;        /**< Bytes used (encoding) or consumed (decoding) */
+    uint16_t  count;      /**< Samples encoded, or left to decode */
+
+    uint8_t   flags;      /**< KEI_CODEC_FLAG_* */
+    uint8_t   mode;
+
+    /* Previous sample */
+    uint32_t  seq;
+    uint64_t  time;
+    int64_t   dt;
+    int32_t   value;
+    int8_t    range;
+    uint8_t   sensitivity;
+    uint8_t   sflags;
+    uint8_t   exp;
+} kei_codec_t;
+
+/**
+ * @brief Start encoding a block
+ *
+ * @param codec State
+ * @param buf Buffer to encode to
+ * @param size Size of buffer, at least KEI_CODEC_HDR_SIZE
+ * @param flags KEI_CODEC_FLAG_*
+ * @param mode Mode all samples in block were taken in
+ */
+int kei_codec_enc_init(kei_codec_t *codec, uint8_t *buf, size_t size, uint8_t flags, uint8_t mode);
+
+/**
+ * @brief Add a sample to a block
+ *
+ * @return 0 on success, -1 if the block is full, in which case it is unchanged
+ */
+int kei_codec_enc_add(kei_codec_t *codec, const kei_codec_sample_t *sample);
+
+/**
+ * @brief Start decoding a block
+ *
+ * @return 0 on success, -1 if the header is invalid
+ */
+int kei_codec_dec_init(kei_codec_t *codec, const uint8_t *buf, size_t len);
+
+/**
+ * @brief Decode the next sample of a block
+ *
+ * @return 0 on success, 1 at end of block, -1 if the block is corrupt
+ */
+int kei_codec_dec_next(kei_codec_t *codec, kei_codec_sample_t *sample);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef KEI_DATALOG_H
+#define KEI_DATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/toolchain.h>
+
+/*
+ * Flash data log
+ *
+ * Every reading is appended to a circular log on the kei_log_partition flash
+ * partition. Readings are collected in RAM and written a whole flash page at
+ * a time, each page consisting of a kei_datalog_page_hdr_t followed by a
+ * hdr.len byte sample block, see codec.h. Page number s is always stored at page
+ * (s % number of pages) of the partition, so the oldest pages are overwritten
+ * once the log wraps. All fields are little-endian.
+ *
+ * Readings still collected in RAM are lost on reset, use kei_datalog_flush()
+ * to write them out early.
+ */
+
+#define KEI_DATALOG_MAGIC     0x474c364b /* "K6LG" */
+#define KEI_DATALOG_PAGE_SIZE CONFIG_KEI_DATALOG_PAGE_SIZE
+
+typedef struct __packed {
+    uint32_t magic;     /**< KEI_DATALOG_MAGIC */
+    uint32_t page_seq;  /**< Page number */
+    uint16_t len;       /**< Length of sample block following header */
+    uint16_t reserved;
+    uint32_t crc;       /**< CRC-32 (IEEE) of header up to this field and sample block */
+} kei_datalog_page_hdr_t;
+
+#define KEI_DATALOG_BLOCK_SIZE (KEI_DATALOG_PAGE_SIZE - sizeof(kei_datalog_page_hdr_t))
+
+/**< Data log state */
+typedef struct {
+    uint32_t n_pages;       /**< Number of pages in partition */
+    uint32_t oldest;        /**< Page number of oldest page held */
+    uint32_t used;          /**< Number of pages held, starting at oldest */
+    uint32_t pending;       /**< Readings collected in RAM, not yet written */
+    uint32_t pending_len;   /**< Size of encoded readings collected in RAM, in bytes */
+    uint32_t written;       /**< Pages written since boot */
+    uint32_t errors;        /**< Page writes that failed since boot */
+    uint32_t missed;        /**< Readings that could not be logged in time */
+} kei_datalog_info_t;
+
+/**
+ * @brief Mount the data log and start logging readings
+ */
+int kei_datalog_init(void);
+
+/**
+ * @brief Get data log state
+ */
+int kei_datalog_get_info(kei_datalog_info_t *info);
+
+/**
+ * @brief Read raw data from a page of the log
+ *
+ * The page may have been overwritten by a newer one by the time it is read,
+ * which can be detected by checking hdr.page_seq.
+ *
+ * @param page_seq Page number
+ * @param off Offset into the page
+ * @param buf Where to store data
+ * @param len Number of bytes to read
+ */
+int kei_datalog_read(uint32_t page_seq, size_t off, void *buf, size_t len);
+
+/**
+ * @brief Write readings collected so far to flash, without waiting for the
+ * page to fill up
+ */
+int kei_datalog_flush(void);
+
+/**
+ * @brief Erase the log
+ */
+int kei_datalog_erase(void);
+
+struct shell;
+/**
+ * @brief Handler for the 'kei log' shell command
+ */
+int kei_datalog_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef KEI_EMUL615_H
+#define KEI_EMUL615_H
+
+#include <stdint.h>
+
+/*
+ * Emulated Keithley 615
+ *
+ * For host builds, where the interface GPIOs are mapped onto GPIO emulator
+ * controllers (see boards/native_posix.overlay). Drives the data, range,
+ * sensitivity, polarity and overload lines and pulses PRINT just as the
+ * instrument would, so the interface code runs unmodified against it.
+ */
+
+typedef enum {
+    KEI_EMUL615_MODE_FREE = 0, /**< Readings at a fixed rate, ignoring TRIGGER */
+    KEI_EMUL615_MODE_TRIGGER,  /**< One reading per TRIGGER pulse, after the conversion time */
+    KEI_EMUL615_MODE_MANUAL,   /**< Readings only on kei_emul615_print() */
+    KEI_EMUL615_MODE_MAX
+} kei_emul615_mode_e;
+
+/**
+ * @brief Start the emulator, must be called after kei_interface_init()
+ */
+int kei_emul615_init(void);
+
+/**
+ * @brief Set emulator mode
+ *
+ * @param mode Mode
+ * @param us Reading period in free-running mode, or conversion time in
+ * trigger mode, in microseconds. Ignored in manual mode.
+ */
+int kei_emul615_set_mode(kei_emul615_mode_e mode, uint32_t us);
+
+/**
+ * @brief Get emulator mode
+ *
+ * @param us Where to store the reading period or conversion time, may be NULL
+ */
+kei_emul615_mode_e kei_emul615_get_mode(uint32_t *us);
+
+/**
+ * @brief Produce a reading now
+ */
+void kei_emul615_print(void);
+
+#endif
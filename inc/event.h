@@ -0,0 +1,141 @@
+#ifndef KEI_EVENT_H
+#define KEI_EVENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/toolchain.h>
+
+#include "interface.h"
+
+/*
+ * Event capture
+ *
+ * The last CONFIG_KEI_EVENT_PRE readings are kept in RAM at all times. When
+ * a trigger condition fires, those, the reading that fired it and the next
+ * CONFIG_KEI_EVENT_POST readings are frozen into a capture record, without
+ * having to stream or log every reading to catch the event. Conditions are
+ * described by a spec string of comma-separated items, e.g.
+ * "rise:1.5E-9,overload":
+ *
+ *   rise:<level>  A reading reaches level from below
+ *   fall:<level>  A reading reaches level from above
+ *   overload      A reading is overloaded, following one that is not
+ *   range         The range (power) setting changes
+ *
+ * Levels are in units, e.g. "1.5E-9" or "-0.2". Overloaded readings are not
+ * compared against levels, crossings are detected between the readings on
+ * either side of them. Triggers are ignored while a record is being
+ * collected, after which the trigger re-arms.
+ *
+ * The last CONFIG_KEI_EVENT_RECORDS records are held, the oldest being
+ * overwritten by new ones. Each record is CONFIG_KEI_EVENT_RECORD_SIZE bytes,
+ * consisting of a kei_event_hdr_t followed by a hdr.len byte sample block,
+ * see codec.h. Records that do not fit all readings are cut short, and
+ * flagged as such. All fields are little-endian.
+ */
+
+#define KEI_EVENT_MAGIC       0x5645364b /* "K6EV" */
+#define KEI_EVENT_RECORD_SIZE CONFIG_KEI_EVENT_RECORD_SIZE
+#define KEI_EVENT_SPEC_MAX    64 /**< Maximum length of a formatted spec, including terminator */
+
+#define KEI_EVENT_CAUSE_RISE     (1U << 0)
+#define KEI_EVENT_CAUSE_FALL     (1U << 1)
+#define KEI_EVENT_CAUSE_OVERLOAD (1U << 2)
+#define KEI_EVENT_CAUSE_RANGE    (1U << 3)
+#define KEI_EVENT_CAUSE_FORCED   (1U << 4) /**< Fired by kei_event_force() */
+
+#define KEI_EVENT_FLAG_TRUNCATED (1U << 0) /**< Record ran out of space, or the mode changed, before all readings were added */
+
+typedef struct __packed {
+    uint32_t magic;     /**< KEI_EVENT_MAGIC */
+    uint32_t index;     /**< Event number, counting from 1 since boot */
+    uint16_t len;       /**< Length of sample block following header */
+    uint8_t  cause;     /**< KEI_EVENT_CAUSE_* that fired */
+    uint8_t  flags;     /**< KEI_EVENT_FLAG_* */
+    uint32_t trig_seq;  /**< Sequence number of the reading that fired */
+    uint16_t pre;       /**< Readings before the one that fired */
+    uint16_t post;      /**< Readings after the one that fired */
+    uint32_t crc;       /**< CRC-32 (IEEE) of header up to this field and sample block */
+} kei_event_hdr_t;
+
+#define KEI_EVENT_BLOCK_SIZE (KEI_EVENT_RECORD_SIZE - sizeof(kei_event_hdr_t))
+
+/**< Event capture state */
+typedef struct {
+    bool     armed;     /**< Whether triggers are acted upon */
+    bool     busy;      /**< Whether a record is being collected */
+    uint32_t events;    /**< Records started since boot */
+    uint32_t oldest;    /**< Index of oldest record held */
+    uint32_t held;      /**< Number of complete records held, starting at oldest */
+    uint32_t truncated; /**< Records cut short since boot */
+} kei_event_info_t;
+
+/**
+ * @brief Add a reading to the pre-trigger history and evaluate triggers
+ *
+ * @param sample Sample to add
+ */
+void kei_event_push(const kei_interface_sample_t *sample);
+
+/**
+ * @brief Set trigger conditions
+ *
+ * @param spec Condition spec, empty or "none" for no conditions
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int kei_event_set(const char *spec);
+
+/**
+ * @brief Get trigger conditions, formatted as a spec string
+ */
+int kei_event_get_spec(char *buf, size_t len);
+
+/**
+ * @brief Enable or disable acting upon triggers
+ *
+ * A record being collected is completed regardless.
+ */
+void kei_event_arm(bool arm);
+
+/**
+ * @brief Fire a trigger on the next reading, regardless of conditions
+ *
+ * @return 0 on success, -1 if a record is already being collected
+ */
+int kei_event_force(void);
+
+/**
+ * @brief Discard all records held
+ */
+void kei_event_clear(void);
+
+/**
+ * @brief Get event capture state
+ */
+void kei_event_get_info(kei_event_info_t *info);
+
+/**
+ * @brief Read raw data from a record
+ *
+ * The record may have been overwritten by a newer one by the time it is read,
+ * which can be detected by checking hdr.index and hdr.crc.
+ *
+ * @param index Event number
+ * @param off Offset into the record
+ * @param buf Where to store data
+ * @param len Number of bytes to read
+ *
+ * @return 0 on success, -1 if the record is not held
+ */
+int kei_event_read(uint32_t index, size_t off, void *buf, size_t len);
+
+struct shell;
+/**
+ * @brief Handler for the 'kei event' shell command
+ */
+int kei_event_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef KEI_FILTER_H
+#define KEI_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+/*
+ * Filter chains
+ *
+ * A chain consists of up to CONFIG_KEI_FILTER_STAGES stages, applied in order
+ * to the micro-unit value of each sample. Chains are described by a spec
+ * string of comma-separated "<type>:<n>" stages, e.g. "median:5,decim:4":
+ *
+ *   boxcar:<n>  Moving average over the last n readings
+ *   median:<n>  Running median of the last n readings
+ *   ema:<n>     Exponential moving average, time constant of n readings
+ *   decim:<n>   Pass on only every n-th reading
+ *
+ * Readings at different ranges cannot be combined, so a range change restarts
+ * the chain. Overloaded readings are passed on immediately and also restart
+ * the chain.
+ */
+
+#define KEI_FILTER_SPEC_MAX 64 /**< Maximum length of a formatted spec, including terminator */
+
+typedef enum {
+    KEI_FILTER_NONE = 0,
+    KEI_FILTER_BOXCAR,
+    KEI_FILTER_MEDIAN,
+    KEI_FILTER_EMA,
+    KEI_FILTER_DECIMATE,
+    KEI_FILTER_MAX
+} kei_filter_type_e;
+
+/**< Single filter stage */
+typedef struct {
+    uint8_t  type;                          /**< kei_filter_type_e */
+    uint16_t n;                             /**< Length / time constant / ratio */
+    uint16_t count;                         /**< Readings held, or seen since last output */
+    uint16_t pos;                           /**< Next position in buf */
+    int64_t  acc;                           /**< Running sum (boxcar), or Q8 average (EMA) */
+    int32_t  buf[CONFIG_KEI_FILTER_LEN_MAX]; /**< History (boxcar, median) */
+} kei_filter_stage_t;
+
+/**< Filter chain */
+typedef struct {
+    uint8_t            n_stages;
+    int8_t             range;  /**< Range of readings held by the chain */
+    kei_filter_stage_t stages[CONFIG_KEI_FILTER_STAGES];
+} kei_filter_t;
+
+/**
+ * @brief Configure a filter chain from a spec string
+ *
+ * @param filter Chain to configure, left untouched if spec is invalid
+ * @param spec Chain spec, empty or "none" for no filtering
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int kei_filter_parse(kei_filter_t *filter, const char *spec);
+
+/**
+ * @brief Format the configuration of a filter chain as spec string
+ */
+int kei_filter_format(const kei_filter_t *filter, char *buf, size_t len);
+
+/**
+ * @brief Check whether two chains have the same configuration
+ */
+bool kei_filter_equal(const kei_filter_t *a, const kei_filter_t *b);
+
+/**
+ * @brief Discard all readings held by a filter chain
+ */
+void kei_filter_reset(kei_filter_t *filter);
+
+/**
+ * @brief Pass a sample through a filter chain
+ *
+ * On output, the sample's data holds the filtered value, while all other fields
+ * are those of the most recent reading that went in.
+ *
+ * @param filter Chain
+ * @param sample Sample to filter, replaced by the output
+ *
+ * @return 0 if the chain produced an output, -1 if the sample was absorbed
+ */
+int kei_filter_apply(kei_filter_t *filter, kei_interface_sample_t *sample);
+
+/**
+ * @brief Pass a sample through the board-wide filter chain
+ */
+void kei_filter_push(const kei_interface_sample_t *sample);
+
+/**
+ * @brief Get the most recent output of the board-wide filter chain
+ *
+ * @return 0 on success, -1 if there has been no output yet
+ */
+int kei_filter_get(kei_interface_sample_t *sample);
+
+/**
+ * @brief Configure the board-wide filter chain, see kei_filter_parse()
+ */
+int kei_filter_set(const char *spec);
+
+/**
+ * @brief Format the configuration of the board-wide filter chain
+ */
+int kei_filter_get_spec(char *buf, size_t len);
+
+struct shell;
+/**
+ * @brief Handler for the 'kei filter' shell command
+ */
+int kei_filter_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
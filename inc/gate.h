@@ -0,0 +1,88 @@
+#ifndef KEI_GATE_H
+#define KEI_GATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+/*
+ * Change gates
+ *
+ * A gate lets a reading through to a subscriber only if it differs
+ * meaningfully from the last one let through, so slowly changing readings
+ * cost next to nothing to publish. Gates are described by a spec string of
+ * comma-separated items, e.g. "db:500,hb:10000":
+ *
+ *   change        Only let through readings that changed
+ *   db:<n>        Absolute deadband, in micro-units of the value
+ *   dbrel:<ppm>   Relative deadband, in ppm of the last value let through
+ *   hb:<ms>       Let a reading through regardless, once nothing was let
+ *                 through for this long (heartbeat)
+ *
+ * Any item enables the gate. A reading is let through if its value differs
+ * from the last one let through by more than the larger of both deadbands,
+ * or if its range or flags differ. Without a gate, every reading is let
+ * through.
+ *
+ * Subscribers that take a filter chain take gate items in the same spec,
+ * e.g. "median:5,db:500". The gate is applied to the output of the chain.
+ */
+
+#define KEI_GATE_SPEC_MAX 48 /**< Maximum length of a formatted spec, including terminator */
+
+#define KEI_GATE_HEARTBEAT 1 /**< kei_gate_apply() result for a heartbeat */
+
+typedef struct {
+    bool     enabled;
+    uint32_t deadband;     /**< Absolute deadband, in micro-units */
+    uint32_t deadband_ppm; /**< Relative deadband, in ppm */
+    uint32_t heartbeat_ms; /**< Maximum silence, 0 for none */
+    uint64_t heartbeat_cyc;
+
+    /* Last reading let through */
+    bool     have_last;
+    int32_t  value;
+    int8_t   range;
+    uint8_t  flags;
+    uint64_t timestamp;
+
+    uint32_t suppressed;   /**< Readings held back since the gate was set */
+} kei_gate_t;
+
+/**
+ * @brief Configure a gate from a spec string
+ *
+ * @param gate Gate to configure, left untouched if spec is invalid
+ * @param spec Gate spec, empty or "none" for no gate
+ * @param rest Where to store the items that are not gate items, e.g. for
+ *             kei_filter_parse(), NULL if there must not be any
+ * @param len Size of rest
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int kei_gate_parse(kei_gate_t *gate, const char *spec, char *rest, size_t len);
+
+/**
+ * @brief Format the configuration of a gate as spec string
+ */
+int kei_gate_format(const kei_gate_t *gate, char *buf, size_t len);
+
+/**
+ * @brief Check whether two gates have the same configuration
+ */
+bool kei_gate_equal(const kei_gate_t *a, const kei_gate_t *b);
+
+/**
+ * @brief Pass a sample through a gate
+ *
+ * @param gate Gate
+ * @param sample Sample
+ *
+ * @return 0 if the sample is let through, KEI_GATE_HEARTBEAT if it is let
+ *         through as a heartbeat, -1 if it is held back
+ */
+int kei_gate_apply(kei_gate_t *gate, const kei_interface_sample_t *sample);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef KEI_INTERFACE_H
 #define KEI_INTERFACE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define KEI_DATAFLAG_OVERLOAD (1U << 0)
@@ -9,6 +10,9 @@
  * lower on 50 Hz units). */
 #define KEI_TRIG_PERIOD_MIN 42
 
+/* Time to wait for a reading after a manual trigger */
+#define KEI_TRIG_WAIT_MS 100
+
 /**< Mode the electrometer is in. This is not available via the 50-pin connector */
 typedef enum {
     KEI_MODE_NONE  = 0,
@@ -32,11 +36,54 @@ typedef struct {
     uint8_t flags;       /**< Flags */
 } kei_interface_data_t;
 
+typedef struct {
+    uint32_t                seq;       /**< Sequence number, starting at 1 */
+    uint64_t                timestamp; /**< Time of PRINT strobe, in cycles, see timebase.h */
+    kei_interface_rawdata_t raw;       /**< Raw reading */
+    uint8_t                 mode;      /**< kei_interface_mode_e the reading was converted for */
+    kei_interface_data_t    data;      /**< Reading converted to micro-units, per mode */
+} kei_interface_sample_t;
+
+/**< Read cursor into the sample buffer, one per consumer */
+typedef struct {
+    uint32_t next;    /**< Sequence number of the next sample to be read */
+    uint32_t dropped; /**< Number of samples overwritten before they could be read */
+    uint8_t  perf_id; /**< Consumer slot in backlog statistics, see perf.h */
+} kei_interface_reader_t;
+
+/**< Capture statistics */
+typedef struct {
+    uint32_t captured; /**< Captures queued for decoding */
+    uint32_t dropped;  /**< Captures dropped due to the decode queue being full */
+    uint32_t retries;  /**< Captures re-sampled due to lines changing between samples */
+    uint32_t torn;     /**< Captures rejected due to lines not settling */
+} kei_interface_capstats_t;
+
+/**< Trigger timing statistics */
+typedef struct {
+    uint32_t count;       /**< Number of triggers */
+
+    /* Periodic mode, relative to the ideal schedule */
+    uint32_t overruns;    /**< Number of times one or more triggers were missed */
+    int32_t  min_us;      /**< Minimum deviation, in microseconds */
+    int32_t  max_us;      /**< Maximum deviation, in microseconds */
+    int64_t  sum_us;      /**< Sum of deviations, in microseconds, for computing mean */
+
+    /* Chained mode */
+    uint32_t timeouts;    /**< Number of triggers not followed by a reading */
+    uint32_t conv_us;     /**< Average time from trigger to reading, in microseconds */
+    uint32_t interval_us; /**< Average time between readings, in microseconds */
+
+    /* Manual mode */
+    uint32_t joined;      /**< Number of reads that joined a reading already in flight */
+} kei_interface_trigstats_t;
+
 typedef enum {
     KEI_TRIGMODE_NONE  = 0,
     KEI_TRIGMODE_FREERUNNING, /**< Instrument is allowed to trigger itself */
     KEI_TRIGMODE_PERIODIC,    /**< We periodically trigger the instrument */
     KEI_TRIGMODE_MANUAL,      /**< We only trigger the instrument when a read is requested */
+    KEI_TRIGMODE_CHAINED,     /**< We trigger the instrument again as soon as a reading comes in */
     KEI_TRIGMODE_MAX
 } kei_interface_trigmode_e;
 
@@ -59,26 +106,164 @@ int kei_interface_print(void);
  */
 int kei_interface_set_mode(kei_interface_mode_e mode);
 
+/**
+ * @brief Get which mode the electrometer is set to
+ */
+kei_interface_mode_e kei_interface_get_mode(void);
+
 /**
  * @brief Get most recent data received from the electrometer
  *
+ * In manual trigger mode, a reading is triggered and waited for.
+ *
  * @param data Where to store data
  */
 int kei_interface_get_data(kei_interface_data_t *data);
 
+/**
+ * @brief Trigger a reading, without waiting for it
+ *
+ * If a reading triggered by a previous call is still in flight, that reading
+ * is joined rather than triggering a new one. The reading is the first
+ * sample newer than seq, which should be expected within KEI_TRIG_WAIT_MS.
+ *
+ * @param seq Where to store the sequence number the reading will be newer than
+ *
+ * @return 0 on success, -1 if in free-running or no trigger mode, or on failure
+ */
+int kei_interface_trigger(uint32_t *seq);
+
+/**
+ * @brief Get most recent sample received from the electrometer
+ *
+ * Does not trigger a reading, regardless of trigger mode.
+ *
+ * @param sample Where to store sample
+ *
+ * @return 0 on success, -1 if no sample has been received yet
+ */
+int kei_interface_get_sample(kei_interface_sample_t *sample);
+
+/**
+ * @brief Get sequence number of the most recent sample, 0 if there is none
+ */
+uint32_t kei_interface_get_seq(void);
+
+/**
+ * @brief Wait for a sample newer than the given sequence number
+ *
+ * Returns immediately if such a sample has already been received. Does not
+ * trigger a reading.
+ *
+ * @param seq Sequence number the sample must be newer than
+ * @param timeout_ms Maximum time to wait, in milliseconds, < 0 to wait forever
+ *
+ * @return 0 on success, -1 on timeout
+ */
+int kei_interface_wait_sample(uint32_t seq, int32_t timeout_ms);
+
+/**
+ * @brief Initialize a reader, such that it will only see samples received
+ * from this point on
+ *
+ * @param reader Reader to initialize
+ */
+void kei_interface_reader_init(kei_interface_reader_t *reader);
+
+/**
+ * @brief Read the next sample for the given reader
+ *
+ * Never blocks. If the reader has fallen behind by more than the buffer
+ * length, it skips ahead to the oldest sample still buffered, and the number
+ * of skipped samples is added to its drop counter.
+ *
+ * @param reader Reader to read with
+ * @param sample Where to store sample
+ *
+ * @return 0 on success, -1 if there are no new samples
+ */
+int kei_interface_read(kei_interface_reader_t *reader, kei_interface_sample_t *sample);
+
 /**
  * @brief Set trigger mode
  *
  * @param mode Desired trigger mode
+ *
+ * @return 0 on success, -1 on failure, in which case no trigger mode
+ *         (KEI_TRIGMODE_NONE) is in effect
  */
 int kei_interface_set_trigmode(kei_interface_trigmode_e mode);
 
 /**
- * @brief Set trigger period (not applicable in free-running mode)
+ * @brief Get trigger mode
+ */
+kei_interface_trigmode_e kei_interface_get_trigmode(void);
+
+/**
+ * @brief Set trigger period (not applicable in free-running or chained mode)
  *
  * @param period_ms Desired trigger period, in milliseconds, >= 42 ms
  */
 int kei_interface_set_trigperiod(uint32_t period_ms);
 
+/**
+ * @brief Get trigger period, in milliseconds
+ */
+uint32_t kei_interface_get_trigperiod(void);
+
+/**
+ * @brief Enable or disable capture validation
+ *
+ * When enabled, the data, range, sensitivity, polarity and overload lines
+ * are sampled until two consecutive samples agree, up to a bounded number of
+ * retries, and the reading is rejected otherwise.
+ *
+ * @param enable Whether to validate captures
+ */
+void kei_interface_set_validate(bool enable);
+
+/**
+ * @brief Get capture statistics
+ *
+ * @param stats Where to store statistics
+ */
+void kei_interface_get_capstats(kei_interface_capstats_t *stats);
+
+/**
+ * @brief Reset capture statistics
+ */
+void kei_interface_reset_capstats(void);
+
+/**
+ * @brief Get trigger timing statistics
+ *
+ * @param stats Where to store statistics
+ */
+void kei_interface_get_trigstats(kei_interface_trigstats_t *stats);
+
+/**
+ * @brief Reset trigger timing statistics
+ */
+void kei_interface_reset_trigstats(void);
+
+/**< Cost of one pass through the capture path, in cycles */
+typedef struct {
+    uint32_t isr;     /**< PRINT ISR body: timestamp, validated capture and queueing */
+    uint32_t capture; /**< Reading every captured port once */
+    uint32_t bcd;     /**< Decoding the data lines */
+    uint32_t decode;  /**< Decoding a whole sample */
+} kei_interface_benchcyc_t;
+
+/**
+ * @brief Time one pass through the capture and decode paths (CONFIG_KEI_BENCH)
+ *
+ * Runs the PRINT ISR body on the current line state as if an edge had come
+ * in, but queues the capture where it is discarded, so nothing is published
+ * and capture, trigger and perf state are left untouched.
+ *
+ * @param cyc Where to store costs
+ */
+void kei_interface_bench_capture(kei_interface_benchcyc_t *cyc);
+
 #endif
 
@@ -1,25 +1,46 @@
 #ifndef KEI_NET_H
 #define KEI_NET_H
 
+#include <stdint.h>
+
+typedef enum {
+    KEI_NET_ADDR_NONE = 0,
+    KEI_NET_ADDR_CACHED,    /**< Lease remembered from a previous boot */
+    KEI_NET_ADDR_STATIC,    /**< CONFIG_KEI_NET_STATIC_ADDR */
+    KEI_NET_ADDR_DHCP,
+    KEI_NET_ADDR_MAX
+} kei_net_addr_src_e;
+
+/**< Network bring-up milestones, in milliseconds since boot, 0 if not yet
+ * reached */
+typedef struct {
+    kei_net_addr_src_e source;      /**< Where the first usable address came from */
+    uint32_t           addr_ms;     /**< First address usable */
+    uint32_t           services_ms; /**< Streaming and command server started */
+    uint32_t           dhcp_ms;     /**< DHCP first bound */
+} kei_net_boot_t;
+
 /**
  * @brief Initialize network driver
  */
 int kei_net_init(void);
 
 /**
- * @brief Get address via DHCP
+ * @brief Bring up an address, and start DHCP in the background
+ *
+ * A lease cached from the previous boot, or else a configured static address,
+ * is put in use right away, and replaced once DHCP binds.
+ *
+ * @return 0 if an address is usable now, -1 if waiting for DHCP
  */
 int kei_net_getaddr(void);
 
-#if (CONFIG_SNTP)
 /**
- * @brief Get time via SNTP
+ * @brief Get network bring-up milestones
  *
- * @param time_s Where to store retrieved time in seconds
- * @param time_us Where to store microsecond time offset, if desired
+ * @param boot Where to store milestones
  */
-int kei_net_sntp(time_t *time_s, unsigned *time_us);
-#endif /* (CONFIG_SNTP) */
+void kei_net_get_boot(kei_net_boot_t *boot);
 
 #endif
 
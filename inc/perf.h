@@ -0,0 +1,82 @@
+#ifndef KEI_PERF_H
+#define KEI_PERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+/*
+ * Runtime performance instrumentation
+ *
+ * Always-on histograms of hot path timings, in cycles, and of how far behind
+ * each consumer of the sample buffer is when it reads. Bucket i counts values
+ * v with 2^(i-1) <= v < 2^i, bucket 0 counts zeros. Shown by 'kei perf', and
+ * available over the command server as PERF:<name>?.
+ */
+
+#define KEI_PERF_BUCKETS 32
+
+typedef enum {
+    KEI_PERF_ISR = 0, /**< PRINT ISR duration */
+    KEI_PERF_TRIG,    /**< TRIGGER pulse to PRINT strobe */
+    KEI_PERF_AGE,     /**< Time from PRINT strobe to a consumer reading the sample */
+    KEI_PERF_HIST_MAX
+} kei_perf_hist_e;
+
+/**< Histogram, with log2 buckets */
+typedef struct {
+    uint32_t count[KEI_PERF_BUCKETS];
+    uint32_t max;
+} kei_perf_hist_t;
+
+/**
+ * @brief Add a value to a histogram, safe to call from ISRs
+ */
+void kei_perf_add(kei_perf_hist_e hist, uint32_t value);
+
+/**
+ * @brief Add a consumer's backlog, in samples, at the time it read a sample
+ *
+ * @param reader Reader, see kei_perf_reader_register()
+ * @param depth Number of samples waiting, including the one read
+ */
+void kei_perf_add_depth(const kei_interface_reader_t *reader, uint32_t depth);
+
+/**
+ * @brief Track a reader's backlog under the given name
+ *
+ * Must be called after kei_interface_reader_init(). Readers that are not
+ * registered are counted together, as "other".
+ *
+ * @param reader Reader
+ * @param name Consumer name, must remain valid
+ */
+void kei_perf_reader_register(kei_interface_reader_t *reader, const char *name);
+
+/**
+ * @brief Get a copy of a histogram
+ */
+int kei_perf_get(kei_perf_hist_e hist, kei_perf_hist_t *out);
+
+/**
+ * @brief Clear all histograms, and the interface's capture and trigger
+ * statistics
+ */
+void kei_perf_reset(void);
+
+/**
+ * @brief Format a histogram compactly, as "<max>,<first bucket>,<count>,...",
+ * leaving out empty buckets at either end
+ *
+ * @return Length of string
+ */
+int kei_perf_format(const kei_perf_hist_t *hist, char *buf, size_t len);
+
+struct shell;
+/**
+ * @brief Handler for the 'kei perf' shell command
+ */
+int kei_perf_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
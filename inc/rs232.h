@@ -0,0 +1,52 @@
+#ifndef KEI_RS232_H
+#define KEI_RS232_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * RS-232 data output
+ *
+ * Every reading is sent out of uart_rs232 using the async UART API, either as
+ * fixed-width text lines like "+ 1.234E-09" (the instrument's digits, decimal
+ * point and exponent), or as binary frames identical to UDP stream datagrams
+ * (see stream.h). Readings are dropped, and counted, if the line (or, with
+ * flow control, the receiver) does not keep up.
+ *
+ * The text format is not that of any original printer. The 615 only presents
+ * its reading as BCD on the 50-pin printer connector, and the printers driven
+ * from it do their own formatting, so there is no ASCII line to be compatible
+ * with. Lines instead show the reading as the instrument's display does, so
+ * they can be checked against the front panel.
+ */
+
+typedef enum {
+    KEI_RS232_FORMAT_615 = 0, /**< Fixed-width text, one reading per line */
+    KEI_RS232_FORMAT_BINARY,  /**< kei_stream_hdr_t + kei_stream_rec_t frames */
+    KEI_RS232_FORMAT_MAX
+} kei_rs232_format_e;
+
+/**
+ * @brief Start RS-232 data output
+ */
+int kei_rs232_init(void);
+
+/**
+ * @brief Set output format
+ */
+int kei_rs232_set_format(kei_rs232_format_e format);
+
+/**
+ * @brief Configure line
+ *
+ * @param baud Baud rate
+ * @param flow_ctrl Whether to use RTS/CTS hardware flow control
+ */
+int kei_rs232_configure(uint32_t baud, bool flow_ctrl);
+
+/**
+ * @brief Get number of readings lost, by being dropped or missed
+ */
+uint32_t kei_rs232_get_lost(void);
+
+#endif
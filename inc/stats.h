@@ -0,0 +1,66 @@
+#ifndef KEI_STATS_H
+#define KEI_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+#define KEI_STATS_FLAG_PARTIAL (1U << 0) /**< Window was cut short by a range change */
+#define KEI_STATS_FLAG_FULL    (1U << 1) /**< Window was cut short at the most readings one can hold (65535) */
+
+/**< Statistics over one window of readings */
+typedef struct {
+    uint32_t index;     /**< Window number, incremented for every window completed */
+    uint32_t count;     /**< Number of readings included */
+    uint32_t overloads; /**< Number of overloaded readings, which are not included */
+    int8_t   range;     /**< Range (power) setting of readings in window */
+    uint8_t  flags;     /**< KEI_STATS_FLAG_* */
+    int32_t  mean;      /**< Mean, in micro-units */
+    int32_t  min;       /**< Minimum, in micro-units */
+    int32_t  max;       /**< Maximum, in micro-units */
+    uint64_t variance;  /**< Sample variance, in micro-units squared */
+    uint32_t stddev;    /**< Sample standard deviation, in micro-units */
+} kei_stats_t;
+
+/**
+ * @brief Add a sample to the running statistics
+ *
+ * @param sample Sample to add
+ */
+void kei_stats_push(const kei_interface_sample_t *sample);
+
+/**
+ * @brief Get statistics
+ *
+ * @param last Where to store statistics of the last completed window, may be NULL
+ * @param current Where to store statistics of the window in progress, may be NULL
+ *
+ * @return 0 on success, -1 if no window has been completed yet (last is
+ *         still filled in, with count 0)
+ */
+int kei_stats_get(kei_stats_t *last, kei_stats_t *current);
+
+/**
+ * @brief Set statistics window, discarding the window in progress
+ *
+ * Exactly one of samples and time_ms must be non-zero.
+ *
+ * @param samples Number of readings per window
+ * @param time_ms Duration of window, in milliseconds
+ */
+int kei_stats_set_window(uint32_t samples, uint32_t time_ms);
+
+/**
+ * @brief Reset statistics, discarding all windows
+ */
+void kei_stats_reset(void);
+
+struct shell;
+/**
+ * @brief Handler for the 'kei stats' shell command
+ */
+int kei_stats_cmd(const struct shell *sh, size_t argc, char **argv);
+
+#endif
+
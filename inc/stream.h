@@ -0,0 +1,100 @@
+#ifndef KEI_STREAM_H
+#define KEI_STREAM_H
+
+#include <stdint.h>
+
+#include <zephyr/toolchain.h>
+
+#include "interface.h"
+
+/*
+ * UDP streaming protocol
+ *
+ * A client subscribes by sending "SUB" to the streaming port, and is answered
+ * with "OK". From then on every reading is sent to the client's address, in
+ * datagrams consisting of a kei_stream_hdr_t followed by hdr.count
+ * kei_stream_rec_t records. The subscription lapses unless renewed within the
+ * lease time, or is ended early by sending "UNSUB". All fields are
+ * little-endian.
+ *
+ * "SUB <spec>" additionally sets a filter chain for the client, see filter.h,
+ * e.g. "SUB boxcar:8,decim:8". Records are then only sent as the chain
+ * produces output, and carry KEI_STREAM_RECFLAG_FILTERED.
+ *
+ * The spec may also hold change gate items, see gate.h, e.g.
+ * "SUB db:500,hb:10000", in which case readings are only sent as they change
+ * by more than the deadband, after filtering. Readings sent only because the
+ * heartbeat interval ran out carry KEI_STREAM_RECFLAG_HEARTBEAT.
+ *
+ * Subscribing with "SUBZ" or "SUBZ <spec>" instead gets datagrams with
+ * version KEI_STREAM_VERSION_CODEC, where the header is followed by a sample
+ * block as described in codec.h, rather than by records. The header count
+ * still gives the number of samples. Sample flags carry
+ * KEI_STREAM_RECFLAG_FILTERED, the block flags KEI_CODEC_FLAG_UTC.
+ */
+
+#define KEI_STREAM_MAGIC   0x364b /* "K6" */
+#define KEI_STREAM_VERSION       1
+#define KEI_STREAM_VERSION_CODEC 2 /**< Datagram holds a sample block rather than records */
+
+#define KEI_STREAM_RECFLAG_HEARTBEAT (1U << 5) /**< Reading unchanged, sent as the heartbeat interval ran out */
+#define KEI_STREAM_RECFLAG_FILTERED (1U << 6) /**< Value is the output of a filter chain */
+#define KEI_STREAM_RECFLAG_UTC      (1U << 7) /**< Timestamp is UTC, rather than time since boot */
+
+typedef struct __packed {
+    uint16_t magic;     /**< KEI_STREAM_MAGIC */
+    uint8_t  version;   /**< KEI_STREAM_VERSION */
+    uint8_t  count;     /**< Number of records following header */
+    uint32_t seq;       /**< Datagram sequence number, per subscriber */
+} kei_stream_hdr_t;
+
+typedef struct __packed {
+    uint32_t seq;         /**< Sample sequence number */
+    uint64_t timestamp;   /**< Time of sample, in microseconds */
+    int32_t  value;       /**< Value of reading, in micro-units */
+    int8_t   range;       /**< Range (power) setting */
+    uint8_t  sensitivity; /**< Sensitivity setting */
+    uint8_t  flags;       /**< KEI_DATAFLAG_* and KEI_STREAM_RECFLAG_* */
+    uint8_t  mode;        /**< kei_interface_mode_e the reading was converted for */
+} kei_stream_rec_t;
+
+typedef struct {
+    uint32_t records;       /**< Records sent */
+    uint32_t dgrams;        /**< Datagrams sent */
+    uint32_t send_errors;   /**< Datagrams that failed to send */
+    uint32_t pending_hwm;   /**< High-water mark of datagrams awaiting send */
+    uint32_t dropped;       /**< Records dropped for any subscriber */
+    uint32_t suppressed;    /**< Records held back by change gates, for any subscriber */
+    uint32_t missed;        /**< Samples missed by the streaming thread */
+    uint32_t subscribers;   /**< Current number of subscribers */
+    uint32_t first_ms;      /**< Uptime at which the first datagram was sent, 0 if none yet */
+} kei_stream_stats_t;
+
+/**
+ * @brief Start UDP streaming service
+ */
+int kei_stream_init(void);
+
+/**
+ * @brief Encode a sample into a stream record
+ *
+ * @param sample Sample to encode
+ * @param rec Where to store record
+ */
+void kei_stream_encode(const kei_interface_sample_t *sample, kei_stream_rec_t *rec);
+
+/**
+ * @brief Get number of records lost, by being dropped for a subscriber or
+ * missed altogether
+ */
+uint32_t kei_stream_get_lost(void);
+
+/**
+ * @brief Get streaming counters
+ *
+ * @param stats Where to store counters
+ */
+void kei_stream_get_stats(kei_stream_stats_t *stats);
+
+#endif
+
@@ -0,0 +1,84 @@
+#ifndef KEI_TIMEBASE_H
+#define KEI_TIMEBASE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Get current time, in hardware cycles since boot
+ *
+ * Safe to call from ISRs.
+ */
+uint64_t kei_time_cycles(void);
+
+/**
+ * @brief Extend a 32-bit cycle count to a full 64-bit timestamp
+ *
+ * Safe to call from ISRs.
+ *
+ * @param cycles Value of k_cycle_get_32(), captured no more than half a
+ *        counter wrap period ago
+ */
+uint64_t kei_time_extend(uint32_t cycles);
+
+typedef struct {
+    int32_t rate_ppb;     /**< Frequency correction of the cycle counter */
+    int32_t slew_ppb;     /**< Additional correction while slewing, 0 if not */
+    int64_t slew_left_ns; /**< Offset still to be slewed out */
+} kei_time_discipline_t;
+
+/**
+ * @brief Set the UTC reference for converting timestamps, stepping the time
+ * and ending any slew in progress
+ *
+ * @param cycles Timestamp, in cycles, at which utc_ns was valid
+ * @param utc_ns UTC time, in nanoseconds since the UNIX epoch
+ */
+void kei_time_set_utc(uint64_t cycles, uint64_t utc_ns);
+
+/**
+ * @brief Set the frequency correction of the cycle counter, from now on
+ *
+ * @param rate_ppb Correction, in parts per billion, positive if the counter
+ *        runs slow
+ */
+void kei_time_set_rate(int32_t rate_ppb);
+
+/**
+ * @brief Gradually correct the UTC time, rather than stepping it
+ *
+ * Replaces any slew still in progress. Timestamps stay monotonic.
+ *
+ * @param offset_ns Amount to advance the time by, negative to hold it back
+ * @param max_ppb Rate at which to correct, in parts per billion
+ */
+void kei_time_slew(int64_t offset_ns, uint32_t max_ppb);
+
+/**
+ * @brief Get the corrections currently applied to the cycle counter
+ *
+ * @param disc Where to store corrections
+ */
+void kei_time_get_discipline(kei_time_discipline_t *disc);
+
+/**
+ * @brief Convert a timestamp to UTC
+ *
+ * @param cycles Timestamp to convert, in cycles
+ * @param utc_us Where to store UTC time, in microseconds since the UNIX epoch
+ *
+ * @return 0 on success, -1 if no UTC reference has been set yet
+ */
+int kei_time_to_utc(uint64_t cycles, uint64_t *utc_us);
+
+/**
+ * @brief Convert a timestamp to UTC, in nanoseconds
+ *
+ * @param cycles Timestamp to convert, in cycles
+ * @param utc_ns Where to store UTC time, in nanoseconds since the UNIX epoch
+ *
+ * @return 0 on success, -1 if no UTC reference has been set yet
+ */
+int kei_time_to_utc_ns(uint64_t cycles, uint64_t *utc_ns);
+
+#endif
+
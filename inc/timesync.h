@@ -0,0 +1,54 @@
+#ifndef KEI_TIMESYNC_H
+#define KEI_TIMESYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * SNTP time discipline
+ *
+ * Polls the configured servers (CONFIG_KEI_TIMESYNC_SERVERS, or as set with
+ * 'kei_timesync servers') every CONFIG_KEI_TIMESYNC_POLL_S seconds, and keeps
+ * the timebase (see timebase.h) in step with the server that answered with
+ * the least round-trip delay. The first result, and any offset beyond
+ * CONFIG_KEI_TIMESYNC_STEP_MS, steps the time. Smaller offsets are slewed out
+ * at up to CONFIG_KEI_TIMESYNC_SLEW_PPM. The frequency error of the crystal
+ * is estimated from how far the server's time advanced against the cycle
+ * counter over recent polls, and corrected for continuously, so offsets stay
+ * small between polls.
+ */
+
+typedef struct {
+    bool     synced;       /**< Time has been set at least once */
+    int64_t  offset_ns;    /**< Offset of the last sample used, server minus local */
+    int64_t  delay_ns;     /**< Round-trip delay of the last sample used */
+    int32_t  rate_ppb;     /**< Frequency correction applied */
+    int64_t  slew_left_ns; /**< Offset still to be slewed out */
+    uint32_t last_ms;      /**< Uptime at which the last sample was used */
+    uint32_t polls;        /**< Requests sent */
+    uint32_t replies;      /**< Valid replies received */
+    uint32_t steps;        /**< Times the time was stepped */
+} kei_timesync_status_t;
+
+/**
+ * @brief Start the time discipline service
+ */
+int kei_timesync_init(void);
+
+/**
+ * @brief Set the servers to poll
+ *
+ * @param spec Space or comma separated list of "<IPv4 address>[:<port>]"
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int kei_timesync_set_servers(const char *spec);
+
+/**
+ * @brief Get discipline state
+ *
+ * @param status Where to store state
+ */
+void kei_timesync_get_status(kei_timesync_status_t *status);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef KEI_TXBUF_H
+#define KEI_TXBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Double-buffered serial output
+ *
+ * Shared by the USB and RS-232 data channels. The channel's thread fills one
+ * buffer while the transport sends the other, and buffers are only handed
+ * over once the transport is done with the previous one. Buffers hold either
+ * text, or a binary frame identical to a UDP stream datagram (see stream.h),
+ * whose header is filled in on handover. Switching between the two starts a
+ * new buffer.
+ */
+
+typedef struct kei_txbuf kei_txbuf_t;
+
+/**
+ * @brief Start sending a buffer, called on handover
+ *
+ * The transport must call kei_txbuf_done() once the buffer has been sent.
+ *
+ * @return 0 if sending started, -1 if it failed, in which case the samples
+ *         in the buffer are counted as lost
+ */
+typedef int (*kei_txbuf_send_t)(kei_txbuf_t *tx, const uint8_t *buf, size_t len);
+
+struct kei_txbuf {
+    uint8_t          *buf[2];
+    size_t            size;       /**< Size of each buffer */
+    size_t            len[2];
+    uint16_t          count[2];   /**< Samples in each buffer */
+    uint8_t           fill;       /**< Buffer being filled */
+    bool              binary;     /**< Whether buffer being filled holds a binary frame */
+    volatile bool     busy;       /**< Other buffer is being sent */
+    uint32_t          frame_seq;  /**< Sequence number of next binary frame */
+    kei_txbuf_send_t  send;
+
+    struct {
+        uint32_t samples;  /**< Samples queued for sending */
+        uint32_t dropped;  /**< Samples dropped as both buffers were full */
+        uint32_t failed;   /**< Samples lost as their buffer could not be sent */
+    } stats;
+};
+
+/**
+ * @brief Initialize buffers
+ *
+ * @param tx Buffers
+ * @param buf Storage for both buffers, 2 * size bytes
+ * @param size Size of each buffer, must fit a binary frame of one record
+ * @param binary Whether the first buffer holds a binary frame
+ * @param send Transport
+ */
+void kei_txbuf_init(kei_txbuf_t *tx, uint8_t *buf, size_t size, bool binary,
+                    kei_txbuf_send_t send);
+
+/**
+ * @brief Add an entry for one sample to the buffer being filled
+ *
+ * If it is full, the buffer is handed over first.
+ *
+ * @param tx Buffers
+ * @param binary Whether the entry is a kei_stream_rec_t rather than text
+ * @param entry Entry
+ * @param len Length of entry, at most the buffer size
+ *
+ * @return 0 on success, -1 if the sample was dropped as both buffers are full
+ */
+int kei_txbuf_add(kei_txbuf_t *tx, bool binary, const void *entry, size_t len);
+
+/**
+ * @brief Hand the buffer being filled over, if it holds any samples and the
+ * transport is idle
+ */
+void kei_txbuf_flush(kei_txbuf_t *tx);
+
+/**
+ * @brief Mark the buffer being sent as done, safe to call from ISRs
+ */
+void kei_txbuf_done(kei_txbuf_t *tx);
+
+/**
+ * @brief Get number of samples lost, by being dropped or in failed sends
+ */
+uint32_t kei_txbuf_get_lost(const kei_txbuf_t *tx);
+
+#endif
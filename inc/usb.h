@@ -1,7 +1,58 @@
 #ifndef KEI_USB_H
 #define KEI_USB_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * USB data channel
+ *
+ * Every reading is sent over the CDC ACM port while a host has it open (DTR
+ * set), either as binary frames identical to UDP stream datagrams (see
+ * stream.h), or as CSV lines "<seq>,<time>,<value>,<range>,<flags>", with
+ * fields as in kei_stream_rec_t. Readings are dropped, and counted, if the
+ * host does not keep up.
+ *
+ * A change gate (see gate.h) can hold back readings that did not change
+ * meaningfully. Readings let through only as a heartbeat carry
+ * KEI_STREAM_RECFLAG_HEARTBEAT.
+ */
+
+typedef enum {
+    KEI_USB_FORMAT_BINARY = 0, /**< kei_stream_hdr_t + kei_stream_rec_t frames */
+    KEI_USB_FORMAT_CSV,        /**< One line of text per reading */
+    KEI_USB_FORMAT_MAX
+} kei_usb_format_e;
+
+/**
+ * @brief Enable USB and start the data channel
+ */
 int kei_usb_init(void);
 
-#endif
+/**
+ * @brief Set data channel format
+ */
+int kei_usb_set_format(kei_usb_format_e format);
+
+/**
+ * @brief Get data channel format
+ */
+kei_usb_format_e kei_usb_get_format(void);
 
+/**
+ * @brief Set data channel change gate, see kei_gate_parse()
+ */
+int kei_usb_set_gate(const char *spec);
+
+/**
+ * @brief Format data channel change gate
+ */
+int kei_usb_get_gate(char *buf, size_t len);
+
+/**
+ * @brief Get number of readings lost while a host had the port open, by
+ * being dropped or missed
+ */
+uint32_t kei_usb_get_lost(void);
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#include "bench.h"
+#include "datalog.h"
+#include "emul615.h"
+#include "interface.h"
+#include "rs232.h"
+#include "stream.h"
+#include "usb.h"
+
+#define BENCH_RUNS_DEFAULT     1000
+#define BENCH_TRIG_RUNS        100
+#define BENCH_THROUGHPUT_S     2
+#define BENCH_SETTLE_MS        100
+
+/**< Accumulated results of one benchmark */
+typedef struct {
+    uint32_t n;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+} _bench_acc_t;
+
+static void _acc_init(_bench_acc_t *acc) {
+    memset(acc, 0, sizeof(*acc));
+    acc->min = UINT32_MAX;
+}
+
+static void _acc_add(_bench_acc_t *acc, uint32_t value) {
+    acc->n++;
+    acc->sum += value;
+    acc->min  = MIN(acc->min, value);
+    acc->max  = MAX(acc->max, value);
+}
+
+static void _acc_print(const struct shell *sh, const char *name, const _bench_acc_t *acc, const char *unit) {
+    if(!acc->n) {
+        shell_print(sh, "bench %s n=0", name);
+        return;
+    }
+    shell_print(sh, "bench %s n=%u min=%u mean=%u max=%u unit=%s", name, acc->n,
+                acc->min, (uint32_t)(acc->sum / acc->n), acc->max, unit);
+}
+
+/**
+ * @brief Time the PRINT ISR and decoding
+ */
+static int _bench_capture(const struct shell *sh, uint32_t runs) {
+    _bench_acc_t isr, capture, bcd, decode;
+    _acc_init(&isr);
+    _acc_init(&capture);
+    _acc_init(&bcd);
+    _acc_init(&decode);
+
+    for(uint32_t i = 0; i < runs; i++) {
+        kei_interface_benchcyc_t cyc;
+        kei_interface_bench_capture(&cyc);
+        _acc_add(&isr,     cyc.isr);
+        _acc_add(&capture, cyc.capture);
+        _acc_add(&bcd,     cyc.bcd);
+        _acc_add(&decode,  cyc.decode);
+    }
+
+    _acc_print(sh, "isr",     &isr,     "cyc");
+    _acc_print(sh, "capture", &capture, "cyc");
+    _acc_print(sh, "bcd",     &bcd,     "cyc");
+    _acc_print(sh, "decode",  &decode,  "cyc");
+
+    return 0;
+}
+
+/**
+ * @brief Time access to the most recent sample, and catching up on a backlog
+ * of samples
+ */
+static int _bench_read(const struct shell *sh, uint32_t runs) {
+    static const uint32_t depths[] = { 1, 4, 16, CONFIG_KEI_SAMPLE_BUF_LEN - 2 };
+
+    uint32_t head = kei_interface_get_seq();
+    if(!head) {
+        shell_print(sh, "No readings yet");
+        return -1;
+    }
+
+    _bench_acc_t acc;
+    kei_interface_sample_t sample;
+    kei_interface_data_t   data;
+
+    _acc_init(&acc);
+    for(uint32_t i = 0; i < runs; i++) {
+        uint32_t t0 = k_cycle_get_32();
+        kei_interface_get_sample(&sample);
+        _acc_add(&acc, k_cycle_get_32() - t0);
+    }
+    _acc_print(sh, "get_sample", &acc, "cyc");
+
+    /* In manual trigger mode this would time a reading, see 'trigger' */
+    if(kei_interface_get_trigmode() != KEI_TRIGMODE_MANUAL) {
+        _acc_init(&acc);
+        for(uint32_t i = 0; i < runs; i++) {
+            uint32_t t0 = k_cycle_get_32();
+            kei_interface_get_data(&data);
+            _acc_add(&acc, k_cycle_get_32() - t0);
+        }
+        _acc_print(sh, "get_data", &acc, "cyc");
+    }
+
+    for(unsigned d = 0; d < ARRAY_SIZE(depths); d++) {
+        char name[24];
+        snprintf(name, sizeof(name), "read_backlog_%u", depths[d]);
+
+        _acc_init(&acc);
+        for(uint32_t i = 0; (i < runs) && (depths[d] <= head); i++) {
+            kei_interface_reader_t reader;
+            kei_interface_reader_init(&reader);
+            reader.next = kei_interface_get_seq() - depths[d] + 1;
+
+            uint32_t count = 0;
+            uint32_t t0    = k_cycle_get_32();
+            while(!kei_interface_read(&reader, &sample)) {
+                count++;
+            }
+            if(count) {
+                _acc_add(&acc, (k_cycle_get_32() - t0) / count);
+            }
+        }
+        _acc_print(sh, name, &acc, "cyc");
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Time manual reads, from trigger to data
+ */
+static int _bench_trigger(const struct shell *sh, uint32_t runs) {
+    kei_interface_trigmode_e trigmode = kei_interface_get_trigmode();
+#ifdef CONFIG_KEI_EMUL615
+    uint32_t           emul_us;
+    kei_emul615_mode_e emul_mode = kei_emul615_get_mode(&emul_us);
+    kei_emul615_set_mode(KEI_EMUL615_MODE_TRIGGER, CONFIG_KEI_EMUL615_CONV_US);
+#endif
+    kei_interface_set_trigmode(KEI_TRIGMODE_MANUAL);
+
+    _bench_acc_t acc;
+    uint32_t     timeouts = 0;
+    _acc_init(&acc);
+
+    for(uint32_t i = 0; i < runs; i++) {
+        kei_interface_data_t data;
+
+        uint32_t t0 = k_cycle_get_32();
+        if(kei_interface_get_data(&data)) {
+            timeouts++;
+            continue;
+        }
+        _acc_add(&acc, k_cyc_to_us_floor32(k_cycle_get_32() - t0));
+    }
+
+    kei_interface_set_trigmode(trigmode);
+#ifdef CONFIG_KEI_EMUL615
+    kei_emul615_set_mode(emul_mode, emul_us);
+#endif
+
+    _acc_print(sh, "trigger_latency", &acc, "us");
+    shell_print(sh, "bench trigger_timeouts count=%u", timeouts);
+
+    return 0;
+}
+
+#ifdef CONFIG_KEI_EMUL615
+static uint32_t _lost_capture(void) {
+    kei_interface_capstats_t stats;
+    kei_interface_get_capstats(&stats);
+    return stats.dropped + stats.torn;
+}
+
+static uint32_t _lost_log(void) {
+    kei_datalog_info_t info;
+    if(kei_datalog_get_info(&info)) {
+        return 0;
+    }
+    return info.missed;
+}
+
+/**< Output paths, and how to find out how many readings each has lost */
+static const struct {
+    const char *name;
+    uint32_t  (*lost)(void);
+} _paths[] = {
+    { "capture", _lost_capture },
+    { "log",     _lost_log },
+    { "usb",     kei_usb_get_lost },
+    { "stream",  kei_stream_get_lost },
+#ifdef CONFIG_KEI_RS232
+    { "rs232",   kei_rs232_get_lost },
+#endif
+};
+
+/**
+ * @brief Find the reading rate each output path carries without losing
+ * readings, by stepping up the emulated instrument's rate
+ */
+static int _bench_throughput(const struct shell *sh, uint32_t seconds) {
+    static const uint32_t rates[] = { 24, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+
+    uint32_t max_rate[ARRAY_SIZE(_paths)] = { 0 };
+    bool     failed[ARRAY_SIZE(_paths)]   = { false };
+
+    kei_interface_trigmode_e trigmode = kei_interface_get_trigmode();
+    uint32_t                 emul_us;
+    kei_emul615_mode_e       emul_mode = kei_emul615_get_mode(&emul_us);
+    kei_interface_set_trigmode(KEI_TRIGMODE_FREERUNNING);
+
+    for(unsigned r = 0; r < ARRAY_SIZE(rates); r++) {
+        uint32_t lost[ARRAY_SIZE(_paths)];
+        char     line[128];
+        int      len;
+
+        kei_emul615_set_mode(KEI_EMUL615_MODE_FREE, 1000000 / rates[r]);
+        k_msleep(BENCH_SETTLE_MS);
+
+        for(unsigned p = 0; p < ARRAY_SIZE(_paths); p++) {
+            lost[p] = _paths[p].lost();
+        }
+        uint32_t seq = kei_interface_get_seq();
+
+        k_msleep(seconds * 1000);
+
+        uint32_t got = (kei_interface_get_seq() - seq) / seconds;
+        len = snprintf(line, sizeof(line), "bench throughput rate=%u got=%u", rates[r], got);
+
+        for(unsigned p = 0; p < ARRAY_SIZE(_paths); p++) {
+            lost[p] = _paths[p].lost() - lost[p];
+            len    += snprintf(&line[len], sizeof(line) - MIN((size_t)len, sizeof(line)), " %s=%u",
+                               _paths[p].name, lost[p]);
+
+            /* A path only counts as keeping up if the instrument did too */
+            if(!failed[p] && !lost[p] && (got >= ((rates[r] * 9) / 10))) {
+                max_rate[p] = rates[r];
+            } else {
+                failed[p] = true;
+            }
+        }
+        shell_print(sh, "%s", line);
+    }
+
+    kei_emul615_set_mode(emul_mode, emul_us);
+    kei_interface_set_trigmode(trigmode);
+
+    for(unsigned p = 0; p < ARRAY_SIZE(_paths); p++) {
+        shell_print(sh, "bench max_rate path=%s hz=%u", _paths[p].name, max_rate[p]);
+    }
+
+    return 0;
+}
+#endif
+
+int kei_bench_cmd(const struct shell *sh, size_t argc, char **argv) {
+    if(argc > 3) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    uint32_t arg = 0;
+    if(argc == 3) {
+        char *end;
+        arg = strtoul(argv[2], &end, 10);
+        if(*end || !arg) {
+            shell_print(sh, "Invalid count");
+            return -1;
+        }
+    }
+
+    shell_print(sh, "bench clock hz=%u", sys_clock_hw_cycles_per_sec());
+
+    if(argc == 1) {
+        int ret = _bench_capture(sh, BENCH_RUNS_DEFAULT) |
+                  _bench_read(sh, BENCH_RUNS_DEFAULT) |
+                  _bench_trigger(sh, BENCH_TRIG_RUNS);
+#ifdef CONFIG_KEI_EMUL615
+        ret |= _bench_throughput(sh, BENCH_THROUGHPUT_S);
+#endif
+        return ret;
+    }
+
+    if(!strcmp(argv[1], "capture")) {
+        return _bench_capture(sh, arg ? arg : BENCH_RUNS_DEFAULT);
+    } else if(!strcmp(argv[1], "read")) {
+        return _bench_read(sh, arg ? arg : BENCH_RUNS_DEFAULT);
+    } else if(!strcmp(argv[1], "trigger")) {
+        return _bench_trigger(sh, arg ? arg : BENCH_TRIG_RUNS);
+#ifdef CONFIG_KEI_EMUL615
+    } else if(!strcmp(argv[1], "throughput")) {
+        return _bench_throughput(sh, arg ? arg : BENCH_THROUGHPUT_S);
+#endif
+    }
+
+    shell_print(sh, "Unknown benchmark");
+    return -1;
+}
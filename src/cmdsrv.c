@@ -0,0 +1,825 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+
+#include "cmdsrv.h"
+#include "datalog.h"
+#include "event.h"
+#include "filter.h"
+#include "interface.h"
+#include "net.h"
+#include "perf.h"
+#include "stats.h"
+#include "stream.h"
+#include "timesync.h"
+
+LOG_MODULE_REGISTER(kei_cmdsrv);
+
+#define CMDSRV_RX_LEN   128 /**< Receive buffer size, also maximum command length */
+#define CMDSRV_TX_LEN   512 /**< Transmit buffer size */
+#define CMDSRV_RESP_MAX 128 /**< Maximum length of a single response */
+#define CMDSRV_WAIT_MS    2 /**< Poll interval while a client waits for a reading */
+
+#define CMDSRV_DEFERRED   1 /**< Handler result, response is sent once the command completes */
+
+typedef struct {
+    int      sock;                   /**< Client socket, -1 if unused */
+    size_t   rx_len;
+    size_t   tx_len;
+    char     rx[CMDSRV_RX_LEN];
+    char     tx[CMDSRV_TX_LEN];
+
+    /* Binary block transfer of data log pages or event records, in
+     * progress while left != 0 */
+    struct {
+        int    (*read)(uint32_t rec, size_t off, void *buf, size_t len);
+        size_t   rec_size;           /**< Size of each page or record */
+        uint32_t rec;                /**< Page number or event number being sent */
+        size_t   off;                /**< Offset into page or record */
+        size_t   left;               /**< Bytes left to send, including final newline */
+    } bulk;
+
+    /* READ? waiting for a triggered reading, answered from the poll loop
+     * once it is published, so other clients are not held up meanwhile */
+    struct {
+        bool     pending;
+        uint32_t seq;                /**< Sequence number the reading will be newer than */
+        int64_t  deadline;           /**< Uptime at which to give up, in ms */
+    } read;
+} _cmdsrv_client_t;
+
+static struct {
+    int               listen_sock;
+    _cmdsrv_client_t  clients[CONFIG_KEI_CMDSRV_MAX_CLIENTS];
+    _cmdsrv_client_t *current;       /**< Client whose command is being executed */
+    kei_cmdsrv_stats_t stats;
+} _cmdsrv = {
+    .listen_sock = -1
+};
+
+int kei_cmdsrv_init(void) {
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(CONFIG_KEI_CMDSRV_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    for(unsigned i = 0; i < CONFIG_KEI_CMDSRV_MAX_CLIENTS; i++) {
+        _cmdsrv.clients[i].sock = -1;
+    }
+
+    _cmdsrv.listen_sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(_cmdsrv.listen_sock < 0) {
+        LOG_ERR("Failed to create socket: %d", errno);
+        return -1;
+    }
+
+    if(zsock_bind(_cmdsrv.listen_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+       zsock_listen(_cmdsrv.listen_sock, 2)) {
+        LOG_ERR("Failed to listen: %d", errno);
+        zsock_close(_cmdsrv.listen_sock);
+        _cmdsrv.listen_sock = -1;
+        return -1;
+    }
+
+    zsock_fcntl(_cmdsrv.listen_sock, F_SETFL, O_NONBLOCK);
+
+    LOG_INF("Command server on TCP port %u", CONFIG_KEI_CMDSRV_PORT);
+
+    return 0;
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+/* Each handler writes its response, without line ending, to resp. Returning
+ * CMDSRV_DEFERRED leaves the response to be sent later, other non-zero values
+ * indicate failure, with resp containing the reason. */
+typedef int (*_cmdsrv_hdlr_t)(const char *arg, char *resp, size_t len);
+
+static const char _mode_chars[KEI_MODE_MAX] = {
+    [KEI_MODE_NONE]     = 'N',
+    [KEI_MODE_VOLTS]    = 'V',
+    [KEI_MODE_OHMS]     = 'O',
+    [KEI_MODE_COULOMBS] = 'C',
+    [KEI_MODE_AMPERES]  = 'A'
+};
+
+static const char _trigmode_chars[KEI_TRIGMODE_MAX] = {
+    [KEI_TRIGMODE_NONE]        = 'N',
+    [KEI_TRIGMODE_FREERUNNING] = 'F',
+    [KEI_TRIGMODE_PERIODIC]    = 'P',
+    [KEI_TRIGMODE_MANUAL]      = 'M',
+    [KEI_TRIGMODE_CHAINED]     = 'C'
+};
+
+static int _cmd_idn(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    snprintf(resp, len, "KEITHLEY,615,NETIF,0");
+    return 0;
+}
+
+/**
+ * @brief Format a micro-unit value and range as a SCPI numeric value
+ */
+static int _fmt_value(char *buf, size_t len, int32_t value, int range) {
+    unsigned abs = (value < 0) ? -value : value;
+    return snprintf(buf, len, "%c%u.%06uE%+d",
+                    (value < 0) ? '-' : '+',
+                    abs / 1000000, abs % 1000000, range);
+}
+
+/**
+ * @brief Format the most recent reading as READ? response
+ */
+static int _cmd_read_latest(char *resp, size_t len) {
+    kei_interface_sample_t sample;
+    if(kei_interface_get_sample(&sample)) {
+        snprintf(resp, len, "no data");
+        return -1;
+    }
+
+    if(sample.data.flags & KEI_DATAFLAG_OVERLOAD) {
+        /* SCPI convention for an overflowed measurement */
+        snprintf(resp, len, "+9.9E37");
+        return 0;
+    }
+
+    _fmt_value(resp, len, sample.data.value, sample.data.range);
+    return 0;
+}
+
+static int _cmd_read(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    if(kei_interface_get_trigmode() != KEI_TRIGMODE_MANUAL) {
+        return _cmd_read_latest(resp, len);
+    }
+
+    /* Waiting for the conversion here would stall every client */
+    _cmdsrv_client_t *client = _cmdsrv.current;
+    if(kei_interface_trigger(&client->read.seq)) {
+        snprintf(resp, len, "trigger failed");
+        return -1;
+    }
+    client->read.pending  = true;
+    client->read.deadline = k_uptime_get() + KEI_TRIG_WAIT_MS;
+
+    return CMDSRV_DEFERRED;
+}
+
+static int _cmd_filt(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_interface_sample_t sample;
+    if(kei_filter_get(&sample)) {
+        snprintf(resp, len, "no data");
+        return -1;
+    }
+
+    if(sample.data.flags & KEI_DATAFLAG_OVERLOAD) {
+        snprintf(resp, len, "+9.9E37");
+        return 0;
+    }
+
+    _fmt_value(resp, len, sample.data.value, sample.data.range);
+    return 0;
+}
+
+static int _cmd_filtspec_get(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_filter_get_spec(resp, len);
+    return 0;
+}
+
+static int _cmd_filtspec_set(const char *arg, char *resp, size_t len) {
+    if(kei_filter_set(arg)) {
+        snprintf(resp, len, "invalid filter spec");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Start a block transfer of consecutive pages or records
+ */
+static void _cmd_bulk_start(int (*read)(uint32_t, size_t, void *, size_t), size_t rec_size,
+                            uint32_t first, uint32_t count, char *resp, size_t len) {
+    /* IEEE 488.2 definite length block, "#<digits><length><data>" */
+    char   size_str[12];
+    size_t size = count * rec_size;
+    int    n    = snprintf(size_str, sizeof(size_str), "%u", (unsigned)size);
+    snprintf(resp, len, "#%d%s", n, size_str);
+
+    _cmdsrv_client_t *client = _cmdsrv.current;
+    client->bulk.read     = read;
+    client->bulk.rec_size = rec_size;
+    client->bulk.rec      = first;
+    client->bulk.off      = 0;
+    client->bulk.left     = size + 1;
+}
+
+static int _cmd_logdump(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_datalog_info_t info;
+    if(kei_datalog_get_info(&info)) {
+        snprintf(resp, len, "log unavailable");
+        return -1;
+    }
+
+    _cmd_bulk_start(kei_datalog_read, KEI_DATALOG_PAGE_SIZE, info.oldest, info.used, resp, len);
+    return 0;
+}
+
+#if (CONFIG_KEI_EVENT)
+static int _cmd_event(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_event_info_t info;
+    kei_event_get_info(&info);
+
+    /* <armed>,<events since boot>,<oldest held>,<held> */
+    snprintf(resp, len, "%u,%u,%u,%u", info.armed, info.events, info.oldest, info.held);
+    return 0;
+}
+
+static int _cmd_event_dump(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_event_info_t info;
+    kei_event_get_info(&info);
+
+    _cmd_bulk_start(kei_event_read, KEI_EVENT_RECORD_SIZE, info.oldest, info.held, resp, len);
+    return 0;
+}
+
+static int _cmd_event_trig_get(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_event_get_spec(resp, len);
+    return 0;
+}
+
+static int _cmd_event_trig_set(const char *arg, char *resp, size_t len) {
+    if(kei_event_set(arg)) {
+        snprintf(resp, len, "invalid trigger spec");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _cmd_event_arm(const char *arg, char *resp, size_t len) {
+    if(strcmp(arg, "0") && strcmp(arg, "1")) {
+        snprintf(resp, len, "use EVENT:ARM 0|1");
+        return -1;
+    }
+
+    kei_event_arm(arg[0] == '1');
+    return 0;
+}
+
+static int _cmd_event_force(const char *arg, char *resp, size_t len) {
+    if(strcmp(arg, "1")) {
+        snprintf(resp, len, "use EVENT:FORCE 1");
+        return -1;
+    }
+
+    if(kei_event_force()) {
+        snprintf(resp, len, "record being collected");
+        return -1;
+    }
+    return 0;
+}
+
+static int _cmd_event_clear(const char *arg, char *resp, size_t len) {
+    if(strcmp(arg, "1")) {
+        snprintf(resp, len, "use EVENT:CLEAR 1");
+        return -1;
+    }
+
+    kei_event_clear();
+    return 0;
+}
+#endif
+
+static int _cmd_stat(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_stats_t stats;
+    if(kei_stats_get(&stats, NULL)) {
+        snprintf(resp, len, "no window completed");
+        return -1;
+    }
+
+    /* <window>,<count>,<mean>,<variance>,<min>,<max> */
+    int off = snprintf(resp, len, "%u,%u,", stats.index, stats.count);
+    off += _fmt_value(&resp[off], len - off, stats.mean, stats.range);
+    off += snprintf(&resp[off], len - off, ",%lluE%+d,",
+                    (unsigned long long)stats.variance, (2 * stats.range) - 12);
+    off += _fmt_value(&resp[off], len - off, stats.min, stats.range);
+    off += snprintf(&resp[off], len - off, ",");
+    _fmt_value(&resp[off], len - off, stats.max, stats.range);
+    return 0;
+}
+
+static int _cmd_perf(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_interface_capstats_t  cap;
+    kei_interface_trigstats_t trig;
+    kei_interface_get_capstats(&cap);
+    kei_interface_get_trigstats(&trig);
+
+    /* <cycles per second>,<captured>,<dropped>,<torn>,<retries>,<trigger timeouts> */
+    snprintf(resp, len, "%u,%u,%u,%u,%u,%u", sys_clock_hw_cycles_per_sec(),
+             cap.captured, cap.dropped, cap.torn, cap.retries, trig.timeouts);
+    return 0;
+}
+
+static int _cmd_netboot(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    static const char src_chars[KEI_NET_ADDR_MAX] = {
+        [KEI_NET_ADDR_NONE]   = 'N',
+        [KEI_NET_ADDR_CACHED] = 'C',
+        [KEI_NET_ADDR_STATIC] = 'S',
+        [KEI_NET_ADDR_DHCP]   = 'D',
+    };
+
+    kei_net_boot_t     boot;
+    kei_stream_stats_t stream;
+    kei_net_get_boot(&boot);
+    kei_stream_get_stats(&stream);
+
+    /* <source>,<address ms>,<services ms>,<DHCP ms>,<first datagram ms> */
+    snprintf(resp, len, "%c,%u,%u,%u,%u", src_chars[boot.source], boot.addr_ms,
+             boot.services_ms, boot.dhcp_ms, stream.first_ms);
+    return 0;
+}
+
+#if (CONFIG_KEI_TIMESYNC)
+static int _cmd_timesync(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    kei_timesync_status_t status;
+    kei_timesync_get_status(&status);
+
+    /* <synced>,<offset ns>,<delay ns>,<frequency ppb>,<ms since update> */
+    snprintf(resp, len, "%u,%lld,%lld,%d,%u", status.synced, (long long)status.offset_ns,
+             (long long)status.delay_ns, status.rate_ppb, k_uptime_get_32() - status.last_ms);
+    return 0;
+}
+#endif
+
+/**
+ * @brief Format one histogram, see kei_perf_format()
+ */
+static int _cmd_perf_hist(kei_perf_hist_e which, char *resp, size_t len) {
+    kei_perf_hist_t hist;
+    if(kei_perf_get(which, &hist)) {
+        return -1;
+    }
+
+    kei_perf_format(&hist, resp, len);
+    return 0;
+}
+
+static int _cmd_perf_isr(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+    return _cmd_perf_hist(KEI_PERF_ISR, resp, len);
+}
+
+static int _cmd_perf_trig(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+    return _cmd_perf_hist(KEI_PERF_TRIG, resp, len);
+}
+
+static int _cmd_perf_age(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+    return _cmd_perf_hist(KEI_PERF_AGE, resp, len);
+}
+
+static int _cmd_perf_reset(const char *arg, char *resp, size_t len) {
+    if(strcmp(arg, "1")) {
+        snprintf(resp, len, "use PERF:RESET 1");
+        return -1;
+    }
+
+    kei_perf_reset();
+    return 0;
+}
+
+static int _cmd_mode_get(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    snprintf(resp, len, "%c", _mode_chars[kei_interface_get_mode()]);
+    return 0;
+}
+
+static int _cmd_mode_set(const char *arg, char *resp, size_t len) {
+    for(kei_interface_mode_e mode = KEI_MODE_VOLTS; mode < KEI_MODE_MAX; mode++) {
+        if((arg[0] == _mode_chars[mode]) && (arg[1] == '\0')) {
+            return kei_interface_set_mode(mode);
+        }
+    }
+
+    snprintf(resp, len, "unsupported mode");
+    return -1;
+}
+
+static int _cmd_trigmode_get(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    snprintf(resp, len, "%c", _trigmode_chars[kei_interface_get_trigmode()]);
+    return 0;
+}
+
+static int _cmd_trigmode_set(const char *arg, char *resp, size_t len) {
+    for(kei_interface_trigmode_e mode = KEI_TRIGMODE_FREERUNNING; mode < KEI_TRIGMODE_MAX; mode++) {
+        if((arg[0] == _trigmode_chars[mode]) && (arg[1] == '\0')) {
+            if(kei_interface_set_trigmode(mode)) {
+                snprintf(resp, len, "failed to set mode");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    snprintf(resp, len, "unsupported mode");
+    return -1;
+}
+
+static int _cmd_trigper_get(const char *arg, char *resp, size_t len) {
+    ARG_UNUSED(arg);
+
+    snprintf(resp, len, "%u", kei_interface_get_trigperiod());
+    return 0;
+}
+
+static int _cmd_trigper_set(const char *arg, char *resp, size_t len) {
+    if(!isdigit((int)arg[0])) {
+        snprintf(resp, len, "period must be a number");
+        return -1;
+    }
+
+    if(kei_interface_set_trigperiod(strtoul(arg, NULL, 10))) {
+        snprintf(resp, len, "invalid period");
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char     *name;
+    _cmdsrv_hdlr_t  query; /**< Handler for "<name>?" */
+    _cmdsrv_hdlr_t  set;   /**< Handler for "<name> <arg>" */
+} _cmdsrv_cmds[] = {
+    { "*IDN",        _cmd_idn,            NULL                },
+    { "READ",        _cmd_read,           NULL                },
+    { "STAT",        _cmd_stat,           NULL                },
+    { "FILT",        _cmd_filt,           NULL                },
+    { "FILT:SPEC",   _cmd_filtspec_get,   _cmd_filtspec_set   },
+    { "LOG:DUMP",    _cmd_logdump,        NULL                },
+#if (CONFIG_KEI_EVENT)
+    { "EVENT",       _cmd_event,          NULL                },
+    { "EVENT:DUMP",  _cmd_event_dump,     NULL                },
+    { "EVENT:TRIG",  _cmd_event_trig_get, _cmd_event_trig_set },
+    { "EVENT:ARM",   NULL,                _cmd_event_arm      },
+    { "EVENT:FORCE", NULL,                _cmd_event_force    },
+    { "EVENT:CLEAR", NULL,                _cmd_event_clear    },
+#endif
+    { "PERF",        _cmd_perf,           NULL                },
+    { "PERF:ISR",    _cmd_perf_isr,       NULL                },
+    { "PERF:TRIG",   _cmd_perf_trig,      NULL                },
+    { "PERF:AGE",    _cmd_perf_age,       NULL                },
+    { "PERF:RESET",  NULL,                _cmd_perf_reset     },
+    { "NET:BOOT",    _cmd_netboot,        NULL                },
+#if (CONFIG_KEI_TIMESYNC)
+    { "TIME:SYNC",   _cmd_timesync,       NULL                },
+#endif
+    { "MODE",        _cmd_mode_get,       _cmd_mode_set       },
+    { "TRIG:MODE",   _cmd_trigmode_get,   _cmd_trigmode_set   },
+    { "TRIG:PER",    _cmd_trigper_get,    _cmd_trigper_set    },
+};
+
+/**
+ * @brief Append a command's response to the client's transmit buffer
+ */
+static void _cmdsrv_respond(_cmdsrv_client_t *client, int ret, const char *resp) {
+    /* A block transfer is terminated by a newline once all data is sent */
+    int len = snprintf(&client->tx[client->tx_len], CMDSRV_TX_LEN - client->tx_len, "%s%s%s",
+                       ret ? "ERR " : "", (!ret && !resp[0]) ? "OK" : resp,
+                       client->bulk.left ? "" : "\n");
+    client->tx_len += MIN(len, (int)(CMDSRV_TX_LEN - client->tx_len - 1));
+
+    _cmdsrv.stats.commands++;
+    if(ret) {
+        _cmdsrv.stats.failed++;
+    }
+}
+
+/**
+ * @brief Execute a single command, appending its response to the client's
+ * transmit buffer unless it is deferred
+ */
+static void _cmdsrv_exec(_cmdsrv_client_t *client, char *cmd) {
+    char  resp[CMDSRV_RESP_MAX] = "";
+    int   ret = -1;
+
+    /* Commands are case-insensitive, arguments are not */
+    char *arg = cmd;
+    for(; *arg && !isspace((int)*arg); arg++) {
+        *arg = toupper((int)*arg);
+    }
+    if(*arg) {
+        *arg++ = '\0';
+        while(isspace((int)*arg)) {
+            arg++;
+        }
+    }
+
+    size_t namelen = strlen(cmd);
+    bool   query   = namelen && (cmd[namelen - 1] == '?');
+    if(query) {
+        cmd[--namelen] = '\0';
+    }
+
+    snprintf(resp, sizeof(resp), "unknown command");
+    for(unsigned i = 0; i < ARRAY_SIZE(_cmdsrv_cmds); i++) {
+        if(strcmp(cmd, _cmdsrv_cmds[i].name)) {
+            continue;
+        }
+
+        _cmdsrv_hdlr_t hdlr = query ? _cmdsrv_cmds[i].query : _cmdsrv_cmds[i].set;
+        if(!hdlr || (query && *arg) || (!query && !*arg)) {
+            snprintf(resp, sizeof(resp), "invalid usage");
+        } else {
+            resp[0] = '\0';
+            _cmdsrv.current = client;
+            ret = hdlr(arg, resp, sizeof(resp));
+            if(ret == CMDSRV_DEFERRED) {
+                return;
+            }
+            if(ret && !resp[0]) {
+                snprintf(resp, sizeof(resp), "failed");
+            }
+        }
+        break;
+    }
+
+    _cmdsrv_respond(client, ret, resp);
+}
+
+/**
+ * @brief Answer the client's pending READ?, once its reading came in or
+ * timed out
+ */
+static void _cmdsrv_read_poll(_cmdsrv_client_t *client) {
+    char resp[CMDSRV_RESP_MAX];
+    int  ret;
+
+    if(!client->read.pending) {
+        return;
+    }
+
+    if((int32_t)(kei_interface_get_seq() - client->read.seq) > 0) {
+        ret = _cmd_read_latest(resp, sizeof(resp));
+    } else if(k_uptime_get() >= client->read.deadline) {
+        snprintf(resp, sizeof(resp), "no data");
+        ret = -1;
+    } else {
+        return;
+    }
+
+    client->read.pending = false;
+    _cmdsrv_respond(client, ret, resp);
+}
+
+/**
+ * @brief Execute all complete commands in the client's receive buffer, as
+ * long as there is room for their responses, and no earlier response is
+ * outstanding
+ */
+static void _cmdsrv_process(_cmdsrv_client_t *client) {
+    size_t start = 0;
+
+    for(size_t i = 0; (i < client->rx_len) && !client->bulk.left && !client->read.pending; i++) {
+        if((client->rx[i] != '\n') && (client->rx[i] != ';')) {
+            continue;
+        }
+        if((CMDSRV_TX_LEN - client->tx_len) < (CMDSRV_RESP_MAX + 5)) {
+            break;
+        }
+
+        client->rx[i] = '\0';
+
+        char *cmd = &client->rx[start];
+        while(isspace((int)*cmd)) {
+            cmd++;
+        }
+        char *end = &client->rx[i];
+        while((end > cmd) && isspace((int)end[-1])) {
+            *--end = '\0';
+        }
+
+        if(*cmd) {
+            _cmdsrv_exec(client, cmd);
+        }
+
+        start = i + 1;
+    }
+
+    if(start) {
+        memmove(client->rx, &client->rx[start], client->rx_len - start);
+        client->rx_len -= start;
+    }
+}
+
+/**
+ * @brief Fill the client's transmit buffer with data of the block transfer in
+ * progress, a page or record at a time
+ */
+static void _cmdsrv_bulk_fill(_cmdsrv_client_t *client) {
+    while(client->bulk.left && (client->tx_len < CMDSRV_TX_LEN)) {
+        if(client->bulk.left == 1) {
+            client->tx[client->tx_len++] = '\n';
+            client->bulk.left            = 0;
+            break;
+        }
+
+        size_t n = MIN(CMDSRV_TX_LEN - client->tx_len, client->bulk.rec_size - client->bulk.off);
+        if(client->bulk.read(client->bulk.rec, client->bulk.off, &client->tx[client->tx_len], n)) {
+            /* Keep the block length intact, the host rejects the page by its header */
+            memset(&client->tx[client->tx_len], 0xff, n);
+        }
+
+        client->tx_len    += n;
+        client->bulk.left -= n;
+        client->bulk.off  += n;
+        if(client->bulk.off >= client->bulk.rec_size) {
+            client->bulk.rec++;
+            client->bulk.off = 0;
+        }
+    }
+}
+
+static void _cmdsrv_close(_cmdsrv_client_t *client) {
+    zsock_close(client->sock);
+    client->sock = -1;
+}
+
+static void _cmdsrv_accept(void) {
+    struct sockaddr_in addr;
+    socklen_t          addrlen = sizeof(addr);
+
+    int sock = zsock_accept(_cmdsrv.listen_sock, (struct sockaddr *)&addr, &addrlen);
+    if(sock < 0) {
+        return;
+    }
+
+    for(unsigned i = 0; i < CONFIG_KEI_CMDSRV_MAX_CLIENTS; i++) {
+        _cmdsrv_client_t *client = &_cmdsrv.clients[i];
+        if(client->sock < 0) {
+            zsock_fcntl(sock, F_SETFL, O_NONBLOCK);
+            client->sock      = sock;
+            client->rx_len    = 0;
+            client->tx_len    = 0;
+            client->bulk.left = 0;
+            client->read.pending = false;
+            _cmdsrv.stats.accepted++;
+            return;
+        }
+    }
+
+    LOG_WRN("Too many clients");
+    _cmdsrv.stats.rejected++;
+    zsock_close(sock);
+}
+
+void kei_cmdsrv_get_stats(kei_cmdsrv_stats_t *stats) {
+    *stats = _cmdsrv.stats;
+
+    stats->clients = 0;
+    for(unsigned i = 0; i < CONFIG_KEI_CMDSRV_MAX_CLIENTS; i++) {
+        if(_cmdsrv.clients[i].sock >= 0) {
+            stats->clients++;
+        }
+    }
+}
+
+void kei_cmdsrv_poll(int timeout_ms) {
+    if(_cmdsrv.listen_sock < 0) {
+        k_msleep(timeout_ms);
+        return;
+    }
+
+    struct zsock_pollfd fds[CONFIG_KEI_CMDSRV_MAX_CLIENTS + 1];
+    int                 nfds = 0;
+    bool                wait = false;
+
+    fds[nfds].fd     = _cmdsrv.listen_sock;
+    fds[nfds].events = ZSOCK_POLLIN;
+    nfds++;
+
+    for(unsigned i = 0; i < CONFIG_KEI_CMDSRV_MAX_CLIENTS; i++) {
+        _cmdsrv_client_t *client = &_cmdsrv.clients[i];
+        if(client->sock < 0) {
+            continue;
+        }
+
+        fds[nfds].fd     = client->sock;
+        fds[nfds].events = 0;
+        /* Stop reading while the client is not taking its responses */
+        if(client->rx_len < CMDSRV_RX_LEN) {
+            fds[nfds].events |= ZSOCK_POLLIN;
+        }
+        if(client->tx_len) {
+            fds[nfds].events |= ZSOCK_POLLOUT;
+        }
+        wait |= client->read.pending;
+        nfds++;
+    }
+
+    /* Readings are not signalled through the sockets, so keep checking for
+     * them while a client waits for one */
+    int ready = zsock_poll(fds, nfds, wait ? MIN(timeout_ms, CMDSRV_WAIT_MS) : timeout_ms);
+    if((ready < 0) || (!ready && !wait)) {
+        return;
+    }
+
+    if(ready && (fds[0].revents & ZSOCK_POLLIN)) {
+        _cmdsrv_accept();
+    }
+
+    for(int f = 1; f < nfds; f++) {
+        _cmdsrv_client_t *client = NULL;
+        for(unsigned i = 0; i < CONFIG_KEI_CMDSRV_MAX_CLIENTS; i++) {
+            if(_cmdsrv.clients[i].sock == fds[f].fd) {
+                client = &_cmdsrv.clients[i];
+                break;
+            }
+        }
+        if(!client) {
+            continue;
+        }
+
+        short revents = ready ? fds[f].revents : 0;
+        if(revents & ZSOCK_POLLIN) {
+            ssize_t len = zsock_recv(client->sock, &client->rx[client->rx_len],
+                                     CMDSRV_RX_LEN - client->rx_len, 0);
+            if((len < 0) && (errno == EAGAIN)) {
+                len = 0;
+            } else if(len <= 0) {
+                _cmdsrv_close(client);
+                continue;
+            }
+            client->rx_len += len;
+        } else if(revents & (ZSOCK_POLLERR | ZSOCK_POLLHUP)) {
+            _cmdsrv_close(client);
+            continue;
+        }
+
+        _cmdsrv_read_poll(client);
+        _cmdsrv_process(client);
+        _cmdsrv_bulk_fill(client);
+
+        if((client->rx_len == CMDSRV_RX_LEN) &&
+           (client->tx_len == 0) && !client->read.pending) {
+            /* Receive buffer full without a complete command */
+            LOG_WRN("Command too long");
+            _cmdsrv_close(client);
+            continue;
+        }
+
+        if(client->tx_len) {
+            if(client->tx_len > _cmdsrv.stats.tx_hwm) {
+                _cmdsrv.stats.tx_hwm = client->tx_len;
+            }
+
+            ssize_t len = zsock_send(client->sock, client->tx, client->tx_len, 0);
+            if((len < 0) && (errno != EAGAIN)) {
+                _cmdsrv.stats.send_errors++;
+                _cmdsrv_close(client);
+                continue;
+            } else if(len > 0) {
+                memmove(client->tx, &client->tx[len], client->tx_len - len);
+                client->tx_len -= len;
+                _cmdsrv.stats.bytes += len;
+            }
+        }
+    }
+}
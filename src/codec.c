@@ -0,0 +1,234 @@
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "codec.h"
+
+/* NOTE: Also built into host tools, keep free of Zephyr dependencies */
+
+#define CODEC_EXP_MAX 9
+
+static const int32_t _pow10[CODEC_EXP_MAX + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static uint64_t _zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t _unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t _varint_put(uint8_t *buf, uint64_t value) {
+    size_t n = 0;
+    while(value >= 0x80) {
+        buf[n++] = (value & 0x7f) | 0x80;
+        value  >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+/**
+ * @brief Read a varint from the block being decoded
+ *
+ * @return 0 on success, -1 if the varint runs past the end of the block
+ */
+static int _varint_get(kei_codec_t *codec, uint64_t *value) {
+    *value = 0;
+    for(unsigned shift = 0; shift < 64; shift += 7) {
+        if(codec->len >= codec->size) {
+            return -1;
+        }
+        uint8_t byte = codec->buf[codec->len++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the largest power of ten the value is a multiple of
+ */
+static uint8_t _exp_find(int32_t value, uint8_t current) {
+    if(!value) {
+        return current;
+    }
+
+    uint8_t exp = 0;
+    while((exp < CODEC_EXP_MAX) && !(value % _pow10[exp + 1])) {
+        exp++;
+    }
+    return exp;
+}
+
+int kei_codec_enc_init(kei_codec_t *codec, uint8_t *buf, size_t size, uint8_t flags, uint8_t mode) {
+    if(size < KEI_CODEC_HDR_SIZE) {
+        return -1;
+    }
+
+    memset(codec, 0, sizeof(*codec));
+    codec->buf   = buf;
+    codec->size  = size;
+    codec->len   = KEI_CODEC_HDR_SIZE;
+    codec->flags = flags;
+    codec->mode  = mode;
+
+    buf[0] = KEI_CODEC_VERSION;
+    buf[1] = flags;
+    buf[2] = mode;
+    buf[3] = 0;
+    buf[4] = 0;
+
+    return 0;
+}
+
+int kei_codec_enc_add(kei_codec_t *codec, const kei_codec_sample_t *sample) {
+    uint8_t     tmp[KEI_CODEC_SAMPLE_MAX];
+    size_t      n    = 0;
+    kei_codec_t next = *codec;
+
+    if(codec->count == UINT16_MAX) {
+        return -1;
+    }
+
+    if(!codec->count) {
+        n        += _varint_put(&tmp[n], sample->time);
+        n        += _varint_put(&tmp[n], sample->seq);
+        next.time = sample->time;
+        next.seq  = sample->seq - 1;
+        next.dt   = 0;
+    }
+
+    bool state = !codec->count ||
+                 (sample->range       != codec->range) ||
+                 (sample->sensitivity != codec->sensitivity) ||
+                 (sample->flags       != codec->sflags) ||
+                 (sample->value % _pow10[codec->exp]);
+    if(state) {
+        next.exp = _exp_find(sample->value, codec->exp);
+    }
+
+    int64_t  q     = sample->value / _pow10[next.exp];
+    int64_t  dq    = state ? q : (q - (codec->value / _pow10[next.exp]));
+    uint32_t dseq  = sample->seq - next.seq;
+    int64_t  dt    = (int64_t)(sample->time - next.time);
+
+    n += _varint_put(&tmp[n], (_zigzag(dq) << 2) | ((dseq != 1) << 1) | state);
+    if(state) {
+        n        += _varint_put(&tmp[n], _zigzag(sample->range));
+        tmp[n++]  = sample->flags;
+        tmp[n++]  = (sample->sensitivity << 4) | next.exp;
+    }
+    if(dseq != 1) {
+        n += _varint_put(&tmp[n], dseq);
+    }
+    n += _varint_put(&tmp[n], _zigzag(dt - next.dt));
+
+    if((codec->len + n) > codec->size) {
+        return -1;
+    }
+
+    memcpy(&codec->buf[codec->len], tmp, n);
+    next.len        += n;
+    next.count++;
+    next.seq         = sample->seq;
+    next.time        = sample->time;
+    next.dt          = dt;
+    next.value       = sample->value;
+    next.range       = sample->range;
+    next.sensitivity = sample->sensitivity;
+    next.sflags      = sample->flags;
+    *codec           = next;
+
+    codec->buf[3] = codec->count & 0xff;
+    codec->buf[4] = codec->count >> 8;
+
+    return 0;
+}
+
+int kei_codec_dec_init(kei_codec_t *codec, const uint8_t *buf, size_t len) {
+    if((len < KEI_CODEC_HDR_SIZE) || (buf[0] != KEI_CODEC_VERSION)) {
+        return -1;
+    }
+
+    memset(codec, 0, sizeof(*codec));
+    codec->buf   = (uint8_t *)buf;
+    codec->size  = len;
+    codec->len   = KEI_CODEC_HDR_SIZE;
+    codec->flags = buf[1];
+    codec->mode  = buf[2];
+    codec->count = buf[3] | (buf[4] << 8);
+
+    if(codec->count) {
+        uint64_t time, seq;
+        if(_varint_get(codec, &time) ||
+           _varint_get(codec, &seq)) {
+            return -1;
+        }
+        codec->time = time;
+        codec->seq  = (uint32_t)seq - 1;
+    }
+
+    return 0;
+}
+
+int kei_codec_dec_next(kei_codec_t *codec, kei_codec_sample_t *sample) {
+    if(!codec->count) {
+        return 1;
+    }
+
+    uint64_t ctrl, value;
+    if(_varint_get(codec, &ctrl)) {
+        return -1;
+    }
+
+    bool    state = ctrl & 1;
+    bool    gap   = ctrl & 2;
+    int64_t dq    = _unzigzag(ctrl >> 2);
+
+    if(state) {
+        if(_varint_get(codec, &value) ||
+           ((codec->len + 2) > codec->size)) {
+            return -1;
+        }
+        codec->range       = _unzigzag(value);
+        codec->sflags      = codec->buf[codec->len++];
+        codec->sensitivity = codec->buf[codec->len] >> 4;
+        codec->exp         = codec->buf[codec->len++] & 0x0f;
+        if(codec->exp > CODEC_EXP_MAX) {
+            return -1;
+        }
+    }
+
+    uint32_t dseq = 1;
+    if(gap) {
+        if(_varint_get(codec, &value)) {
+            return -1;
+        }
+        dseq = value;
+    }
+
+    if(_varint_get(codec, &value)) {
+        return -1;
+    }
+    codec->dt   += _unzigzag(value);
+    codec->time += codec->dt;
+    codec->seq  += dseq;
+
+    int64_t q = state ? dq : ((codec->value / _pow10[codec->exp]) + dq);
+    codec->value = (int32_t)(q * _pow10[codec->exp]);
+    codec->count--;
+
+    sample->seq         = codec->seq;
+    sample->time        = codec->time;
+    sample->value       = codec->value;
+    sample->range       = codec->range;
+    sample->sensitivity = codec->sensitivity;
+    sample->flags       = codec->sflags;
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "codec.h"
+#include "datalog.h"
+#include "interface.h"
+#include "perf.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(kei_datalog);
+
+#define DATALOG_PARTITION DT_FIXED_PARTITION_ID(DT_NODELABEL(kei_log_partition))
+
+BUILD_ASSERT(KEI_DATALOG_BLOCK_SIZE >= (KEI_CODEC_HDR_SIZE + KEI_CODEC_SAMPLE_MAX));
+
+static struct {
+    const struct flash_area *fa;
+    kei_interface_reader_t   reader;
+
+    uint32_t                 n_pages;
+    uint32_t                 next;    /**< Page number of page being collected */
+    uint32_t                 used;    /**< Number of complete pages before next held in flash */
+
+    kei_codec_t              codec;   /**< Encoder of page being collected */
+    uint8_t                  page[KEI_DATALOG_PAGE_SIZE] __aligned(8);
+    uint8_t                  view[KEI_DATALOG_PAGE_SIZE]; /**< Page being printed, only used by shell */
+
+    uint32_t                 written;
+    uint32_t                 errors;
+
+    struct k_thread          thread;
+} _datalog;
+
+/* Protects all of _datalog, and serializes flash access */
+K_MUTEX_DEFINE(_datalog_lock);
+
+K_THREAD_STACK_DEFINE(_datalog_thread_stack, 1024);
+static void _datalog_thread_main(void *p1, void *p2, void *p3);
+
+static off_t _page_offset(uint32_t page_seq) {
+    return (off_t)(page_seq % _datalog.n_pages) * KEI_DATALOG_PAGE_SIZE;
+}
+
+/**
+ * @brief Check whether a page in flash holds a valid log page
+ *
+ * @param page Index of page within partition
+ * @param page_seq Where to store page number
+ *
+ * @return 0 if valid, -1 if not
+ */
+static int _page_check(uint32_t page, uint32_t *page_seq) {
+    kei_datalog_page_hdr_t hdr;
+    off_t                  off = (off_t)page * KEI_DATALOG_PAGE_SIZE;
+
+    if(flash_area_read(_datalog.fa, off, &hdr, sizeof(hdr)) ||
+       (sys_le32_to_cpu(hdr.magic) != KEI_DATALOG_MAGIC)) {
+        return -1;
+    }
+
+    size_t len = sys_le16_to_cpu(hdr.len);
+    if((len < KEI_CODEC_HDR_SIZE) || (len > KEI_DATALOG_BLOCK_SIZE)) {
+        return -1;
+    }
+
+    uint32_t crc = crc32_ieee((const uint8_t *)&hdr, offsetof(kei_datalog_page_hdr_t, crc));
+    off         += sizeof(hdr);
+    while(len) {
+        uint8_t buf[64];
+        size_t  n = MIN(len, sizeof(buf));
+        if(flash_area_read(_datalog.fa, off, buf, n)) {
+            return -1;
+        }
+        crc  = crc32_ieee_update(crc, buf, n);
+        off += n;
+        len -= n;
+    }
+
+    if(crc != sys_le32_to_cpu(hdr.crc)) {
+        return -1;
+    }
+
+    *page_seq = sys_le32_to_cpu(hdr.page_seq);
+    return 0;
+}
+
+/**
+ * @brief Find the newest run of valid pages in the partition
+ */
+static void _datalog_mount(void) {
+    bool     found  = false;
+    uint32_t newest = 0;
+
+    for(uint32_t page = 0; page < _datalog.n_pages; page++) {
+        uint32_t page_seq;
+        if(_page_check(page, &page_seq) ||
+           ((page_seq % _datalog.n_pages) != page)) {
+            continue;
+        }
+        if(!found || ((int32_t)(page_seq - newest) > 0)) {
+            newest = page_seq;
+            found  = true;
+        }
+    }
+
+    _datalog.next = found ? (newest + 1) : 0;
+    _datalog.used = 0;
+
+    /* Count consecutive pages back from the newest */
+    while(found && (_datalog.used < _datalog.n_pages)) {
+        uint32_t page_seq = newest - _datalog.used;
+        uint32_t check;
+        if(_page_check(page_seq % _datalog.n_pages, &check) ||
+           (check != page_seq)) {
+            break;
+        }
+        _datalog.used++;
+    }
+}
+
+static void _page_clear(void) {
+    memset(_datalog.page, 0xff, sizeof(_datalog.page));
+    _datalog.codec.count = 0;
+    _datalog.codec.len   = 0;
+}
+
+/**
+ * @brief Write the page being collected to flash. Must be called with lock held.
+ */
+static int _page_write(void) {
+    kei_datalog_page_hdr_t *hdr = (kei_datalog_page_hdr_t *)_datalog.page;
+
+    if(!_datalog.codec.count) {
+        return 0;
+    }
+
+    uint32_t page_seq = _datalog.next++;
+
+    hdr->magic    = sys_cpu_to_le32(KEI_DATALOG_MAGIC);
+    hdr->page_seq = sys_cpu_to_le32(page_seq);
+    hdr->len      = sys_cpu_to_le16(_datalog.codec.len);
+    hdr->reserved = 0;
+    hdr->crc      = sys_cpu_to_le32(
+        crc32_ieee_update(crc32_ieee(_datalog.page, offsetof(kei_datalog_page_hdr_t, crc)),
+                          &_datalog.page[sizeof(*hdr)], _datalog.codec.len));
+
+    /* The page about to be erased is the oldest one once the log has wrapped */
+    if(_datalog.used >= _datalog.n_pages) {
+        _datalog.used = _datalog.n_pages - 1;
+    }
+
+    off_t off = _page_offset(page_seq);
+    int   ret = flash_area_erase(_datalog.fa, off, KEI_DATALOG_PAGE_SIZE);
+    if(!ret) {
+        ret = flash_area_write(_datalog.fa, off, _datalog.page, KEI_DATALOG_PAGE_SIZE);
+    }
+
+    if(ret) {
+        LOG_ERR("Failed to write page %u: %d", page_seq, ret);
+        _datalog.errors++;
+        /* The pages still held are no longer consecutive with new ones */
+        _datalog.used = 0;
+    } else {
+        _datalog.written++;
+        _datalog.used++;
+    }
+
+    _page_clear();
+
+    return ret ? -1 : 0;
+}
+
+/**
+ * @brief Add a reading to the page being collected
+ */
+static void _datalog_append(const kei_interface_sample_t *sample) {
+    kei_codec_t *codec = &_datalog.codec;
+
+    kei_codec_sample_t enc = {
+        .seq         = sample->seq,
+        .value       = sample->data.value,
+        .range       = sample->data.range,
+        .sensitivity = sample->raw.sensitivity,
+        .flags       = sample->data.flags
+    };
+    uint8_t flags = 0;
+    if(kei_time_to_utc(sample->timestamp, &enc.time)) {
+        enc.time  = k_cyc_to_us_floor64(sample->timestamp);
+    } else {
+        flags    |= KEI_CODEC_FLAG_UTC;
+    }
+    uint8_t mode = sample->mode;
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+
+    /* Time base and mode are per block */
+    if(codec->count && ((flags != codec->flags) || (mode != codec->mode))) {
+        _page_write();
+    }
+
+    for(unsigned attempt = 0; attempt < 2; attempt++) {
+        if(!codec->count) {
+            kei_codec_enc_init(codec, &_datalog.page[sizeof(kei_datalog_page_hdr_t)],
+                               KEI_DATALOG_BLOCK_SIZE, flags, mode);
+        }
+        if(!kei_codec_enc_add(codec, &enc)) {
+            break;
+        }
+        _page_write();
+    }
+
+    /* Write the page out as soon as it might not fit another reading */
+    if((codec->size - codec->len) < KEI_CODEC_SAMPLE_MAX) {
+        _page_write();
+    }
+
+    k_mutex_unlock(&_datalog_lock);
+}
+
+int kei_datalog_init(void) {
+    if(flash_area_open(DATALOG_PARTITION, &_datalog.fa)) {
+        LOG_ERR("Could not open log partition");
+        return -1;
+    }
+
+    struct flash_pages_info info;
+    if(flash_get_page_info_by_offs(flash_area_get_device(_datalog.fa),
+                                   _datalog.fa->fa_off, &info) ||
+       (info.size != KEI_DATALOG_PAGE_SIZE)) {
+        LOG_ERR("Flash page size does not match CONFIG_KEI_DATALOG_PAGE_SIZE");
+        flash_area_close(_datalog.fa);
+        _datalog.fa = NULL;
+        return -1;
+    }
+
+    _datalog.n_pages = _datalog.fa->fa_size / KEI_DATALOG_PAGE_SIZE;
+    if(_datalog.n_pages < 2) {
+        LOG_ERR("Log partition too small");
+        flash_area_close(_datalog.fa);
+        _datalog.fa = NULL;
+        return -1;
+    }
+
+    _datalog_mount();
+    _page_clear();
+
+    LOG_INF("Data log: %u/%u pages used, next page %u",
+            _datalog.used, _datalog.n_pages, _datalog.next);
+
+    kei_interface_reader_init(&_datalog.reader);
+    kei_perf_reader_register(&_datalog.reader, "log");
+
+    k_thread_create(&_datalog.thread, _datalog_thread_stack, K_THREAD_STACK_SIZEOF(_datalog_thread_stack),
+                    _datalog_thread_main, NULL, NULL, NULL, 10, 0, K_NO_WAIT);
+    k_thread_name_set(&_datalog.thread, "kei_log");
+
+    return 0;
+}
+
+int kei_datalog_get_info(kei_datalog_info_t *info) {
+    if(!_datalog.fa) {
+        return -1;
+    }
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+    info->n_pages = _datalog.n_pages;
+    info->oldest  = _datalog.next - _datalog.used;
+    info->used    = _datalog.used;
+    info->pending     = _datalog.codec.count;
+    info->pending_len = _datalog.codec.len;
+    info->written = _datalog.written;
+    info->errors  = _datalog.errors;
+    info->missed  = _datalog.reader.dropped;
+    k_mutex_unlock(&_datalog_lock);
+
+    return 0;
+}
+
+int kei_datalog_read(uint32_t page_seq, size_t off, void *buf, size_t len) {
+    if(!_datalog.fa || ((off + len) > KEI_DATALOG_PAGE_SIZE)) {
+        return -1;
+    }
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+    int ret = flash_area_read(_datalog.fa, _page_offset(page_seq) + off, buf, len);
+    k_mutex_unlock(&_datalog_lock);
+
+    return ret ? -1 : 0;
+}
+
+int kei_datalog_flush(void) {
+    if(!_datalog.fa) {
+        return -1;
+    }
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+    int ret = _page_write();
+    k_mutex_unlock(&_datalog_lock);
+
+    return ret;
+}
+
+int kei_datalog_erase(void) {
+    if(!_datalog.fa) {
+        return -1;
+    }
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+    /* Page numbers keep counting up, so pages written before the erase can
+     * never be mistaken for newer ones */
+    int ret = flash_area_erase(_datalog.fa, 0, _datalog.fa->fa_size);
+    _datalog.used = 0;
+    _page_clear();
+    k_mutex_unlock(&_datalog_lock);
+
+    return ret ? -1 : 0;
+}
+
+static void _datalog_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    while(1) {
+        kei_interface_wait_sample(_datalog.reader.next - 1, -1);
+
+        kei_interface_sample_t sample;
+        while(!kei_interface_read(&_datalog.reader, &sample)) {
+            _datalog_append(&sample);
+        }
+    }
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+/**
+ * @brief Load a page into the view buffer, including the page being collected
+ *
+ * @return 0 on success, -1 if the page is not held
+ */
+static int _page_view(uint32_t page_seq, kei_codec_t *codec) {
+    int ret = 0;
+
+    k_mutex_lock(&_datalog_lock, K_FOREVER);
+    if(page_seq == _datalog.next) {
+        memcpy(_datalog.view, _datalog.page, sizeof(_datalog.view));
+        if(!_datalog.codec.count) {
+            ret = -1;
+        } else {
+            kei_codec_dec_init(codec, &_datalog.view[sizeof(kei_datalog_page_hdr_t)],
+                               _datalog.codec.len);
+        }
+    } else {
+        const kei_datalog_page_hdr_t *hdr = (const kei_datalog_page_hdr_t *)_datalog.view;
+        if(flash_area_read(_datalog.fa, _page_offset(page_seq), _datalog.view, sizeof(_datalog.view)) ||
+           (sys_le32_to_cpu(hdr->magic)    != KEI_DATALOG_MAGIC) ||
+           (sys_le32_to_cpu(hdr->page_seq) != page_seq) ||
+           (sys_le16_to_cpu(hdr->len)      >  KEI_DATALOG_BLOCK_SIZE) ||
+           kei_codec_dec_init(codec, &_datalog.view[sizeof(*hdr)], sys_le16_to_cpu(hdr->len))) {
+            ret = -1;
+        }
+    }
+    k_mutex_unlock(&_datalog_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Print readings of a page, including the page being collected
+ *
+ * @return Number of readings printed
+ */
+static unsigned _page_print(const struct shell *sh, uint32_t page_seq, unsigned skip, unsigned max) {
+    kei_codec_t codec;
+    if(_page_view(page_seq, &codec)) {
+        return 0;
+    }
+
+    const char        *tz = (codec.flags & KEI_CODEC_FLAG_UTC) ? "Z" : " ";
+    kei_codec_sample_t sample;
+    unsigned           n  = 0;
+    for(unsigned i = 0; (n < max) && !kei_codec_dec_next(&codec, &sample); i++) {
+        if(i < skip) {
+            continue;
+        }
+
+        if(sample.flags & KEI_DATAFLAG_OVERLOAD) {
+            shell_print(sh, "#%-8u %8llu.%06u%s  overload", sample.seq,
+                        (unsigned long long)(sample.time / 1000000), (uint32_t)(sample.time % 1000000), tz);
+        } else {
+            shell_print(sh, "#%-8u %8llu.%06u%s  %d uU E%+d", sample.seq,
+                        (unsigned long long)(sample.time / 1000000), (uint32_t)(sample.time % 1000000), tz,
+                        sample.value, sample.range);
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Get number of readings in a page, including the page being collected
+ */
+static unsigned _page_count(uint32_t page_seq) {
+    kei_codec_t codec;
+    return _page_view(page_seq, &codec) ? 0 : codec.count;
+}
+
+int kei_datalog_cmd(const struct shell *sh, size_t argc, char **argv) {
+    kei_datalog_info_t info;
+    if(kei_datalog_get_info(&info)) {
+        shell_print(sh, "Data log not available");
+        return -1;
+    }
+
+    if(argc == 1) {
+        shell_print(sh, "Pages: %u/%u used, oldest: %u",
+                    info.used, info.n_pages, info.oldest);
+        shell_print(sh, "Pending: %u readings, %u/%u bytes",
+                    info.pending, info.pending_len, (unsigned)KEI_DATALOG_BLOCK_SIZE);
+        shell_print(sh, "Pages written: %u, write errors: %u, readings missed: %u",
+                    info.written, info.errors, info.missed);
+        return 0;
+    } else if((argc == 2) && !strcmp(argv[1], "flush")) {
+        return kei_datalog_flush();
+    } else if((argc == 2) && !strcmp(argv[1], "erase")) {
+        return kei_datalog_erase();
+    } else if((argc > 3) ||
+              (strcmp(argv[1], "head") && strcmp(argv[1], "tail"))) {
+        shell_print(sh, "Unsupported arguments");
+        return -1;
+    }
+
+    unsigned max  = (argc == 3) ? strtoul(argv[2], NULL, 10) : 10;
+    uint32_t last = info.oldest + info.used;
+    uint32_t page = info.oldest;
+    unsigned skip = 0;
+
+    /* Pages from oldest up to and including the one being collected */
+    if(!strcmp(argv[1], "tail")) {
+        unsigned total = 0;
+        for(page = last;; page--) {
+            total += _page_count(page);
+            if((total >= max) || (page == info.oldest)) {
+                break;
+            }
+        }
+        skip = (total > max) ? (total - max) : 0;
+    }
+
+    unsigned printed = 0;
+    for(; ((int32_t)(page - last) <= 0) && (printed < max); page++) {
+        printed += _page_print(sh, page, skip, max - printed);
+        skip     = 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,379 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+
+#include "emul615.h"
+
+LOG_MODULE_REGISTER(kei_emul615);
+
+#define ZEPHYR_USER_NODE DT_PATH(zephyr_user)
+
+#define EMUL_VALUE_MAX 1999 /**< Largest displayed value, 3 1/2 digits */
+#define EMUL_RANGE_MAX 19
+
+#define _EMUL_SPEC(node, prop, idx) GPIO_DT_SPEC_GET_BY_IDX(node, prop, idx),
+
+/* Same lines as the interface, seen from the instrument's side */
+static const struct {
+    struct gpio_dt_spec polarity;
+    struct gpio_dt_spec overload;
+    struct gpio_dt_spec trigger;
+    struct gpio_dt_spec print;
+
+    struct gpio_dt_spec data_bcd       [DT_PROP_LEN(ZEPHYR_USER_NODE, data_gpios)];
+    struct gpio_dt_spec range_bcd      [DT_PROP_LEN(ZEPHYR_USER_NODE, range_gpios)];
+    struct gpio_dt_spec sensitivity_bcd[DT_PROP_LEN(ZEPHYR_USER_NODE, sensitivity_gpios)];
+} _emul_gpios = {
+    .polarity        = GPIO_DT_SPEC_GET(ZEPHYR_USER_NODE, polarity_gpios),
+    .overload        = GPIO_DT_SPEC_GET(ZEPHYR_USER_NODE, overload_gpios),
+    .trigger         = GPIO_DT_SPEC_GET(ZEPHYR_USER_NODE, trigger_gpios),
+    .print           = GPIO_DT_SPEC_GET(ZEPHYR_USER_NODE, print_gpios),
+    .data_bcd        = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, data_gpios,        _EMUL_SPEC) },
+    .range_bcd       = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, range_gpios,       _EMUL_SPEC) },
+    .sensitivity_bcd = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, sensitivity_gpios, _EMUL_SPEC) }
+};
+
+static struct {
+    kei_emul615_mode_e mode;
+    uint32_t           period_us;   /**< Reading period in free-running mode */
+    uint32_t           conv_us;     /**< TRIGGER to PRINT delay in trigger mode */
+
+    int16_t            value;       /**< Displayed value, before noise and sweep */
+    uint8_t            range;
+    uint8_t            sensitivity;
+    bool               overload;
+    uint16_t           noise;       /**< Peak noise added to each reading, in digits */
+    int16_t            step;        /**< Added to the value after each reading */
+
+    int16_t            sweep;       /**< Current sweep offset */
+    uint32_t           rand;        /**< Noise generator state */
+    bool               trig_level;  /**< TRIGGER level at last poll */
+    bool               converting;  /**< Reading following a TRIGGER is in progress */
+
+    struct k_timer     run_timer;   /**< Free-running readings */
+    struct k_timer     poll_timer;  /**< Watches TRIGGER in trigger mode */
+    struct k_timer     conv_timer;  /**< Ends conversion in trigger mode */
+
+    struct {
+        uint32_t prints;   /**< Readings produced */
+        uint32_t triggers; /**< TRIGGER pulses seen */
+        uint32_t ignored;  /**< TRIGGER pulses seen while already converting */
+    } stats;
+} _emul = {
+    .mode        = KEI_EMUL615_MODE_FREE,
+    .period_us   = CONFIG_KEI_EMUL615_PERIOD_US,
+    .conv_us     = CONFIG_KEI_EMUL615_CONV_US,
+    .value       = 1234,
+    .range       = 9,
+    .sensitivity = 0,
+    .rand        = 0x615
+};
+
+/**
+ * @brief Drive an interface line, as seen by the interface
+ */
+static void _emul_line_set(const struct gpio_dt_spec *spec, bool active) {
+    bool level = active ^ !!(spec->dt_flags & GPIO_ACTIVE_LOW);
+    gpio_emul_input_set(spec->port, spec->pin, level);
+}
+
+/**
+ * @brief Drive a set of BCD lines
+ */
+static void _emul_bcd_set(const struct gpio_dt_spec *specs, size_t count, unsigned value) {
+    uint32_t bcd = 0;
+    for(unsigned shift = 0; value; shift += 4, value /= 10) {
+        bcd |= (value % 10) << shift;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        _emul_line_set(&specs[i], bcd & BIT(i));
+    }
+}
+
+/**
+ * @brief Put the next reading on the lines and strobe PRINT
+ *
+ * The interface latches the lines on the falling edge of PRINT, synchronously
+ * within gpio_emul_input_set(), so the strobe can be arbitrarily short.
+ */
+static void _emul_print(void) {
+    int32_t value = _emul.value + _emul.sweep;
+
+    if(_emul.noise) {
+        /* xorshift32 */
+        _emul.rand ^= _emul.rand << 13;
+        _emul.rand ^= _emul.rand >> 17;
+        _emul.rand ^= _emul.rand << 5;
+        value += (int32_t)(_emul.rand % (2U * _emul.noise + 1)) - _emul.noise;
+    }
+    value = CLAMP(value, -EMUL_VALUE_MAX, EMUL_VALUE_MAX);
+
+    if(_emul.step) {
+        _emul.sweep += _emul.step;
+        if(abs(_emul.value + _emul.sweep) > EMUL_VALUE_MAX) {
+            _emul.sweep = -_emul.value - ((_emul.step > 0) ? EMUL_VALUE_MAX : -EMUL_VALUE_MAX);
+        }
+    }
+
+    _emul_line_set(&_emul_gpios.overload, _emul.overload);
+    _emul_line_set(&_emul_gpios.polarity, value < 0);
+    _emul_bcd_set(_emul_gpios.data_bcd,        ARRAY_SIZE(_emul_gpios.data_bcd),        abs(value));
+    _emul_bcd_set(_emul_gpios.range_bcd,       ARRAY_SIZE(_emul_gpios.range_bcd),       _emul.range);
+    _emul_bcd_set(_emul_gpios.sensitivity_bcd, ARRAY_SIZE(_emul_gpios.sensitivity_bcd), _emul.sensitivity);
+
+    _emul_line_set(&_emul_gpios.print, false);
+    _emul_line_set(&_emul_gpios.print, true);
+
+    _emul.stats.prints++;
+}
+
+static void _emul_run_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
+
+    _emul_print();
+}
+
+static void _emul_poll_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
+
+    bool level = gpio_emul_output_get(_emul_gpios.trigger.port, _emul_gpios.trigger.pin) ^
+                 !!(_emul_gpios.trigger.dt_flags & GPIO_ACTIVE_LOW);
+
+    if(level && !_emul.trig_level) {
+        _emul.stats.triggers++;
+        if(_emul.converting) {
+            _emul.stats.ignored++;
+        } else {
+            _emul.converting = true;
+            k_timer_start(&_emul.conv_timer, K_USEC(_emul.conv_us), K_NO_WAIT);
+        }
+    }
+    _emul.trig_level = level;
+}
+
+static void _emul_conv_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
+
+    _emul.converting = false;
+    _emul_print();
+}
+
+int kei_emul615_init(void) {
+    k_timer_init(&_emul.run_timer,  _emul_run_timer_expiry,  NULL);
+    k_timer_init(&_emul.poll_timer, _emul_poll_timer_expiry, NULL);
+    k_timer_init(&_emul.conv_timer, _emul_conv_timer_expiry, NULL);
+
+    /* Lines idle, PRINT high */
+    _emul_line_set(&_emul_gpios.print, true);
+
+    if(kei_emul615_set_mode(_emul.mode, _emul.period_us)) {
+        return -1;
+    }
+
+    LOG_INF("Emulated 615 running");
+
+    return 0;
+}
+
+int kei_emul615_set_mode(kei_emul615_mode_e mode, uint32_t us) {
+    if(mode >= KEI_EMUL615_MODE_MAX) {
+        return -1;
+    }
+    if((mode != KEI_EMUL615_MODE_MANUAL) && !us) {
+        return -1;
+    }
+
+    k_timer_stop(&_emul.run_timer);
+    k_timer_stop(&_emul.poll_timer);
+    k_timer_stop(&_emul.conv_timer);
+    _emul.converting = false;
+
+    _emul.mode = mode;
+    switch(mode) {
+        case KEI_EMUL615_MODE_FREE:
+            _emul.period_us = us;
+            k_timer_start(&_emul.run_timer, K_USEC(us), K_USEC(us));
+            break;
+        case KEI_EMUL615_MODE_TRIGGER:
+            _emul.conv_us    = us;
+            _emul.trig_level = false;
+            k_timer_start(&_emul.poll_timer, K_USEC(CONFIG_KEI_EMUL615_POLL_US),
+                          K_USEC(CONFIG_KEI_EMUL615_POLL_US));
+            break;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+kei_emul615_mode_e kei_emul615_get_mode(uint32_t *us) {
+    if(us) {
+        *us = (_emul.mode == KEI_EMUL615_MODE_TRIGGER) ? _emul.conv_us : _emul.period_us;
+    }
+    return _emul.mode;
+}
+
+void kei_emul615_print(void) {
+    /* Keep the lines from being changed by the timers mid-reading */
+    unsigned key = irq_lock();
+    _emul_print();
+    irq_unlock(key);
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static const char * const _mode_names[KEI_EMUL615_MODE_MAX] = {
+    [KEI_EMUL615_MODE_FREE]    = "free",
+    [KEI_EMUL615_MODE_TRIGGER] = "trigger",
+    [KEI_EMUL615_MODE_MANUAL]  = "manual",
+};
+
+static int _cmdhdlr_emul_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_mode(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_value(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_overload(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_noise(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_sweep(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_emul_print(const struct shell *sh, size_t argc, char **argv);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_emul,
+    SHELL_CMD(info, NULL, "Print emulator state", _cmdhdlr_emul_info),
+    SHELL_CMD(mode, NULL, "Set mode: free <Hz> | trigger <conversion us> | manual", _cmdhdlr_emul_mode),
+    SHELL_CMD(value, NULL, "Set reading: <value> [range] [sensitivity]", _cmdhdlr_emul_value),
+    SHELL_CMD(overload, NULL, "Set overload: on|off", _cmdhdlr_emul_overload),
+    SHELL_CMD(noise, NULL, "Set peak noise, in digits", _cmdhdlr_emul_noise),
+    SHELL_CMD(sweep, NULL, "Set value step per reading, 0 to stop", _cmdhdlr_emul_sweep),
+    SHELL_CMD(print, NULL, "Produce a reading now", _cmdhdlr_emul_print),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kei_emul615, &_subcmd_emul, "Emulated Keithley 615 subcommands", NULL);
+
+/**
+ * @brief Parse a whole number argument within [min, max]
+ */
+static int _parse_long(const struct shell *sh, const char *arg, long min, long max, long *value) {
+    char *end;
+    *value = strtol(arg, &end, 0);
+    if(*end || (end == arg) || (*value < min) || (*value > max)) {
+        shell_print(sh, "Invalid value '%s', expected %ld to %ld", arg, min, max);
+        return -1;
+    }
+    return 0;
+}
+
+static int _cmdhdlr_emul_info(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    shell_print(sh, "Mode: %s, period: %u us, conversion: %u us",
+                _mode_names[_emul.mode], _emul.period_us, _emul.conv_us);
+    shell_print(sh, "Value: %d, range: %u, sensitivity: %u, overload: %s",
+                _emul.value, _emul.range, _emul.sensitivity, _emul.overload ? "on" : "off");
+    shell_print(sh, "Noise: %u, sweep step: %d", _emul.noise, _emul.step);
+    shell_print(sh, "Readings: %u, triggers: %u, ignored while converting: %u",
+                _emul.stats.prints, _emul.stats.triggers, _emul.stats.ignored);
+
+    return 0;
+}
+
+static int _cmdhdlr_emul_mode(const struct shell *sh, size_t argc, char **argv) {
+    if(argc < 2) {
+        shell_print(sh, "Mode: %s", _mode_names[_emul.mode]);
+        return 0;
+    }
+
+    kei_emul615_mode_e mode;
+    for(mode = 0; mode < KEI_EMUL615_MODE_MAX; mode++) {
+        if(!strcmp(argv[1], _mode_names[mode])) {
+            break;
+        }
+    }
+    if(mode >= KEI_EMUL615_MODE_MAX) {
+        shell_print(sh, "Unsupported mode");
+        return -1;
+    }
+
+    long arg = 0;
+    if(mode == KEI_EMUL615_MODE_FREE) {
+        if((argc != 3) || _parse_long(sh, argv[2], 1, 100000, &arg)) {
+            return -1;
+        }
+        arg = 1000000 / arg;
+    } else if(mode == KEI_EMUL615_MODE_TRIGGER) {
+        if((argc != 3) || _parse_long(sh, argv[2], 1, 10000000, &arg)) {
+            return -1;
+        }
+    }
+
+    return kei_emul615_set_mode(mode, arg);
+}
+
+static int _cmdhdlr_emul_value(const struct shell *sh, size_t argc, char **argv) {
+    long value, range = _emul.range, sensitivity = _emul.sensitivity;
+
+    if((argc < 2) || (argc > 4) ||
+       _parse_long(sh, argv[1], -EMUL_VALUE_MAX, EMUL_VALUE_MAX, &value) ||
+       ((argc > 2) && _parse_long(sh, argv[2], 0, EMUL_RANGE_MAX, &range)) ||
+       ((argc > 3) && _parse_long(sh, argv[3], 0, 3, &sensitivity))) {
+        return -1;
+    }
+
+    _emul.value       = value;
+    _emul.range       = range;
+    _emul.sensitivity = sensitivity;
+    _emul.sweep       = 0;
+
+    return 0;
+}
+
+static int _cmdhdlr_emul_overload(const struct shell *sh, size_t argc, char **argv) {
+    if(argc != 2) {
+        shell_print(sh, "Overload: %s", _emul.overload ? "on" : "off");
+        return 0;
+    }
+
+    _emul.overload = !strcmp(argv[1], "on");
+    return 0;
+}
+
+static int _cmdhdlr_emul_noise(const struct shell *sh, size_t argc, char **argv) {
+    long noise;
+    if((argc != 2) || _parse_long(sh, argv[1], 0, EMUL_VALUE_MAX, &noise)) {
+        return -1;
+    }
+
+    _emul.noise = noise;
+    return 0;
+}
+
+static int _cmdhdlr_emul_sweep(const struct shell *sh, size_t argc, char **argv) {
+    long step;
+    if((argc != 2) || _parse_long(sh, argv[1], -EMUL_VALUE_MAX, EMUL_VALUE_MAX, &step)) {
+        return -1;
+    }
+
+    _emul.step  = step;
+    _emul.sweep = 0;
+    return 0;
+}
+
+static int _cmdhdlr_emul_print(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(sh);
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    kei_emul615_print();
+    return 0;
+}
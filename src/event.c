@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "codec.h"
+#include "event.h"
+#include "interface.h"
+#include "timebase.h"
+
+#define EVENT_LEVEL_DIGITS 18 /**< Maximum significant digits of a level, keeps it within int64_t */
+
+/* The pre-trigger readings are added leaving room for this much, so the
+ * reading that fired always makes it into the record */
+BUILD_ASSERT(KEI_EVENT_BLOCK_SIZE >= (KEI_CODEC_HDR_SIZE + (2 * KEI_CODEC_SAMPLE_MAX)));
+
+/**< Level, mantissa * 10^exp units */
+typedef struct {
+    int64_t mantissa;
+    int8_t  exp;
+} _event_level_t;
+
+/**< Trigger conditions */
+typedef struct {
+    uint8_t        causes; /**< KEI_EVENT_CAUSE_* enabled */
+    _event_level_t rise;
+    _event_level_t fall;
+} _event_trig_t;
+
+static const struct {
+    const char *name;
+    uint8_t     cause;
+} _event_causes[] = {
+    { "rise",     KEI_EVENT_CAUSE_RISE     },
+    { "fall",     KEI_EVENT_CAUSE_FALL     },
+    { "overload", KEI_EVENT_CAUSE_OVERLOAD },
+    { "range",    KEI_EVENT_CAUSE_RANGE    },
+    { "forced",   KEI_EVENT_CAUSE_FORCED   },
+};
+
+K_MUTEX_DEFINE(_event_lock);
+
+static struct {
+    _event_trig_t          trig;
+    bool                   armed;
+    bool                   force;
+
+    /* Previous reading, for edge detection */
+    bool                   have_prev;
+    bool                   prev_overload;
+    bool                   have_value;  /**< Whether prev_value and prev_range are valid */
+    int32_t                prev_value;
+    int8_t                 prev_range;
+
+    /* Pre-trigger history, oldest at pre_pos once full */
+    kei_interface_sample_t pre[CONFIG_KEI_EVENT_PRE];
+    uint16_t               pre_pos;
+    uint16_t               pre_count;
+
+    /* Record being collected */
+    bool                   busy;
+    uint16_t               post_left;
+    kei_codec_t            codec;
+
+    uint32_t               events;      /**< Index of newest record, complete or not */
+    uint32_t               held;        /**< Complete records held, ending at the newest complete one */
+    uint32_t               truncated;
+
+    uint8_t                records[CONFIG_KEI_EVENT_RECORDS][KEI_EVENT_RECORD_SIZE] __aligned(4);
+} _event;
+
+/**
+ * @brief Compare a * 10^ea against b * 10^eb
+ *
+ * @return < 0, 0 or > 0 if a is less than, equal to or greater than b
+ */
+static int _level_cmp(int64_t a, int ea, int64_t b, int eb) {
+    if(!a || !b) {
+        return (a > b) - (a < b);
+    }
+
+    /* Scale the one with the larger exponent down to the other. If it
+     * cannot be scaled any further, its magnitude is the larger one. */
+    while((ea > eb) && (llabs(a) <= (INT64_MAX / 10))) {
+        a *= 10;
+        ea--;
+    }
+    while((eb > ea) && (llabs(b) <= (INT64_MAX / 10))) {
+        b *= 10;
+        eb--;
+    }
+
+    if(ea > eb) {
+        return (a < 0) ? -1 : 1;
+    } else if(eb > ea) {
+        return (b < 0) ? 1 : -1;
+    }
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * @brief Compare a reading against a level
+ */
+static int _level_cmp_data(int32_t value, int8_t range, const _event_level_t *level) {
+    return _level_cmp(value, range - 6, level->mantissa, level->exp);
+}
+
+/**
+ * @brief Parse a level, e.g. "1.5E-9" or "-0.2"
+ *
+ * @return Pointer past the level, NULL if invalid
+ */
+static const char *_level_parse(const char *p, _event_level_t *level) {
+    bool    neg    = false;
+    int64_t m      = 0;
+    int     exp    = 0;
+    int     digits = 0;
+    bool    any    = false;
+    bool    point  = false;
+
+    if((*p == '-') || (*p == '+')) {
+        neg = (*p++ == '-');
+    }
+
+    for(; ((*p >= '0') && (*p <= '9')) || ((*p == '.') && !point); p++) {
+        if(*p == '.') {
+            point = true;
+            continue;
+        }
+        any = true;
+        if(!m && (*p == '0')) {
+            /* Leading zeros are not significant */
+            exp -= point;
+            continue;
+        }
+        if(digits >= EVENT_LEVEL_DIGITS) {
+            exp += !point;
+            continue;
+        }
+        m    = (m * 10) + (*p - '0');
+        exp -= point;
+        digits++;
+    }
+    if(!any) {
+        return NULL;
+    }
+
+    if((*p == 'e') || (*p == 'E')) {
+        char *end;
+        long  e = strtol(p + 1, &end, 10);
+        if((end == (p + 1)) || (e < -64) || (e > 64)) {
+            return NULL;
+        }
+        exp += e;
+        p    = end;
+    }
+
+    /* Normalize, so formatting gives back the shortest form */
+    while(m && !(m % 10)) {
+        m /= 10;
+        exp++;
+    }
+    if(!m) {
+        exp = 0;
+    }
+    if((exp < INT8_MIN) || (exp > INT8_MAX)) {
+        return NULL;
+    }
+
+    level->mantissa = neg ? -m : m;
+    level->exp      = exp;
+
+    return p;
+}
+
+/**
+ * @brief Format a level in scientific notation, e.g. "1.5E-9"
+ */
+static int _level_format(const _event_level_t *level, char *buf, size_t len) {
+    char digits[24];
+    int  n = snprintf(digits, sizeof(digits), "%llu",
+                      (unsigned long long)llabs(level->mantissa));
+
+    return snprintf(buf, len, "%s%c%s%sE%+d", (level->mantissa < 0) ? "-" : "",
+                    digits[0], (n > 1) ? "." : "", &digits[1], level->exp + n - 1);
+}
+
+static int _event_parse(_event_trig_t *trig, const char *spec) {
+    _event_trig_t parsed = { 0 };
+
+    if(!strcmp(spec, "none")) {
+        goto parse_done;
+    }
+
+    const char *p = spec;
+    while(*p) {
+        const char *end = strchr(p, ',');
+        const char *colon;
+        if(!end) {
+            end = p + strlen(p);
+        }
+        colon = memchr(p, ':', end - p);
+
+        size_t  namelen = (colon ? colon : end) - p;
+        uint8_t cause   = 0;
+        for(unsigned i = 0; i < ARRAY_SIZE(_event_causes); i++) {
+            if((strlen(_event_causes[i].name) == namelen) &&
+               !strncmp(p, _event_causes[i].name, namelen)) {
+                cause = _event_causes[i].cause;
+            }
+        }
+        if(!cause || (cause == KEI_EVENT_CAUSE_FORCED)) {
+            return -1;
+        }
+
+        bool levelled = (cause == KEI_EVENT_CAUSE_RISE) || (cause == KEI_EVENT_CAUSE_FALL);
+        if(levelled != !!colon) {
+            return -1;
+        }
+        if(levelled) {
+            _event_level_t *level = (cause == KEI_EVENT_CAUSE_RISE) ? &parsed.rise : &parsed.fall;
+            if(_level_parse(colon + 1, level) != end) {
+                return -1;
+            }
+        }
+        parsed.causes |= cause;
+
+        p = *end ? (end + 1) : end;
+    }
+
+parse_done:
+    *trig = parsed;
+    return 0;
+}
+
+static int _event_format(const _event_trig_t *trig, char *buf, size_t len) {
+    if(!trig->causes) {
+        return snprintf(buf, len, "none");
+    }
+
+    int off = 0;
+    for(unsigned i = 0; (i < ARRAY_SIZE(_event_causes)) && (off < (int)len); i++) {
+        uint8_t cause = _event_causes[i].cause;
+        if(!(trig->causes & cause)) {
+            continue;
+        }
+        off += snprintf(&buf[off], len - off, "%s%s", off ? "," : "", _event_causes[i].name);
+        if((off < (int)len) && (cause == KEI_EVENT_CAUSE_RISE)) {
+            off += snprintf(&buf[off], len - off, ":");
+            off += _level_format(&trig->rise, &buf[off], len - off);
+        } else if((off < (int)len) && (cause == KEI_EVENT_CAUSE_FALL)) {
+            off += snprintf(&buf[off], len - off, ":");
+            off += _level_format(&trig->fall, &buf[off], len - off);
+        }
+    }
+
+    return off;
+}
+
+static uint8_t *_record_buf(uint32_t index) {
+    return _event.records[index % CONFIG_KEI_EVENT_RECORDS];
+}
+
+/**
+ * @brief Add a reading to the record being collected. Must be called with
+ * lock held.
+ *
+ * @return 0 on success, -1 if the record is full
+ */
+static int _record_add(const kei_interface_sample_t *sample) {
+    /* Mode is per block */
+    if(sample->mode != _event.codec.mode) {
+        return -1;
+    }
+
+    kei_codec_sample_t enc = {
+        .seq         = sample->seq,
+        .value       = sample->data.value,
+        .range       = sample->data.range,
+        .sensitivity = sample->raw.sensitivity,
+        .flags       = sample->data.flags
+    };
+    if(!(_event.codec.flags & KEI_CODEC_FLAG_UTC) ||
+       kei_time_to_utc(sample->timestamp, &enc.time)) {
+        enc.time = k_cyc_to_us_floor64(sample->timestamp);
+    }
+
+    return kei_codec_enc_add(&_event.codec, &enc);
+}
+
+/**
+ * @brief Complete the record being collected. Must be called with lock held.
+ */
+static void _record_finish(void) {
+    kei_event_hdr_t *hdr = (kei_event_hdr_t *)_record_buf(_event.events);
+
+    hdr->len = sys_cpu_to_le16(_event.codec.len);
+    hdr->crc = sys_cpu_to_le32(
+        crc32_ieee_update(crc32_ieee((const uint8_t *)hdr, offsetof(kei_event_hdr_t, crc)),
+                          (const uint8_t *)&hdr[1], _event.codec.len));
+
+    if(hdr->flags & KEI_EVENT_FLAG_TRUNCATED) {
+        _event.truncated++;
+    }
+
+    _event.busy = false;
+    _event.held++;
+}
+
+/**
+ * @brief Start a record with the pre-trigger history and the reading that
+ * fired. Must be called with lock held.
+ */
+static void _record_start(const kei_interface_sample_t *sample, uint8_t cause) {
+    uint32_t         index = ++_event.events;
+    uint8_t         *buf   = _record_buf(index);
+    kei_event_hdr_t *hdr   = (kei_event_hdr_t *)buf;
+
+    /* The slot about to be reused is the oldest one once all are taken */
+    if(_event.held >= CONFIG_KEI_EVENT_RECORDS) {
+        _event.held = CONFIG_KEI_EVENT_RECORDS - 1;
+    }
+
+    uint64_t utc;
+    uint8_t  flags = kei_time_to_utc(sample->timestamp, &utc) ? 0 : KEI_CODEC_FLAG_UTC;
+
+    memset(buf, 0xff, KEI_EVENT_RECORD_SIZE);
+    hdr->magic    = sys_cpu_to_le32(KEI_EVENT_MAGIC);
+    hdr->index    = sys_cpu_to_le32(index);
+    hdr->cause    = cause;
+    hdr->flags    = 0;
+    hdr->trig_seq = sys_cpu_to_le32(sample->seq);
+    hdr->post     = 0;
+
+    /* Hold back room for the reading that fired while adding history */
+    kei_codec_enc_init(&_event.codec, &buf[sizeof(*hdr)], KEI_EVENT_BLOCK_SIZE - KEI_CODEC_SAMPLE_MAX,
+                       flags, sample->mode);
+
+    /* History only reaches back to the last mode change */
+    uint16_t pre   = 0;
+    unsigned first = (_event.pre_count < CONFIG_KEI_EVENT_PRE) ? 0 : _event.pre_pos;
+    unsigned start = 0;
+    for(unsigned i = 0; i < _event.pre_count; i++) {
+        if(_event.pre[(first + i) % CONFIG_KEI_EVENT_PRE].mode != sample->mode) {
+            start = i + 1;
+        }
+    }
+    for(unsigned i = start; i < _event.pre_count; i++) {
+        if(_record_add(&_event.pre[(first + i) % CONFIG_KEI_EVENT_PRE])) {
+            hdr->flags |= KEI_EVENT_FLAG_TRUNCATED;
+            break;
+        }
+        pre++;
+    }
+    hdr->pre = sys_cpu_to_le16(pre);
+
+    _event.codec.size += KEI_CODEC_SAMPLE_MAX;
+    _record_add(sample);
+
+    _event.busy      = true;
+    _event.post_left = CONFIG_KEI_EVENT_POST;
+    if(!_event.post_left || (hdr->flags & KEI_EVENT_FLAG_TRUNCATED)) {
+        _record_finish();
+    }
+}
+
+/**
+ * @brief Add a reading following the one that fired. Must be called with
+ * lock held.
+ */
+static void _record_post(const kei_interface_sample_t *sample) {
+    kei_event_hdr_t *hdr = (kei_event_hdr_t *)_record_buf(_event.events);
+
+    if(_record_add(sample)) {
+        hdr->flags |= KEI_EVENT_FLAG_TRUNCATED;
+        _record_finish();
+        return;
+    }
+
+    hdr->post = sys_cpu_to_le16(sys_le16_to_cpu(hdr->post) + 1);
+    if(!--_event.post_left) {
+        _record_finish();
+    }
+}
+
+/**
+ * @brief Get the trigger conditions a reading fires. Must be called with lock
+ * held.
+ */
+static uint8_t _event_eval(const kei_interface_sample_t *sample) {
+    const kei_interface_data_t *data  = &sample->data;
+    const _event_trig_t        *trig  = &_event.trig;
+    uint8_t                     fired = 0;
+
+    if(data->flags & KEI_DATAFLAG_OVERLOAD) {
+        if(_event.have_prev && !_event.prev_overload) {
+            fired |= KEI_EVENT_CAUSE_OVERLOAD;
+        }
+    } else if(_event.have_value) {
+        if(data->range != _event.prev_range) {
+            fired |= KEI_EVENT_CAUSE_RANGE;
+        }
+        if((trig->causes & KEI_EVENT_CAUSE_RISE) &&
+           (_level_cmp_data(_event.prev_value, _event.prev_range, &trig->rise) < 0) &&
+           (_level_cmp_data(data->value, data->range, &trig->rise) >= 0)) {
+            fired |= KEI_EVENT_CAUSE_RISE;
+        }
+        if((trig->causes & KEI_EVENT_CAUSE_FALL) &&
+           (_level_cmp_data(_event.prev_value, _event.prev_range, &trig->fall) > 0) &&
+           (_level_cmp_data(data->value, data->range, &trig->fall) <= 0)) {
+            fired |= KEI_EVENT_CAUSE_FALL;
+        }
+    }
+
+    _event.have_prev     = true;
+    _event.prev_overload = data->flags & KEI_DATAFLAG_OVERLOAD;
+    if(!_event.prev_overload) {
+        _event.have_value = true;
+        _event.prev_value = data->value;
+        _event.prev_range = data->range;
+    }
+
+    return fired & trig->causes;
+}
+
+void kei_event_push(const kei_interface_sample_t *sample) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+
+    uint8_t fired = _event.armed ? _event_eval(sample) : 0;
+    if(_event.force) {
+        fired       |= KEI_EVENT_CAUSE_FORCED;
+        _event.force = false;
+    }
+
+    if(_event.busy) {
+        _record_post(sample);
+    } else if(fired) {
+        _record_start(sample, fired);
+    }
+
+    _event.pre[_event.pre_pos] = *sample;
+    _event.pre_pos             = (_event.pre_pos + 1) % CONFIG_KEI_EVENT_PRE;
+    if(_event.pre_count < CONFIG_KEI_EVENT_PRE) {
+        _event.pre_count++;
+    }
+
+    k_mutex_unlock(&_event_lock);
+}
+
+int kei_event_set(const char *spec) {
+    _event_trig_t trig;
+    if(_event_parse(&trig, spec)) {
+        return -1;
+    }
+
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    _event.trig = trig;
+    k_mutex_unlock(&_event_lock);
+
+    return 0;
+}
+
+int kei_event_get_spec(char *buf, size_t len) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    int ret = _event_format(&_event.trig, buf, len);
+    k_mutex_unlock(&_event_lock);
+
+    return ret;
+}
+
+void kei_event_arm(bool arm) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    _event.armed = arm;
+    /* Edges are only detected between readings seen while armed */
+    _event.have_prev  = false;
+    _event.have_value = false;
+    k_mutex_unlock(&_event_lock);
+}
+
+int kei_event_force(void) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    int ret = _event.busy ? -1 : 0;
+    if(!ret) {
+        _event.force = true;
+    }
+    k_mutex_unlock(&_event_lock);
+
+    return ret;
+}
+
+void kei_event_clear(void) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    /* Indices keep counting up, so records fetched before the clear can
+     * never be mistaken for newer ones */
+    _event.held = 0;
+    k_mutex_unlock(&_event_lock);
+}
+
+void kei_event_get_info(kei_event_info_t *info) {
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    info->armed     = _event.armed;
+    info->busy      = _event.busy;
+    info->events    = _event.events;
+    info->oldest    = _event.events - _event.busy - _event.held + 1;
+    info->held      = _event.held;
+    info->truncated = _event.truncated;
+    k_mutex_unlock(&_event_lock);
+}
+
+int kei_event_read(uint32_t index, size_t off, void *buf, size_t len) {
+    if((off + len) > KEI_EVENT_RECORD_SIZE) {
+        return -1;
+    }
+
+    k_mutex_lock(&_event_lock, K_FOREVER);
+    uint32_t newest = _event.events - _event.busy;
+    int      ret    = ((newest - index) < _event.held) ? 0 : -1;
+    if(!ret) {
+        memcpy(buf, &_record_buf(index)[off], len);
+    }
+    k_mutex_unlock(&_event_lock);
+
+    return ret;
+}
+
+static int _event_init(const struct device *dev) {
+    ARG_UNUSED(dev);
+
+    if(_event_parse(&_event.trig, CONFIG_KEI_EVENT_TRIG)) {
+        _event.trig.causes = 0;
+    }
+    _event.armed = true;
+
+    return 0;
+}
+SYS_INIT(_event_init, APPLICATION, 0);
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static int _cause_format(uint8_t cause, char *buf, size_t len) {
+    int off = 0;
+
+    buf[0] = '\0';
+    for(unsigned i = 0; (i < ARRAY_SIZE(_event_causes)) && (off < (int)len); i++) {
+        if(cause & _event_causes[i].cause) {
+            off += snprintf(&buf[off], len - off, "%s%s", off ? "|" : "", _event_causes[i].name);
+        }
+    }
+
+    return off;
+}
+
+/**
+ * @brief Print a record, or its summary if max is 0
+ */
+static int _event_print(const struct shell *sh, uint32_t index, unsigned max) {
+    static uint8_t view[KEI_EVENT_RECORD_SIZE]; /* Only used by shell */
+
+    if(kei_event_read(index, 0, view, sizeof(view))) {
+        shell_print(sh, "Event #%u not held", index);
+        return -1;
+    }
+
+    const kei_event_hdr_t *hdr = (const kei_event_hdr_t *)view;
+    kei_codec_t            codec;
+    if(kei_codec_dec_init(&codec, &view[sizeof(*hdr)], sys_le16_to_cpu(hdr->len))) {
+        return -1;
+    }
+
+    char causes[48];
+    _cause_format(hdr->cause, causes, sizeof(causes));
+
+    const char        *tz = (codec.flags & KEI_CODEC_FLAG_UTC) ? "Z" : " ";
+    uint32_t           trig_seq = sys_le32_to_cpu(hdr->trig_seq);
+    kei_codec_sample_t sample;
+    unsigned           n  = 0;
+    while((n < MAX(max, 1)) && !kei_codec_dec_next(&codec, &sample)) {
+        if(!max && (sample.seq != trig_seq)) {
+            continue;
+        }
+
+        if(!max) {
+            shell_print(sh, "Event #%-4u %-14s at #%-8u %8llu.%06u%s  %u+1+%u readings, %u bytes%s",
+                        index, causes, trig_seq,
+                        (unsigned long long)(sample.time / 1000000), (uint32_t)(sample.time % 1000000), tz,
+                        sys_le16_to_cpu(hdr->pre), sys_le16_to_cpu(hdr->post), sys_le16_to_cpu(hdr->len),
+                        (hdr->flags & KEI_EVENT_FLAG_TRUNCATED) ? " (truncated)" : "");
+        } else if(sample.flags & KEI_DATAFLAG_OVERLOAD) {
+            shell_print(sh, "%c#%-8u %8llu.%06u%s  overload", (sample.seq == trig_seq) ? '*' : ' ',
+                        sample.seq, (unsigned long long)(sample.time / 1000000),
+                        (uint32_t)(sample.time % 1000000), tz);
+        } else {
+            shell_print(sh, "%c#%-8u %8llu.%06u%s  %d uU E%+d", (sample.seq == trig_seq) ? '*' : ' ',
+                        sample.seq, (unsigned long long)(sample.time / 1000000),
+                        (uint32_t)(sample.time % 1000000), tz, sample.value, sample.range);
+        }
+        n++;
+    }
+
+    return 0;
+}
+
+int kei_event_cmd(const struct shell *sh, size_t argc, char **argv) {
+    if((argc == 3) && !strcmp(argv[1], "trig")) {
+        if(kei_event_set(argv[2])) {
+            shell_print(sh, "Invalid trigger spec, e.g. \"rise:1.5E-9,overload\"");
+            return -1;
+        }
+        return 0;
+    } else if((argc == 2) && !strcmp(argv[1], "arm")) {
+        kei_event_arm(true);
+        return 0;
+    } else if((argc == 2) && !strcmp(argv[1], "disarm")) {
+        kei_event_arm(false);
+        return 0;
+    } else if((argc == 2) && !strcmp(argv[1], "force")) {
+        if(kei_event_force()) {
+            shell_print(sh, "Record already being collected");
+            return -1;
+        }
+        return 0;
+    } else if((argc == 2) && !strcmp(argv[1], "clear")) {
+        kei_event_clear();
+        return 0;
+    } else if(((argc == 3) || (argc == 4)) && !strcmp(argv[1], "show")) {
+        unsigned max = (argc == 4) ? strtoul(argv[3], NULL, 10) : UINT16_MAX;
+        return _event_print(sh, strtoul(argv[2], NULL, 10), MAX(max, 1));
+    } else if(argc != 1) {
+        shell_print(sh, "Unsupported arguments");
+        return -1;
+    }
+
+    char             spec[KEI_EVENT_SPEC_MAX];
+    kei_event_info_t info;
+    kei_event_get_spec(spec, sizeof(spec));
+    kei_event_get_info(&info);
+
+    shell_print(sh, "Trigger: %s, %s%s", spec, info.armed ? "armed" : "disarmed",
+                info.busy ? ", collecting" : "");
+    shell_print(sh, "Readings per record: %u before, %u after, %u bytes",
+                CONFIG_KEI_EVENT_PRE, CONFIG_KEI_EVENT_POST, (unsigned)KEI_EVENT_RECORD_SIZE);
+    shell_print(sh, "Records: %u/%u held, %u since boot, %u truncated",
+                info.held, CONFIG_KEI_EVENT_RECORDS, info.events, info.truncated);
+    for(uint32_t i = 0; i < info.held; i++) {
+        _event_print(sh, info.oldest + i, 0);
+    }
+
+    return 0;
+}
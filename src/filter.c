@@ -0,0 +1,290 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#include "filter.h"
+#include "interface.h"
+
+#define FILTER_EMA_Q 8 /**< Fractional bits of EMA state */
+
+static const char * const _filter_names[KEI_FILTER_MAX] = {
+    [KEI_FILTER_NONE]     = "none",
+    [KEI_FILTER_BOXCAR]   = "boxcar",
+    [KEI_FILTER_MEDIAN]   = "median",
+    [KEI_FILTER_EMA]      = "ema",
+    [KEI_FILTER_DECIMATE] = "decim",
+};
+
+/* Board-wide chain */
+K_MUTEX_DEFINE(_filter_lock);
+
+static struct {
+    kei_filter_t           filter;
+    kei_interface_sample_t output; /**< Most recent output, seq 0 if none */
+} _filter;
+
+int kei_filter_parse(kei_filter_t *filter, const char *spec) {
+    kei_filter_t parsed = { 0 };
+
+    if(!strcmp(spec, _filter_names[KEI_FILTER_NONE])) {
+        goto parse_done;
+    }
+
+    const char *p = spec;
+    while(*p) {
+        if(parsed.n_stages >= CONFIG_KEI_FILTER_STAGES) {
+            return -1;
+        }
+        kei_filter_stage_t *stage = &parsed.stages[parsed.n_stages++];
+
+        const char *colon = strchr(p, ':');
+        if(!colon) {
+            return -1;
+        }
+        for(kei_filter_type_e type = KEI_FILTER_BOXCAR; type < KEI_FILTER_MAX; type++) {
+            if((strlen(_filter_names[type]) == (size_t)(colon - p)) &&
+               !strncmp(p, _filter_names[type], colon - p)) {
+                stage->type = type;
+            }
+        }
+        if(stage->type == KEI_FILTER_NONE) {
+            return -1;
+        }
+
+        char         *end;
+        unsigned long n = strtoul(colon + 1, &end, 10);
+        if((end == (colon + 1)) || (*end && (*end != ',')) ||
+           (n < 1) || (n > UINT16_MAX)) {
+            return -1;
+        }
+        if(((stage->type == KEI_FILTER_BOXCAR) || (stage->type == KEI_FILTER_MEDIAN)) &&
+           (n > CONFIG_KEI_FILTER_LEN_MAX)) {
+            return -1;
+        }
+        stage->n = n;
+
+        p = *end ? (end + 1) : end;
+    }
+
+parse_done:
+    *filter = parsed;
+    return 0;
+}
+
+int kei_filter_format(const kei_filter_t *filter, char *buf, size_t len) {
+    if(!filter->n_stages) {
+        return snprintf(buf, len, "%s", _filter_names[KEI_FILTER_NONE]);
+    }
+
+    int off = 0;
+    for(unsigned i = 0; (i < filter->n_stages) && (off < (int)len); i++) {
+        off += snprintf(&buf[off], len - off, "%s%s:%u", i ? "," : "",
+                        _filter_names[filter->stages[i].type], filter->stages[i].n);
+    }
+
+    return off;
+}
+
+bool kei_filter_equal(const kei_filter_t *a, const kei_filter_t *b) {
+    if(a->n_stages != b->n_stages) {
+        return false;
+    }
+
+    for(unsigned i = 0; i < a->n_stages; i++) {
+        if((a->stages[i].type != b->stages[i].type) ||
+           (a->stages[i].n    != b->stages[i].n)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void kei_filter_reset(kei_filter_t *filter) {
+    for(unsigned i = 0; i < filter->n_stages; i++) {
+        kei_filter_stage_t *stage = &filter->stages[i];
+        stage->count = 0;
+        stage->pos   = 0;
+        stage->acc   = 0;
+    }
+}
+
+/**
+ * @brief Add a reading to the history of a boxcar or median stage
+ */
+static void _stage_history_add(kei_filter_stage_t *stage, int32_t value) {
+    if(stage->count < stage->n) {
+        stage->count++;
+    } else if(stage->type == KEI_FILTER_BOXCAR) {
+        stage->acc -= stage->buf[stage->pos];
+    }
+
+    stage->buf[stage->pos] = value;
+    if(++stage->pos >= stage->n) {
+        stage->pos = 0;
+    }
+}
+
+static int32_t _stage_median(const kei_filter_stage_t *stage) {
+    int32_t sorted[CONFIG_KEI_FILTER_LEN_MAX];
+    unsigned count = stage->count;
+
+    /* Insertion sort, n is small */
+    for(unsigned i = 0; i < count; i++) {
+        int32_t  value = stage->buf[i];
+        unsigned j     = i;
+        for(; j && (sorted[j - 1] > value); j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+
+    if(count & 1) {
+        return sorted[count / 2];
+    }
+    return ((int64_t)sorted[(count / 2) - 1] + sorted[count / 2]) / 2;
+}
+
+/**
+ * @brief Pass a value through a single stage
+ *
+ * @return true if the stage produced an output
+ */
+static bool _stage_apply(kei_filter_stage_t *stage, int32_t *value) {
+    switch(stage->type) {
+        case KEI_FILTER_BOXCAR:
+            _stage_history_add(stage, *value);
+            stage->acc += *value;
+            *value      = stage->acc / stage->count;
+            break;
+        case KEI_FILTER_MEDIAN:
+            _stage_history_add(stage, *value);
+            *value = _stage_median(stage);
+            break;
+        case KEI_FILTER_EMA: {
+            int64_t value_q = (int64_t)*value * (1 << FILTER_EMA_Q);
+            if(!stage->count) {
+                stage->acc   = value_q;
+                stage->count = 1;
+            } else {
+                stage->acc  += (value_q - stage->acc) / stage->n;
+            }
+            *value = stage->acc / (1 << FILTER_EMA_Q);
+            break;
+        }
+        case KEI_FILTER_DECIMATE:
+            if(++stage->count < stage->n) {
+                return false;
+            }
+            stage->count = 0;
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+int kei_filter_apply(kei_filter_t *filter, kei_interface_sample_t *sample) {
+    kei_interface_data_t *data = &sample->data;
+
+    if(!filter->n_stages) {
+        return 0;
+    }
+
+    if(data->flags & KEI_DATAFLAG_OVERLOAD) {
+        kei_filter_reset(filter);
+        return 0;
+    }
+
+    if(data->range != filter->range) {
+        kei_filter_reset(filter);
+        filter->range = data->range;
+    }
+
+    for(unsigned i = 0; i < filter->n_stages; i++) {
+        if(!_stage_apply(&filter->stages[i], &data->value)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void kei_filter_push(const kei_interface_sample_t *sample) {
+    kei_interface_sample_t out = *sample;
+
+    k_mutex_lock(&_filter_lock, K_FOREVER);
+    if(!kei_filter_apply(&_filter.filter, &out)) {
+        _filter.output = out;
+    }
+    k_mutex_unlock(&_filter_lock);
+}
+
+int kei_filter_get(kei_interface_sample_t *sample) {
+    k_mutex_lock(&_filter_lock, K_FOREVER);
+    *sample = _filter.output;
+    k_mutex_unlock(&_filter_lock);
+
+    return sample->seq ? 0 : -1;
+}
+
+int kei_filter_set(const char *spec) {
+    kei_filter_t filter;
+    if(kei_filter_parse(&filter, spec)) {
+        return -1;
+    }
+
+    k_mutex_lock(&_filter_lock, K_FOREVER);
+    _filter.filter = filter;
+    memset(&_filter.output, 0, sizeof(_filter.output));
+    k_mutex_unlock(&_filter_lock);
+
+    return 0;
+}
+
+int kei_filter_get_spec(char *buf, size_t len) {
+    k_mutex_lock(&_filter_lock, K_FOREVER);
+    int ret = kei_filter_format(&_filter.filter, buf, len);
+    k_mutex_unlock(&_filter_lock);
+
+    return ret;
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+int kei_filter_cmd(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 2) {
+        if(kei_filter_set(argv[1])) {
+            shell_print(sh, "Invalid filter spec, e.g. \"median:5,decim:4\"");
+            return -1;
+        }
+        return 0;
+    } else if(argc != 1) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    char spec[KEI_FILTER_SPEC_MAX];
+    kei_filter_get_spec(spec, sizeof(spec));
+    shell_print(sh, "Filter: %s", spec);
+
+    kei_interface_sample_t sample;
+    if(kei_filter_get(&sample)) {
+        shell_print(sh, "No output yet");
+    } else if(sample.data.flags & KEI_DATAFLAG_OVERLOAD) {
+        shell_print(sh, "Output #%u: overload", sample.seq);
+    } else {
+        shell_print(sh, "Output #%u: %d uU E%+d", sample.seq, sample.data.value, sample.data.range);
+    }
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "gate.h"
+#include "interface.h"
+
+typedef enum {
+    GATE_ITEM_CHANGE = 0,
+    GATE_ITEM_DEADBAND,
+    GATE_ITEM_DEADBAND_PPM,
+    GATE_ITEM_HEARTBEAT,
+    GATE_ITEM_MAX
+} _gate_item_e;
+
+static const char * const _gate_names[GATE_ITEM_MAX] = {
+    [GATE_ITEM_CHANGE]       = "change",
+    [GATE_ITEM_DEADBAND]     = "db",
+    [GATE_ITEM_DEADBAND_PPM] = "dbrel",
+    [GATE_ITEM_HEARTBEAT]    = "hb",
+};
+
+int kei_gate_parse(kei_gate_t *gate, const char *spec, char *rest, size_t len) {
+    kei_gate_t parsed = { 0 };
+    size_t     off    = 0;
+
+    if(rest) {
+        if(!len) {
+            return -1;
+        }
+        rest[0] = '\0';
+    }
+
+    const char *p = spec;
+    while(*p) {
+        const char *end = strchr(p, ',');
+        if(!end) {
+            end = p + strlen(p);
+        }
+        const char *colon   = memchr(p, ':', end - p);
+        size_t      namelen = (colon ? colon : end) - p;
+
+        _gate_item_e item = GATE_ITEM_MAX;
+        for(_gate_item_e i = 0; i < GATE_ITEM_MAX; i++) {
+            if((strlen(_gate_names[i]) == namelen) && !strncmp(p, _gate_names[i], namelen)) {
+                item = i;
+            }
+        }
+
+        if(item == GATE_ITEM_MAX) {
+            /* Not ours, e.g. a filter stage. "none" is left to the caller,
+             * unless it has no use for the rest. */
+            bool none = ((end - p) == 4) && !strncmp(p, "none", 4);
+            if(none && !rest) {
+                goto parse_next;
+            }
+            if(!rest || ((off + (end - p) + 2) > len)) {
+                return -1;
+            }
+            off += snprintf(&rest[off], len - off, "%s%.*s", off ? "," : "", (int)(end - p), p);
+            goto parse_next;
+        }
+
+        if((item == GATE_ITEM_CHANGE) != !colon) {
+            return -1;
+        }
+        unsigned long n = 0;
+        if(colon) {
+            char *nend;
+            n = strtoul(colon + 1, &nend, 10);
+            if((nend == (colon + 1)) || (nend != end) || (n > UINT32_MAX)) {
+                return -1;
+            }
+        }
+
+        parsed.enabled = true;
+        switch(item) {
+            case GATE_ITEM_DEADBAND:
+                parsed.deadband = n;
+                break;
+            case GATE_ITEM_DEADBAND_PPM:
+                parsed.deadband_ppm = n;
+                break;
+            case GATE_ITEM_HEARTBEAT:
+                if(!n) {
+                    return -1;
+                }
+                parsed.heartbeat_ms  = n;
+                parsed.heartbeat_cyc = k_ms_to_cyc_ceil64(n);
+                break;
+            default:
+                break;
+        }
+
+parse_next:
+        p = *end ? (end + 1) : end;
+    }
+
+    *gate = parsed;
+    return 0;
+}
+
+int kei_gate_format(const kei_gate_t *gate, char *buf, size_t len) {
+    if(!gate->enabled) {
+        return snprintf(buf, len, "none");
+    }
+
+    int off = 0;
+    if(gate->deadband) {
+        off += snprintf(&buf[off], len - off, "%s:%u", _gate_names[GATE_ITEM_DEADBAND],
+                        gate->deadband);
+    }
+    if(gate->deadband_ppm && (off < (int)len)) {
+        off += snprintf(&buf[off], len - off, "%s%s:%u", off ? "," : "",
+                        _gate_names[GATE_ITEM_DEADBAND_PPM], gate->deadband_ppm);
+    }
+    if(gate->heartbeat_ms && (off < (int)len)) {
+        off += snprintf(&buf[off], len - off, "%s%s:%u", off ? "," : "",
+                        _gate_names[GATE_ITEM_HEARTBEAT], gate->heartbeat_ms);
+    }
+    if(!off) {
+        off = snprintf(buf, len, "%s", _gate_names[GATE_ITEM_CHANGE]);
+    }
+
+    return off;
+}
+
+bool kei_gate_equal(const kei_gate_t *a, const kei_gate_t *b) {
+    return (a->enabled      == b->enabled)      &&
+           (a->deadband     == b->deadband)     &&
+           (a->deadband_ppm == b->deadband_ppm) &&
+           (a->heartbeat_ms == b->heartbeat_ms);
+}
+
+int kei_gate_apply(kei_gate_t *gate, const kei_interface_sample_t *sample) {
+    const kei_interface_data_t *data = &sample->data;
+    int                         ret  = 0;
+
+    if(!gate->enabled) {
+        return 0;
+    }
+
+    if(gate->have_last && (data->range == gate->range) && (data->flags == gate->flags)) {
+        int64_t  diff = (int64_t)data->value - gate->value;
+        uint64_t band = MAX((uint64_t)gate->deadband,
+                            ((uint64_t)llabs(gate->value) * gate->deadband_ppm) / 1000000);
+
+        if((uint64_t)llabs(diff) <= band) {
+            if(!gate->heartbeat_ms ||
+               ((sample->timestamp - gate->timestamp) < gate->heartbeat_cyc)) {
+                gate->suppressed++;
+                return -1;
+            }
+            ret = KEI_GATE_HEARTBEAT;
+        }
+    }
+
+    gate->have_last = true;
+    gate->value     = data->value;
+    gate->range     = data->range;
+    gate->flags     = data->flags;
+    gate->timestamp = sample->timestamp;
+
+    return ret;
+}
@@ -7,7 +7,14 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/shell/shell.h>
 
+#include "bench.h"
+#include "datalog.h"
+#include "event.h"
+#include "filter.h"
 #include "interface.h"
+#include "perf.h"
+#include "stats.h"
+#include "timebase.h"
 
 LOG_MODULE_REGISTER(kei_int, LOG_LEVEL_DBG);
 
@@ -17,6 +24,10 @@ LOG_MODULE_REGISTER(kei_int, LOG_LEVEL_DBG);
 #define N_RANGE_BITS        5
 #define N_SENSITIVITY_BITS  2
 
+BUILD_ASSERT(DT_PROP_LEN(ZEPHYR_USER_NODE, data_gpios)        == N_DATA_BITS);
+BUILD_ASSERT(DT_PROP_LEN(ZEPHYR_USER_NODE, range_gpios)       == N_RANGE_BITS);
+BUILD_ASSERT(DT_PROP_LEN(ZEPHYR_USER_NODE, sensitivity_gpios) == N_SENSITIVITY_BITS);
+
 static const struct {
     struct gpio_dt_spec polarity;
     struct gpio_dt_spec overload;
@@ -65,76 +76,406 @@ static const struct {
 };
 
 
+/*
+ * Port-level capture
+ *
+ * Rather than reading each pin individually within the print ISR, every GPIO
+ * port the interface is spread across is read once, and the BCD values are
+ * then decoded from those snapshots using the tables below, which are
+ * generated from the zephyr,user pin lists at compile time.
+ */
+
+#define N_PORTS 4
+
+static const struct device *const _int_ports[N_PORTS] = {
+    DEVICE_DT_GET(DT_NODELABEL(gpioa)),
+    DEVICE_DT_GET(DT_NODELABEL(gpiob)),
+    DEVICE_DT_GET(DT_NODELABEL(gpioc)),
+    DEVICE_DT_GET(DT_NODELABEL(gpiod))
+};
+
+/* Index into _int_ports of the controller for the given pin, N_PORTS if the
+ * pin is on a port that is not captured. */
+#define _PORT_IDX(node, prop, idx)                                                           \
+    ((DT_DEP_ORD(DT_GPIO_CTLR_BY_IDX(node, prop, idx)) == DT_DEP_ORD(DT_NODELABEL(gpioa))) ? 0 : \
+     (DT_DEP_ORD(DT_GPIO_CTLR_BY_IDX(node, prop, idx)) == DT_DEP_ORD(DT_NODELABEL(gpiob))) ? 1 : \
+     (DT_DEP_ORD(DT_GPIO_CTLR_BY_IDX(node, prop, idx)) == DT_DEP_ORD(DT_NODELABEL(gpioc))) ? 2 : \
+     (DT_DEP_ORD(DT_GPIO_CTLR_BY_IDX(node, prop, idx)) == DT_DEP_ORD(DT_NODELABEL(gpiod))) ? 3 : \
+     N_PORTS)
+
+/* Value contributed by BCD bit idx: 1, 2, 4, 8, 10, 20, 40, 80, 100, ... */
+#define _BCD_WEIGHT(idx) \
+    ((1U << ((idx) % 4)) * (((idx) < 4) ? 1 : ((idx) < 8) ? 10 : ((idx) < 12) ? 100 : 1000))
+
+typedef struct {
+    gpio_port_pins_t mask;   /**< Pin mask within port */
+    uint16_t         weight; /**< Value contributed when pin is active */
+    uint8_t          port;   /**< Index into _int_ports */
+} _bcd_bit_t;
+
+#define _BCD_BIT_INIT(node, prop, idx)                      \
+    {                                                       \
+        .mask   = BIT(DT_GPIO_PIN_BY_IDX(node, prop, idx)), \
+        .weight = _BCD_WEIGHT(idx),                         \
+        .port   = _PORT_IDX(node, prop, idx)                \
+    }
+#define _BCD_BIT(node, prop, idx) _BCD_BIT_INIT(node, prop, idx),
+
+static const struct {
+    _bcd_bit_t polarity;
+    _bcd_bit_t overload;
+
+    _bcd_bit_t data_bcd       [N_DATA_BITS];
+    _bcd_bit_t range_bcd      [N_RANGE_BITS];
+    _bcd_bit_t sensitivity_bcd[N_SENSITIVITY_BITS];
+} _int_bcd = {
+    .polarity        = _BCD_BIT_INIT(ZEPHYR_USER_NODE, polarity_gpios, 0),
+    .overload        = _BCD_BIT_INIT(ZEPHYR_USER_NODE, overload_gpios, 0),
+    .data_bcd        = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, data_gpios,        _BCD_BIT) },
+    .range_bcd       = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, range_gpios,       _BCD_BIT) },
+    .sensitivity_bcd = { DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, sensitivity_gpios, _BCD_BIT) }
+};
+
+/**< Snapshot of all captured GPIO ports */
+typedef struct {
+    gpio_port_value_t port[N_PORTS];
+} _port_snapshot_t;
+
+/**< Capture latched by the print ISR, for decoding by the worker thread */
+typedef struct {
+    uint64_t         timestamp;
+    _port_snapshot_t snap;
+} _capture_t;
+
+K_MSGQ_DEFINE(_capture_queue, sizeof(_capture_t), CONFIG_KEI_CAPTURE_QUEUE_LEN, 8);
+
+
+#define SAMPLE_BUF_LEN CONFIG_KEI_SAMPLE_BUF_LEN
+BUILD_ASSERT((SAMPLE_BUF_LEN >= 4) && !(SAMPLE_BUF_LEN & (SAMPLE_BUF_LEN - 1)),
+             "Sample buffer length must be a power of two");
+
 static struct {
-    kei_interface_rawdata_t last_sample;    /**< Last sample received from instrument */
     kei_interface_mode_e    mode;           /**< Current instrument mode/units */
 
+    /* Single-producer (worker thread), multi-consumer sample buffer. Each slot's
+     * sequence number is cleared while it is being written, so readers can
+     * detect when a slot was overwritten while they were copying it. */
+    struct {
+        kei_interface_sample_t buf[SAMPLE_BUF_LEN];
+        volatile uint32_t      head;        /**< Sequence number of most recent sample */
+    } samples;
+
     struct {
         kei_interface_trigmode_e mode;      /**< Current trigger mode */
         uint32_t                 period_ms; /**< Trigger period, in ms, when using periodic trigger */
+
+        struct k_timer           period_timer; /**< Fires periodic triggers, or chained trigger timeout */
+        struct k_timer           pulse_timer;  /**< Ends trigger pulse */
+
+        uint64_t                 fired;        /**< Time of last trigger pulse, in cycles */
+
+        struct k_mutex           manual_lock;   /**< Protects manual_* */
+        uint32_t                 manual_seq;    /**< Most recent sample at time of last manual trigger */
+        int64_t                  manual_fired;  /**< Uptime of last manual trigger, in ms */
+        uint64_t                 last_print;   /**< Time of last reading in chained mode, in cycles */
+
+        uint64_t                 start;        /**< Time of first periodic trigger, in cycles */
+        uint64_t                 period_cyc;   /**< Trigger period, in cycles */
+        uint32_t                 n;            /**< Number of periods since start */
+
+        kei_interface_trigstats_t stats;       /**< Periodic trigger timing statistics */
     } trig;
 
     struct gpio_callback print_gpio_callback;
+    uint32_t             print_latency_cyc; /**< Print edge to timestamp latency, in cycles */
+    uint64_t             last_capture;      /**< Time of last PRINT strobe captured, in cycles */
 
-    struct k_thread  thread;
+    struct {
+        bool                      validate;        /**< Double-sample lines, rejecting torn reads */
+        gpio_port_pins_t          masks[N_PORTS];  /**< Pins of interest within each port */
+        kei_interface_capstats_t  stats;
+    } capture;
+
+    struct k_thread      thread;
 
-    struct k_condvar data_ready_cond;
-    struct k_mutex   data_ready_mutex;
+    sys_slist_t          waiters;           /**< Threads waiting for a new sample */
 } _data;
 
-static int kei_interface_trigger(int wait);
+/**< Thread waiting for a sample newer than seq */
+typedef struct {
+    sys_snode_t  node;
+    uint32_t     seq;
+    struct k_sem sem;
+} _sample_waiter_t;
+
+static void _trig_chain_next(uint64_t print_time);
 
 /**
- * @brief Read a whole value given a set of BCD inputs
+ * @brief Read the state of every captured GPIO port
  */
-static int _bcd_read(const struct gpio_dt_spec *gpios, int count) {
-    unsigned value = 0;
-    unsigned mul   = 1;
-    while(count) {
-        for(unsigned bit = 0; (bit < 4) && count; bit++, count--, gpios++) {
-            int pin = gpio_pin_get_dt(gpios);
-            if(pin < 0) {
-                return -1;
-            } else if(pin) {
-                value += (1U << bit) * mul;
+static int _port_capture(_port_snapshot_t *snap) {
+    for(unsigned i = 0; i < N_PORTS; i++) {
+        if(gpio_port_get(_int_ports[i], &snap->port[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Capture port state, sampling repeatedly until two consecutive
+ * captures agree, if validation is enabled
+ *
+ * @param snap Where to store port state
+ * @param stats Where to count retries and torn captures
+ *
+ * @return 0 on success, -1 on failure or if the bus did not settle
+ */
+static int _port_capture_validated(_port_snapshot_t *snap, kei_interface_capstats_t *stats) {
+    if(_port_capture(snap)) {
+        return -1;
+    }
+    if(!_data.capture.validate) {
+        return 0;
+    }
+
+    for(unsigned attempt = 0; ; attempt++) {
+        _port_snapshot_t check;
+
+#if (CONFIG_KEI_CAPTURE_SETTLE_US > 0)
+        k_busy_wait(CONFIG_KEI_CAPTURE_SETTLE_US);
+#endif
+
+        if(_port_capture(&check)) {
+            return -1;
+        }
+
+        bool match = true;
+        for(unsigned i = 0; i < N_PORTS; i++) {
+            if((snap->port[i] ^ check.port[i]) & _data.capture.masks[i]) {
+                match = false;
+                break;
             }
         }
-        mul *= 10;
+        if(match) {
+            return 0;
+        }
+
+        if(attempt >= CONFIG_KEI_CAPTURE_RETRIES) {
+            stats->torn++;
+            return -1;
+        }
+
+        stats->retries++;
+        *snap = check;
+    }
+}
+
+/**
+ * @brief Read a whole value given a set of BCD inputs from a port snapshot
+ */
+static int _bcd_read(const _bcd_bit_t *bits, int count, const _port_snapshot_t *snap) {
+    unsigned value = 0;
+    for(; count; count--, bits++) {
+        if(snap->port[bits->port] & bits->mask) {
+            value += bits->weight;
+        }
     }
     return value;
 }
 
+/**
+ * @brief Add a sample to the sample buffer, assigning it the next sequence
+ * number. Must only be called from one context.
+ */
+static void _sample_publish(kei_interface_sample_t *sample) {
+    uint32_t seq = _data.samples.head + 1;
+    kei_interface_sample_t *slot = &_data.samples.buf[seq % SAMPLE_BUF_LEN];
+
+    ((volatile kei_interface_sample_t *)slot)->seq = 0;
+    compiler_barrier();
+
+    sample->seq = 0;
+    memcpy(slot, sample, sizeof(*slot));
+
+    compiler_barrier();
+    ((volatile kei_interface_sample_t *)slot)->seq = seq;
+    sample->seq = seq;
+    compiler_barrier();
+    _data.samples.head = seq;
+}
+
+/**
+ * @brief Copy a sample out of the sample buffer
+ *
+ * @return 0 on success, -1 if the slot does not (or no longer) hold the
+ * requested sample
+ */
+static int _sample_copy(uint32_t seq, kei_interface_sample_t *sample) {
+    const volatile kei_interface_sample_t *slot = &_data.samples.buf[seq % SAMPLE_BUF_LEN];
+
+    if(slot->seq != seq) {
+        return -1;
+    }
+    compiler_barrier();
+
+    memcpy(sample, (const void *)slot, sizeof(*sample));
+
+    compiler_barrier();
+    if(slot->seq != seq) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Timestamp and capture a PRINT strobe, the part of the print ISR that
+ * neither publishes the reading nor touches trigger state
+ *
+ * @param entry Cycle count at ISR entry
+ * @param capture Where to store the capture
+ * @param stats Where to count retries and torn captures
+ */
+static int _print_latch(uint32_t entry, _capture_t *capture, kei_interface_capstats_t *stats) {
+    /* The fixed latency between the edge and entry is compensated for */
+    capture->timestamp = kei_time_extend(entry - _data.print_latency_cyc);
+
+    return _port_capture_validated(&capture->snap, stats);
+}
+
 /**
  * @brief Callback for print line going low
+ *
+ * Only latches the port state and timestamp, decoding is left to the worker
+ * thread to keep time spent in the ISR to a minimum.
  */
 static void _print_callback(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
-    int data        = _bcd_read(_int_gpios.data_bcd,        N_DATA_BITS);
-    int range       = _bcd_read(_int_gpios.range_bcd,       N_RANGE_BITS);
-    int sensitivity = _bcd_read(_int_gpios.sensitivity_bcd, N_SENSITIVITY_BITS);
+    /* Timestamp first, so the time spent capturing does not affect it */
+    uint32_t   entry = k_cycle_get_32();
+    _capture_t capture;
 
-    if((data < 0) || (range < 0) || (sensitivity < 0)) {
+    if(_print_latch(entry, &capture, &_data.capture.stats)) {
+        kei_perf_add(KEI_PERF_ISR, k_cycle_get_32() - entry);
         return;
     }
 
-    if(gpio_pin_get_dt(&_int_gpios.polarity) == 1) {
-        data *= -1;
+    if(k_msgq_put(&_capture_queue, &capture, K_NO_WAIT)) {
+        _data.capture.stats.dropped++;
+    } else {
+        _data.capture.stats.captured++;
+    }
+
+    /* First reading since the last trigger pulse */
+    if(_data.trig.fired > _data.last_capture) {
+        kei_perf_add(KEI_PERF_TRIG, (uint32_t)(capture.timestamp - _data.trig.fired));
+    }
+    _data.last_capture = capture.timestamp;
+
+    if(_data.trig.mode == KEI_TRIGMODE_CHAINED) {
+        _trig_chain_next(capture.timestamp);
     }
 
-    _data.last_sample.value       = data;
-    _data.last_sample.range       = range;
-    _data.last_sample.sensitivity = sensitivity;
-    _data.last_sample.flags       = 0;
-    if(gpio_pin_get_dt(&_int_gpios.overload) == 1) {
-        _data.last_sample.flags  |= KEI_DATAFLAG_OVERLOAD;
+    kei_perf_add(KEI_PERF_ISR, k_cycle_get_32() - entry);
+}
+
+/* Micro-units per least-significant digit, by sensitivity */
+static const uint32_t _sensitivity_scale[1U << N_SENSITIVITY_BITS] = {
+    100, 1000, 10000, 100000
+};
+
+/**
+ * @brief Decode a port snapshot into a sample
+ */
+static void _sample_decode(const _port_snapshot_t *snap, kei_interface_sample_t *sample) {
+    kei_interface_rawdata_t *raw  = &sample->raw;
+    kei_interface_data_t    *data = &sample->data;
+
+    /* Kept with the sample, as the mode may change before it is consumed */
+    sample->mode = _data.mode;
+
+    int value = _bcd_read(_int_bcd.data_bcd, N_DATA_BITS, snap);
+    if(_bcd_read(&_int_bcd.polarity, 1, snap)) {
+        value *= -1;
     }
 
-    /* TODO: Timestamp sample */
+    raw->value       = value;
+    raw->range       = _bcd_read(_int_bcd.range_bcd,       N_RANGE_BITS,       snap);
+    raw->sensitivity = _bcd_read(_int_bcd.sensitivity_bcd, N_SENSITIVITY_BITS, snap);
+    raw->flags       = 0;
+    if(_bcd_read(&_int_bcd.overload, 1, snap)) {
+        raw->flags  |= KEI_DATAFLAG_OVERLOAD;
+    }
 
-    k_condvar_signal(&_data.data_ready_cond);
+    /* NOTE: Currently all flags that apply to rawdata apply to data as well */
+    data->flags = raw->flags;
+    if(data->flags & KEI_DATAFLAG_OVERLOAD) {
+        data->value = 0;
+        data->range = 0;
+        return;
+    }
+
+    data->value = raw->value * (int32_t)_sensitivity_scale[raw->sensitivity];
+
+    /* Determine sign power based on current mode */
+    switch(sample->mode) {
+        case KEI_MODE_VOLTS:
+        case KEI_MODE_OHMS:
+            data->range = raw->range;
+            break;
+        case KEI_MODE_NONE:
+        case KEI_MODE_COULOMBS:
+        case KEI_MODE_AMPERES:
+        default:
+            data->range = -raw->range;
+            break;
+    }
 }
 
 K_THREAD_STACK_DEFINE(_kei_thread_stack, 1024);
-static void _kei_thread_main(void *p1, void *p2, void *p3);
+
+/**
+ * @brief Worker thread, decodes captures and publishes samples
+ */
+static void _kei_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    _capture_t capture;
+
+    while(1) {
+        k_msgq_get(&_capture_queue, &capture, K_FOREVER);
+
+        kei_interface_sample_t sample = {
+            .timestamp = capture.timestamp
+        };
+        _sample_decode(&capture.snap, &sample);
+        _sample_publish(&sample);
+
+        /* Consumers fed from here guard their state with mutexes, never
+         * spinlocks or irq_lock(), which on this core would delay the PRINT
+         * interrupt for as long as they hold them */
+        kei_stats_push(&sample);
+        kei_filter_push(&sample);
+#if (CONFIG_KEI_EVENT)
+        kei_event_push(&sample);
+#endif
+
+        /* Waiters are only added or removed with interrupts locked */
+        unsigned key = irq_lock();
+        _sample_waiter_t *waiter;
+        SYS_SLIST_FOR_EACH_CONTAINER(&_data.waiters, waiter, node) {
+            if((int32_t)(_data.samples.head - waiter->seq) > 0) {
+                k_sem_give(&waiter->sem);
+            }
+        }
+        irq_unlock(key);
+    }
+}
+
+static void _trig_pulse_timer_expiry(struct k_timer *timer);
+static void _trig_period_timer_expiry(struct k_timer *timer);
 
 int kei_interface_init(void) {
     memset(&_data, 0, sizeof(_data));
@@ -142,8 +483,13 @@ int kei_interface_init(void) {
     _data.trig.mode      = KEI_TRIGMODE_FREERUNNING;
     _data.trig.period_ms = 1000;
 
-    k_condvar_init(&_data.data_ready_cond);
-    k_mutex_init(&_data.data_ready_mutex);
+    _data.print_latency_cyc = k_ns_to_cyc_floor32(CONFIG_KEI_PRINT_LATENCY_NS);
+
+    sys_slist_init(&_data.waiters);
+    k_mutex_init(&_data.trig.manual_lock);
+
+    k_timer_init(&_data.trig.pulse_timer,  _trig_pulse_timer_expiry,  NULL);
+    k_timer_init(&_data.trig.period_timer, _trig_period_timer_expiry, NULL);
 
     if(gpio_pin_configure_dt(&_int_gpios.polarity, GPIO_INPUT)           ||
        gpio_pin_configure_dt(&_int_gpios.overload, GPIO_INPUT)           ||
@@ -170,6 +516,23 @@ int kei_interface_init(void) {
         }
     }
 
+    /* Make sure every pin in the decode tables lands on a captured port,
+     * and collect the pins compared when validating captures. */
+    const _bcd_bit_t *bits = (const _bcd_bit_t *)&_int_bcd;
+    for(unsigned i = 0; i < (sizeof(_int_bcd) / sizeof(_bcd_bit_t)); i++) {
+        if(bits[i].port >= N_PORTS) {
+            LOG_ERR("Interface pin on uncaptured port");
+            return -1;
+        }
+        _data.capture.masks[bits[i].port] |= bits[i].mask;
+    }
+    _data.capture.validate = IS_ENABLED(CONFIG_KEI_CAPTURE_VALIDATE);
+    for(unsigned i = 0; i < N_PORTS; i++) {
+        if(!device_is_ready(_int_ports[i])) {
+            return -1;
+        }
+    }
+
     LOG_INF("GPIOs initialized");
 
 
@@ -187,37 +550,141 @@ int kei_interface_init(void) {
     LOG_INF("Print interrupt enabled");
 
     k_thread_create(&_data.thread, _kei_thread_stack, K_THREAD_STACK_SIZEOF(_kei_thread_stack),
-                    _kei_thread_main, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
+                    _kei_thread_main, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+    k_thread_name_set(&_data.thread, "kei");
 
     return 0;
 }
 
+/**
+ * @brief Start a trigger pulse, which is ended by the pulse timer
+ *
+ * The pulse lasts at least CONFIG_KEI_TRIG_PULSE_US, and up to a tick longer.
+ * It is not busy-waited out, which would hold up the timer and PRINT ISRs it
+ * is started from, and hide it from the emulator's TRIGGER poll. Safe to call
+ * from ISRs.
+ */
+static int _trig_pulse(void) {
+    if(gpio_pin_set_dt(&_int_gpios.trigger, 1)) {
+        return -1;
+    }
+    _data.trig.fired = kei_time_cycles();
 
-static void _kei_thread_main(void *p1, void *p2, void *p3) {
-    ARG_UNUSED(p1);
-    ARG_UNUSED(p2);
-    ARG_UNUSED(p3);
+    k_timer_start(&_data.trig.pulse_timer, K_USEC(CONFIG_KEI_TRIG_PULSE_US), K_NO_WAIT);
 
-    LOG_INF("KEI thread start");
+    return 0;
+}
 
-    int64_t next_trig = 0;
+static void _trig_pulse_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
 
-    while(1) {
-        if(_data.trig.mode == KEI_TRIGMODE_PERIODIC) {
-            int64_t ticks = k_uptime_ticks();
-            if(ticks >= next_trig) {
-                kei_interface_trigger(0);
-                next_trig = next_trig + ((_data.trig.period_ms * CONFIG_SYS_CLOCK_TICKS_PER_SEC) / 1000);
-                if(ticks >= next_trig) {
-                    next_trig = ticks + ((_data.trig.period_ms * CONFIG_SYS_CLOCK_TICKS_PER_SEC) / 1000);
-                }
-            }
+    gpio_pin_set_dt(&_int_gpios.trigger, 0);
+}
 
-            k_sleep(K_TICKS(next_trig - ticks));
-        } else {
-            k_msleep(1000);
+static void _trig_period_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
+
+    /* Left over from a mode being switched away from */
+    if((_data.trig.mode != KEI_TRIGMODE_PERIODIC) &&
+       (_data.trig.mode != KEI_TRIGMODE_CHAINED)) {
+        return;
+    }
+
+    if(_data.trig.mode == KEI_TRIGMODE_CHAINED) {
+        /* No reading followed the last trigger, restart the chain */
+        _data.trig.stats.timeouts++;
+        _data.trig.last_print = 0;
+        _trig_pulse();
+        k_timer_start(&_data.trig.period_timer, K_MSEC(CONFIG_KEI_TRIG_CHAIN_TIMEOUT_MS), K_NO_WAIT);
+        return;
+    }
+
+    uint64_t now = kei_time_cycles();
+
+    if(_data.trig.n == 0) {
+        _data.trig.start = now;
+    }
+
+    int64_t dev = (int64_t)(now - (_data.trig.start + (_data.trig.n * _data.trig.period_cyc)));
+
+    kei_interface_trigstats_t *stats = &_data.trig.stats;
+    if(dev >= (int64_t)_data.trig.period_cyc) {
+        /* One or more triggers were missed entirely, skip ahead to the
+         * current period rather than counting it as deviation. */
+        stats->overruns++;
+        _data.trig.n += dev / _data.trig.period_cyc;
+        dev          %= _data.trig.period_cyc;
+    }
+
+    int32_t dev_us = (dev < 0) ? -(int32_t)k_cyc_to_us_floor64(-dev) :
+                                  (int32_t)k_cyc_to_us_floor64(dev);
+    if(!stats->count || (dev_us < stats->min_us)) {
+        stats->min_us = dev_us;
+    }
+    if(!stats->count || (dev_us > stats->max_us)) {
+        stats->max_us = dev_us;
+    }
+    stats->sum_us += dev_us;
+    stats->count++;
+
+    _data.trig.n++;
+
+    _trig_pulse();
+}
+
+/**
+ * @brief Trigger the next reading in chained mode, called upon receiving a
+ * reading
+ */
+static void _trig_chain_next(uint64_t print_time) {
+    kei_interface_trigstats_t *stats = &_data.trig.stats;
+
+    /* Conversion time of the attached unit, and achieved reading interval,
+     * as moving averages */
+    if(_data.trig.fired && (print_time > _data.trig.fired)) {
+        int32_t conv_us = k_cyc_to_us_floor64(print_time - _data.trig.fired);
+        if(stats->conv_us) {
+            conv_us = (int32_t)stats->conv_us + ((conv_us - (int32_t)stats->conv_us) / 8);
         }
+        stats->conv_us = conv_us;
     }
+    if(_data.trig.last_print && (print_time > _data.trig.last_print)) {
+        int32_t interval_us = k_cyc_to_us_floor64(print_time - _data.trig.last_print);
+        if(stats->interval_us) {
+            interval_us = (int32_t)stats->interval_us + ((interval_us - (int32_t)stats->interval_us) / 8);
+        }
+        stats->interval_us = interval_us;
+    }
+    _data.trig.last_print = print_time;
+
+    stats->count++;
+    _trig_pulse();
+    k_timer_start(&_data.trig.period_timer, K_MSEC(CONFIG_KEI_TRIG_CHAIN_TIMEOUT_MS), K_NO_WAIT);
+}
+
+/**
+ * @brief Start chained triggering
+ */
+static void _trig_chain_start(void) {
+    unsigned key = irq_lock();
+    _data.trig.fired      = 0;
+    _data.trig.last_print = 0;
+    _trig_pulse();
+    irq_unlock(key);
+
+    k_timer_start(&_data.trig.period_timer, K_MSEC(CONFIG_KEI_TRIG_CHAIN_TIMEOUT_MS), K_NO_WAIT);
+}
+
+/**
+ * @brief (Re)start periodic triggering with the current period
+ */
+static void _trig_period_start(void) {
+    unsigned key = irq_lock();
+    _data.trig.n          = 0;
+    _data.trig.period_cyc = k_ms_to_cyc_floor64(_data.trig.period_ms);
+    irq_unlock(key);
+
+    k_timer_start(&_data.trig.period_timer, K_NO_WAIT, K_MSEC(_data.trig.period_ms));
 }
 
 static const char *_unit_str[KEI_MODE_MAX] = {
@@ -266,40 +733,118 @@ int kei_interface_set_mode(kei_interface_mode_e mode) {
     return 0;
 }
 
-/**
- * @brief Trigger a reading
- *
- * @param wait If non-zero, wait for data to come in before returning
- */
-static int kei_interface_trigger(int wait) {
-    if(_data.trig.mode == KEI_TRIGMODE_FREERUNNING) {
+kei_interface_mode_e kei_interface_get_mode(void) {
+    return _data.mode;
+}
+
+int kei_interface_trigger(uint32_t *seq) {
+    if((_data.trig.mode == KEI_TRIGMODE_NONE) ||
+       (_data.trig.mode == KEI_TRIGMODE_FREERUNNING)) {
         return -1;
     }
 
-    if(gpio_pin_set_dt(&_int_gpios.trigger, 1)) {
-        return -1;
+    k_mutex_lock(&_data.trig.manual_lock, K_FOREVER);
+
+    /* A reading is in flight if no sample has come in since the last
+     * trigger, and it has not yet timed out. Concurrent readers then all
+     * receive the same conversion. */
+    int64_t now = k_uptime_get();
+    if(!_data.trig.manual_fired ||
+       (_data.samples.head != _data.trig.manual_seq) ||
+       ((now - _data.trig.manual_fired) >= KEI_TRIG_WAIT_MS)) {
+        _data.trig.manual_seq = _data.samples.head;
+        if(_trig_pulse()) {
+            k_mutex_unlock(&_data.trig.manual_lock);
+            return -1;
+        }
+        _data.trig.manual_fired = now;
+        _data.trig.stats.count++;
+    } else {
+        _data.trig.stats.joined++;
     }
+    *seq = _data.trig.manual_seq;
+
+    k_mutex_unlock(&_data.trig.manual_lock);
 
-    k_usleep(100);
+    return 0;
+}
 
-    if(gpio_pin_set_dt(&_int_gpios.trigger, 0)) {
+int kei_interface_get_sample(kei_interface_sample_t *sample) {
+    if(!sample) {
         return -1;
     }
 
-    if (wait) {
-        if(k_mutex_lock(&_data.data_ready_mutex, K_MSEC(100))) {
+    /* If the copy fails, the sample was replaced while copying it, so try
+     * again with the new one. */
+    uint32_t seq;
+    do {
+        seq = _data.samples.head;
+        if(seq == 0) {
             return -1;
         }
+    } while(_sample_copy(seq, sample));
+
+    return 0;
+}
+
+uint32_t kei_interface_get_seq(void) {
+    return _data.samples.head;
+}
+
+int kei_interface_wait_sample(uint32_t seq, int32_t timeout_ms) {
+    _sample_waiter_t waiter = {
+        .seq = seq
+    };
+    k_sem_init(&waiter.sem, 0, 1);
+
+    /* Checking for the sample and registering as a waiter must be atomic
+     * with respect to the worker thread, otherwise the wake-up could be
+     * lost. */
+    unsigned key = irq_lock();
+    if((int32_t)(_data.samples.head - seq) > 0) {
+        irq_unlock(key);
+        return 0;
+    }
+    sys_slist_append(&_data.waiters, &waiter.node);
+    irq_unlock(key);
+
+    int ret = k_sem_take(&waiter.sem, (timeout_ms < 0) ? K_FOREVER : K_MSEC(timeout_ms));
+
+    key = irq_lock();
+    sys_slist_find_and_remove(&_data.waiters, &waiter.node);
+    irq_unlock(key);
+
+    return ret ? -1 : 0;
+}
+
+void kei_interface_reader_init(kei_interface_reader_t *reader) {
+    reader->next    = _data.samples.head + 1;
+    reader->dropped = 0;
+    reader->perf_id = 0;
+}
 
-        if (k_condvar_wait(&_data.data_ready_cond, &_data.data_ready_mutex, K_MSEC(50))) {
-            k_mutex_unlock(&_data.data_ready_mutex);
+int kei_interface_read(kei_interface_reader_t *reader, kei_interface_sample_t *sample) {
+    while(1) {
+        uint32_t head = _data.samples.head;
+        if((int32_t)(head - reader->next) < 0) {
             return -1;
         }
 
-        k_mutex_unlock(&_data.data_ready_mutex);
-    }
+        /* The slot following head may be in the process of being
+         * overwritten, so keep at least one slot of distance. */
+        if((head - reader->next) >= (SAMPLE_BUF_LEN - 1)) {
+            uint32_t next = head - (SAMPLE_BUF_LEN - 2);
+            reader->dropped += next - reader->next;
+            reader->next     = next;
+        }
 
-    return 0;
+        if(!_sample_copy(reader->next, sample)) {
+            kei_perf_add_depth(reader, head - reader->next + 1);
+            kei_perf_add(KEI_PERF_AGE, k_cycle_get_32() - (uint32_t)sample->timestamp);
+            reader->next++;
+            return 0;
+        }
+    }
 }
 
 int kei_interface_get_data(kei_interface_data_t *data) {
@@ -308,42 +853,19 @@ int kei_interface_get_data(kei_interface_data_t *data) {
     }
 
     if(_data.trig.mode == KEI_TRIGMODE_MANUAL) {
-        if(kei_interface_trigger(1)) {
+        uint32_t seq;
+        if(kei_interface_trigger(&seq) ||
+           kei_interface_wait_sample(seq, KEI_TRIG_WAIT_MS)) {
             return -1;
         }
     }
 
-    /* TODO: Ensure raw data doesn't get overwritted while we are reading it */
-    memset(data, 0, sizeof(*data));
-
-    /* NOTE: Currently all flags that apply to rawdata apply to data as well */
-    data->flags = _data.last_sample.flags;
-
-    if(data->flags & KEI_DATAFLAG_OVERLOAD) {
-        return 0;
+    kei_interface_sample_t sample;
+    if(kei_interface_get_sample(&sample)) {
+        return -1;
     }
 
-    unsigned value = ABS(_data.last_sample.value);
-
-    /* Convert base value to micro-units */
-    value *= 100; /* Least-significant digit at sensitivity 0 is 100 micro-units */
-    for(unsigned i = _data.last_sample.sensitivity; i > 0; i--) {
-        value *= 10;
-    }
-    data->value = (_data.last_sample.value >= 0) ? value : -value;
-
-    /* Determine sign power based on current mode */
-    switch(_data.mode) {
-        case KEI_MODE_VOLTS:
-        case KEI_MODE_OHMS:
-            data->range = _data.last_sample.range;
-            break;
-        case KEI_MODE_NONE:
-        case KEI_MODE_COULOMBS:
-        case KEI_MODE_AMPERES:
-            data->range = -_data.last_sample.range;
-            break;
-    }
+    *data = sample.data;
 
     return 0;
 }
@@ -353,6 +875,15 @@ int kei_interface_set_trigmode(kei_interface_trigmode_e mode) {
         return -1;
     }
 
+    /* Leave the current mode before stopping the timer, otherwise a PRINT in
+     * chained mode could re-arm it in between. Should switching fail, no
+     * mode is in effect. */
+    unsigned key = irq_lock();
+    _data.trig.mode = KEI_TRIGMODE_NONE;
+    irq_unlock(key);
+
+    k_timer_stop(&_data.trig.period_timer);
+
     if(mode == KEI_TRIGMODE_FREERUNNING) {
         if(gpio_pin_set_dt(&_int_gpios.trigger, 0) ||
            gpio_pin_set_dt(&_int_gpios.hold[0], 0) ||
@@ -370,23 +901,108 @@ int kei_interface_set_trigmode(kei_interface_trigmode_e mode) {
 
     _data.trig.mode = mode;
 
+    if(mode == KEI_TRIGMODE_PERIODIC) {
+        _trig_period_start();
+    } else if(mode == KEI_TRIGMODE_CHAINED) {
+        _trig_chain_start();
+    }
+
     return 0;
 }
 
+kei_interface_trigmode_e kei_interface_get_trigmode(void) {
+    return _data.trig.mode;
+}
+
 int kei_interface_set_trigperiod(uint32_t period_ms) {
     if(period_ms < KEI_TRIG_PERIOD_MIN) {
         return -1;
     }
 
-    if(_data.trig.mode == KEI_TRIGMODE_FREERUNNING) {
+    if((_data.trig.mode == KEI_TRIGMODE_FREERUNNING) ||
+       (_data.trig.mode == KEI_TRIGMODE_CHAINED)) {
         return -1;
     }
 
     _data.trig.period_ms = period_ms;
 
+    if(_data.trig.mode == KEI_TRIGMODE_PERIODIC) {
+        _trig_period_start();
+    }
+
     return 0;
 }
 
+void kei_interface_get_trigstats(kei_interface_trigstats_t *stats) {
+    unsigned key = irq_lock();
+    *stats = _data.trig.stats;
+    irq_unlock(key);
+}
+
+void kei_interface_reset_trigstats(void) {
+    unsigned key = irq_lock();
+    memset(&_data.trig.stats, 0, sizeof(_data.trig.stats));
+    irq_unlock(key);
+}
+
+void kei_interface_set_validate(bool enable) {
+    _data.capture.validate = enable;
+}
+
+void kei_interface_get_capstats(kei_interface_capstats_t *stats) {
+    unsigned key = irq_lock();
+    *stats = _data.capture.stats;
+    irq_unlock(key);
+}
+
+void kei_interface_reset_capstats(void) {
+    unsigned key = irq_lock();
+    memset(&_data.capture.stats, 0, sizeof(_data.capture.stats));
+    irq_unlock(key);
+}
+
+uint32_t kei_interface_get_trigperiod(void) {
+    return _data.trig.period_ms;
+}
+
+#ifdef CONFIG_KEI_BENCH
+/* Takes bench captures in place of the worker's queue, so they are never
+ * published */
+K_MSGQ_DEFINE(_bench_queue, sizeof(_capture_t), 1, 8);
+
+void kei_interface_bench_capture(kei_interface_benchcyc_t *cyc) {
+    _capture_t               capture;
+    _port_snapshot_t         snap;
+    kei_interface_sample_t   sample;
+    kei_interface_capstats_t stats = { 0 };
+    volatile int             value;
+
+    unsigned key = irq_lock();
+
+    uint32_t t0 = k_cycle_get_32();
+    if(!_print_latch(t0, &capture, &stats)) {
+        k_msgq_put(&_bench_queue, &capture, K_NO_WAIT);
+    }
+    uint32_t t1 = k_cycle_get_32();
+    _port_capture(&snap);
+    uint32_t t2 = k_cycle_get_32();
+    value = _bcd_read(_int_bcd.data_bcd, N_DATA_BITS, &snap);
+    uint32_t t3 = k_cycle_get_32();
+    _sample_decode(&snap, &sample);
+    uint32_t t4 = k_cycle_get_32();
+
+    irq_unlock(key);
+
+    k_msgq_purge(&_bench_queue);
+
+    ARG_UNUSED(value);
+    cyc->isr     = t1 - t0;
+    cyc->capture = t2 - t1;
+    cyc->bcd     = t3 - t2;
+    cyc->decode  = t4 - t3;
+}
+#endif
+
 
 
 /*
@@ -397,13 +1013,18 @@ static int _cmdhdlr_kei_read(const struct shell *sh, size_t argc, char **argv);
 static int _cmdhdlr_kei_mode(const struct shell *sh, size_t argc, char **argv);
 static int _cmdhdlr_kei_trig_mode(const struct shell *sh, size_t argc, char **argv);
 static int _cmdhdlr_kei_trig_period(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_kei_trig_stats(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_kei_capture(const struct shell *sh, size_t argc, char **argv);
 
 SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_kei_trig,
     SHELL_CMD(mode, NULL, "Get/set trigger mode\n"
-                          "  F: Free-running, P: Periodic, M: Manual",
+                          "  F: Free-running, P: Periodic, M: Manual, C: Chained",
                           _cmdhdlr_kei_trig_mode),
     SHELL_CMD(period, NULL, "Get/set trigger period",
                             _cmdhdlr_kei_trig_period),
+    SHELL_CMD(stats, NULL, "Show trigger timing statistics\n"
+                           "  reset: Clear statistics",
+                           _cmdhdlr_kei_trig_stats),
     SHELL_SUBCMD_SET_END
 );
 
@@ -414,6 +1035,42 @@ SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_kei,
                           "  V: Volts, O: Ohms, C: Coulombs, A: Amperes",
                           _cmdhdlr_kei_mode),
     SHELL_CMD(trig, &_subcmd_kei_trig, "Trigger config sub-commands", NULL),
+    SHELL_CMD(stats, NULL, "Show reading statistics\n"
+                           "  reset: Discard all windows\n"
+                           "  window <samples|time> <N>: Set window, in readings or ms",
+                           kei_stats_cmd),
+    SHELL_CMD(filter, NULL, "Get/set board-wide filter chain and show its output\n"
+                            "  <spec>: e.g. \"median:5,decim:4\", or \"none\"\n"
+                            "  Stages: boxcar:<n>, median:<n>, ema:<n>, decim:<n>",
+                            kei_filter_cmd),
+    SHELL_CMD(log, NULL, "Show flash data log status or contents\n"
+                         "  head [n]: Print oldest n readings\n"
+                         "  tail [n]: Print newest n readings\n"
+                         "  flush: Write out readings not yet in flash\n"
+                         "  erase: Erase log",
+                         kei_datalog_cmd),
+    SHELL_COND_CMD(CONFIG_KEI_EVENT, event, NULL,
+                   "Show event capture state and records held\n"
+                   "  trig <spec>: e.g. \"rise:1.5E-9,overload\", or \"none\"\n"
+                   "    Conditions: rise:<level>, fall:<level>, overload, range\n"
+                   "  arm|disarm: Enable/disable triggers\n"
+                   "  force: Fire on the next reading\n"
+                   "  show <event> [n]: Print first n readings of a record\n"
+                   "  clear: Discard all records",
+                   kei_event_cmd),
+    SHELL_CMD(perf, NULL, "Show hot path timing histograms and consumer backlogs\n"
+                          "  reset: Clear histograms and capture/trigger statistics",
+                          kei_perf_cmd),
+    SHELL_CMD(capture, NULL, "Show capture statistics\n"
+                             "  reset: Clear statistics\n"
+                             "  validate <on|off>: Enable/disable torn-read rejection",
+                             _cmdhdlr_kei_capture),
+    SHELL_COND_CMD(CONFIG_KEI_BENCH, bench, NULL,
+                   "Benchmark hot paths, printing one result per line\n"
+                   "  capture|read|trigger [n]: Capture/decode cost, sample access cost,\n"
+                   "    trigger-to-data latency, over n runs\n"
+                   "  throughput [s]: Readings/s each output path carries (emulator only)",
+                   kei_bench_cmd),
     SHELL_SUBCMD_SET_END
 );
 
@@ -510,6 +1167,8 @@ static const char *_trigmode_stringify(kei_interface_trigmode_e mode) {
             return "periodic";
         case KEI_TRIGMODE_MANUAL:
             return "manual";
+        case KEI_TRIGMODE_CHAINED:
+            return "chained";
         default:
             return "invalid";
     }
@@ -537,6 +1196,9 @@ static int _cmdhdlr_kei_trig_mode(const struct shell *sh, size_t argc, char **ar
             case 'M':
                 mode = KEI_TRIGMODE_MANUAL;
                 break;
+            case 'C':
+                mode = KEI_TRIGMODE_CHAINED;
+                break;
             default:
                 shell_print(sh, "Unsupported value for mode");
                 return -1;
@@ -583,3 +1245,73 @@ static int _cmdhdlr_kei_trig_period(const struct shell *sh, size_t argc, char **
     return 0;
 }
 
+static int _cmdhdlr_kei_trig_stats(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 2) {
+        if(strcmp(argv[1], "reset")) {
+            shell_print(sh, "Unsupported argument");
+            return -1;
+        }
+        kei_interface_reset_trigstats();
+        return 0;
+    } else if(argc > 2) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    kei_interface_trigstats_t stats;
+    kei_interface_get_trigstats(&stats);
+
+    if(_data.trig.mode == KEI_TRIGMODE_MANUAL) {
+        shell_print(sh, "Triggers: %u, reads joining a reading in flight: %u",
+                    stats.count, stats.joined);
+        return 0;
+    }
+
+    if(_data.trig.mode == KEI_TRIGMODE_CHAINED) {
+        shell_print(sh, "Triggers: %u, timeouts: %u", stats.count, stats.timeouts);
+        shell_print(sh, "Conversion time: %u us", stats.conv_us);
+        if(stats.interval_us) {
+            /* In milli-readings per second */
+            unsigned rate = 1000000000U / stats.interval_us;
+            shell_print(sh, "Achieved rate: %u.%03u readings/s", rate / 1000, rate % 1000);
+        }
+        return 0;
+    }
+
+    shell_print(sh, "Triggers: %u, overruns: %u", stats.count, stats.overruns);
+    if(stats.count) {
+        shell_print(sh, "Deviation from schedule: min %d us, max %d us, mean %d us",
+                    stats.min_us, stats.max_us, (int32_t)(stats.sum_us / stats.count));
+    }
+
+    return 0;
+}
+
+static int _cmdhdlr_kei_capture(const struct shell *sh, size_t argc, char **argv) {
+    if((argc == 2) && !strcmp(argv[1], "reset")) {
+        kei_interface_reset_capstats();
+        return 0;
+    } else if((argc == 3) && !strcmp(argv[1], "validate")) {
+        if(!strcmp(argv[2], "on")) {
+            kei_interface_set_validate(true);
+        } else if(!strcmp(argv[2], "off")) {
+            kei_interface_set_validate(false);
+        } else {
+            shell_print(sh, "Unsupported value for validate");
+            return -1;
+        }
+        return 0;
+    } else if(argc != 1) {
+        shell_print(sh, "Unsupported arguments");
+        return -1;
+    }
+
+    kei_interface_capstats_t stats;
+    kei_interface_get_capstats(&stats);
+
+    shell_print(sh, "Validation: %s", _data.capture.validate ? "on" : "off");
+    shell_print(sh, "Captured: %u, dropped: %u", stats.captured, stats.dropped);
+    shell_print(sh, "Retries: %u, torn (rejected): %u", stats.retries, stats.torn);
+
+    return 0;
+}
@@ -4,7 +4,10 @@ LOG_MODULE_REGISTER(keithley615_comm, LOG_LEVEL_DBG);
 #include <zephyr/kernel.h>
 #include <zephyr/drivers/gpio.h>
 
+#include "datalog.h"
+#include "emul615.h"
 #include "interface.h"
+#include "rs232.h"
 #include "usb.h"
 
 static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(DT_PATH(leds, led_run), gpios);
@@ -28,7 +31,25 @@ void main(void) {
         LOG_ERR("Interface failure");
     }
 
-    //kei_usb_init();
+#ifdef CONFIG_KEI_EMUL615
+    if(kei_emul615_init()) {
+        LOG_ERR("Emulator failure");
+    }
+#endif
+
+    if(kei_datalog_init()) {
+        LOG_ERR("Data log failure");
+    }
+
+    if(kei_usb_init()) {
+        LOG_ERR("USB failure");
+    }
+
+#ifdef CONFIG_KEI_RS232
+    if(kei_rs232_init()) {
+        LOG_ERR("RS-232 failure");
+    }
+#endif
 
 #define SLEEP_TIME_MS (500)
     while(1) {
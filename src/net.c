@@ -4,52 +4,174 @@
 #include <zephyr/net/net_context.h>
 #include <zephyr/net/net_if.h>
 #include <zephyr/net/net_mgmt.h>
-#include <zephyr/net/sntp.h>
+#include <zephyr/settings/settings.h>
 #include <zephyr/shell/shell.h>
 
-#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "cmdsrv.h"
 #include "net.h"
+#include "stream.h"
+#include "timesync.h"
 
 LOG_MODULE_REGISTER(kei_net);
 
 static struct net_mgmt_event_callback _mgmt_cb;
-K_CONDVAR_DEFINE(_net_ready_cond);
-K_MUTEX_DEFINE(_net_ready_mutex);
+K_SEM_DEFINE(_net_bound_sem, 0, 1);
 
 struct net_if *_net_iface;
 
+/**< Address configuration, as kept across reboots */
+typedef struct {
+    struct in_addr addr;
+    struct in_addr netmask;
+    struct in_addr gw;
+} _net_lease_t;
+
+static struct {
+    kei_net_boot_t boot;
+    struct in_addr provisional; /**< Cached or static address in use until DHCP binds, 0 if none */
+    _net_lease_t   cached;      /**< Last lease bound, loaded from settings */
+    bool           have_cached;
+} _net;
+
+#define NET_RATE_SLOTS (CONFIG_KEI_NET_RATE_WINDOW_S + 1)
+
+/**< Counters sampled for the rate view */
+typedef struct {
+    int64_t  uptime;    /**< Time of sample, in milliseconds */
+    uint32_t pkts_tx;   /**< IPv4 packets sent */
+    uint32_t pkts_rx;   /**< IPv4 packets received */
+    uint32_t bytes_tx;
+    uint32_t bytes_rx;
+    uint32_t errors;    /**< IPv4 drops and processing errors */
+    uint32_t records;   /**< Stream records sent */
+    uint32_t dgrams;    /**< Stream datagrams sent */
+} _net_snap_t;
+
+/* Once a second the network thread adds a sample to the ring, and rates are
+ * computed between the newest sample and an older one */
+static struct {
+    _net_snap_t snaps[NET_RATE_SLOTS];
+    unsigned    head;   /**< Slot of next sample */
+    unsigned    count;  /**< Number of valid samples */
+    int64_t     next;   /**< Uptime at which the next sample is due */
+} _net_rate;
+K_MUTEX_DEFINE(_net_rate_mutex);
+
+static void _net_snapshot(_net_snap_t *snap);
+
 static void _net_ev_handler(struct net_mgmt_event_callback *cb, uint32_t mgmt_event, struct net_if *iface) {
-    int i = 0;
+    ARG_UNUSED(cb);
+    ARG_UNUSED(iface);
 
-    if (mgmt_event != NET_EVENT_IPV4_ADDR_ADD) {
-        return;
+    /* Handled by the network thread, as it may mean touching flash */
+    if(mgmt_event == NET_EVENT_IPV4_DHCP_BOUND) {
+        k_sem_give(&_net_bound_sem);
     }
+}
 
-    for (i = 0; i < NET_IF_MAX_IPV4_ADDR; i++) {
-        char buf[NET_IPV4_ADDR_LEN];
+#if (CONFIG_KEI_NET_LEASE_CACHE)
+static int _net_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
 
-        if (iface->config.ip.ipv4->unicast[i].addr_type !=
-                            NET_ADDR_DHCP) {
-            continue;
+    if(settings_name_steq(name, "lease", &next) && !next) {
+        if(len != sizeof(_net.cached)) {
+            return -EINVAL;
         }
+        _net.have_cached = (read_cb(cb_arg, &_net.cached, sizeof(_net.cached)) == sizeof(_net.cached));
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(kei_net_settings, "kei/net", NULL, _net_settings_set, NULL, NULL);
+#endif /* (CONFIG_KEI_NET_LEASE_CACHE) */
+
+/**
+ * @brief Get the configured static address
+ *
+ * @return 0 on success, -1 if none is configured
+ */
+static int _net_static_get(_net_lease_t *lease) {
+    memset(lease, 0, sizeof(*lease));
+
+    if(!CONFIG_KEI_NET_STATIC_ADDR[0] ||
+       net_addr_pton(AF_INET, CONFIG_KEI_NET_STATIC_ADDR, &lease->addr) ||
+       net_addr_pton(AF_INET, CONFIG_KEI_NET_STATIC_NETMASK, &lease->netmask)) {
+        return -1;
+    }
+    if(CONFIG_KEI_NET_STATIC_GW[0] &&
+       net_addr_pton(AF_INET, CONFIG_KEI_NET_STATIC_GW, &lease->gw)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Put an address in use until DHCP binds
+ */
+static int _net_provisional_set(const _net_lease_t *lease) {
+    struct in_addr addr = lease->addr;
+
+    if(!net_if_ipv4_addr_add(_net_iface, &addr, NET_ADDR_MANUAL, 0)) {
+        return -1;
+    }
+    net_if_ipv4_set_netmask(_net_iface, &lease->netmask);
+    net_if_ipv4_set_gw(_net_iface, &lease->gw);
+
+    _net.provisional = lease->addr;
+
+    return 0;
+}
 
-        LOG_INF("Your address: %s",
-                net_addr_ntop(AF_INET,
-                              &iface->config.ip.ipv4->unicast[i].address.in_addr,
-                              buf, sizeof(buf)));
-        LOG_INF("Lease time: %u seconds", iface->config.dhcpv4.lease_time);
-        LOG_INF("Subnet: %s",
-                net_addr_ntop(AF_INET,
-                              &iface->config.ip.ipv4->netmask,
-                              buf, sizeof(buf)));
-        LOG_INF("Router: %s",
-                net_addr_ntop(AF_INET,
-                              &iface->config.ip.ipv4->gw,
-                              buf, sizeof(buf)));
-
-        k_condvar_signal(&_net_ready_cond);
+/**
+ * @brief Take over the address DHCP bound, dropping any provisional address
+ * and remembering the lease for the next boot
+ */
+static void _net_dhcp_bound(void) {
+    char         buf[NET_IPV4_ADDR_LEN];
+    _net_lease_t lease = {
+        .addr    = _net_iface->config.dhcpv4.requested_ip,
+        .netmask = _net_iface->config.ip.ipv4->netmask,
+        .gw      = _net_iface->config.ip.ipv4->gw
+    };
+
+    LOG_INF("Your address: %s", net_addr_ntop(AF_INET, &lease.addr, buf, sizeof(buf)));
+    LOG_INF("Lease time: %u seconds", _net_iface->config.dhcpv4.lease_time);
+    LOG_INF("Subnet: %s", net_addr_ntop(AF_INET, &lease.netmask, buf, sizeof(buf)));
+    LOG_INF("Router: %s", net_addr_ntop(AF_INET, &lease.gw, buf, sizeof(buf)));
+
+    if(_net.provisional.s_addr && (_net.provisional.s_addr != lease.addr.s_addr)) {
+        LOG_INF("Dropping provisional address %s",
+                net_addr_ntop(AF_INET, &_net.provisional, buf, sizeof(buf)));
+        net_if_ipv4_addr_rm(_net_iface, &_net.provisional);
     }
+    _net.provisional.s_addr = 0;
+
+    if(!_net.boot.dhcp_ms) {
+        _net.boot.dhcp_ms = k_uptime_get_32();
+    }
+    if(!_net.boot.addr_ms) {
+        _net.boot.addr_ms = _net.boot.dhcp_ms;
+        _net.boot.source  = KEI_NET_ADDR_DHCP;
+    }
+
+#if (CONFIG_KEI_NET_LEASE_CACHE)
+    /* Only write flash when the lease actually changed */
+    if(!_net.have_cached || memcmp(&_net.cached, &lease, sizeof(lease))) {
+        if(settings_save_one("kei/net/lease", &lease, sizeof(lease))) {
+            LOG_ERR("Failed to save lease");
+        } else {
+            _net.cached      = lease;
+            _net.have_cached = true;
+        }
+    }
+#endif /* (CONFIG_KEI_NET_LEASE_CACHE) */
 }
 
 static void _net_thread_main(void *p1, void *p2, void *p3) {
@@ -57,7 +179,7 @@ static void _net_thread_main(void *p1, void *p2, void *p3) {
 
     LOG_INF("Init");
 
-    net_mgmt_init_event_callback(&_mgmt_cb, _net_ev_handler, NET_EVENT_IPV4_ADDR_ADD);
+    net_mgmt_init_event_callback(&_mgmt_cb, _net_ev_handler, NET_EVENT_IPV4_DHCP_BOUND);
     net_mgmt_add_event_callback(&_mgmt_cb);
     
     _net_iface = net_if_get_default();
@@ -67,121 +189,145 @@ static void _net_thread_main(void *p1, void *p2, void *p3) {
     }
     
     if(kei_net_getaddr()) {
-        LOG_ERR("Net failure");
-        return;
+        /* Without a cached lease or static address, nothing can be served
+         * until DHCP completes. This is sometimes taking over a minute. Not
+         * sure if this is a network issue, or a hardware issue (though lack
+         * of packet errors seems to show that it is not hardware related). */
+        LOG_INF("Waiting for DHCP");
+        while(k_sem_take(&_net_bound_sem, K_SECONDS(60))) {
+            LOG_WRN("Still waiting for DHCP");
+        }
+        _net_dhcp_bound();
     }
 
-#if (CONFIG_SNTP)
-    time_t   time_s;
-    unsigned time_us;
-    
-    if (kei_net_sntp(&time_s, &time_us)) {
-        LOG_ERR("SNTP failure");
-        goto main_sntp_end;
-    } else {
-        LOG_INF("UNIX time: %llu.%06u", time_s, time_us);
-    
-        struct tm *time = gmtime(&time_s);
-        if(time) {
-            LOG_INF("UTC: %04d-%02d-%02dT%02d:%02d:%02d",
-                    time->tm_year + 1900, time->tm_mon + 1, time->tm_mday,
-                    time->tm_hour, time->tm_min, time->tm_sec);
-        }
+    if(kei_stream_init()) {
+        LOG_ERR("Failed to start streaming");
+    }
 
-        struct timespec ts = {
-            .tv_sec  = time_s,
-            .tv_nsec = time_us * 1000
-        };
-        if (clock_settime(CLOCK_REALTIME, &ts)) {
-            LOG_ERR("Failed to set system time");
-        } else {
-            LOG_INF("System time set");
-        }
+    if(kei_cmdsrv_init()) {
+        LOG_ERR("Failed to start command server");
     }
 
-main_sntp_end:
-#endif /* (CONFIG_SNTP) */
+    _net.boot.services_ms = k_uptime_get_32();
+    LOG_INF("Services started %u ms after boot", _net.boot.services_ms);
+
+#if (CONFIG_KEI_TIMESYNC)
+    if(kei_timesync_init()) {
+        LOG_ERR("Failed to start time discipline");
+    }
+#endif /* (CONFIG_KEI_TIMESYNC) */
 
     while(1) {
-        k_msleep(1000);
+        /* DHCP keeps running in the background, renewing or replacing the
+         * address the services started on */
+        if(!k_sem_take(&_net_bound_sem, K_NO_WAIT)) {
+            _net_dhcp_bound();
+        }
+
+        int64_t now = k_uptime_get();
+        if(now >= _net_rate.next) {
+            _net_snap_t snap;
+            _net_snapshot(&snap);
+
+            k_mutex_lock(&_net_rate_mutex, K_FOREVER);
+            _net_rate.snaps[_net_rate.head] = snap;
+            _net_rate.head = (_net_rate.head + 1) % NET_RATE_SLOTS;
+            _net_rate.count = MIN(_net_rate.count + 1, NET_RATE_SLOTS);
+            k_mutex_unlock(&_net_rate_mutex);
+
+            _net_rate.next = now + 1000;
+        }
+
+        kei_cmdsrv_poll(MAX((int)(_net_rate.next - now), 1));
     }
 }
-static K_THREAD_DEFINE(kei_net, 1536, _net_thread_main, NULL, NULL, NULL, 7, 0, 500);
+static K_THREAD_DEFINE(kei_net, 2560, _net_thread_main, NULL, NULL, NULL, 7, 0, 0);
 
 int kei_net_getaddr(void) {
-    LOG_INF("Starting DHCP");
+    _net_lease_t lease;
 
-    net_dhcpv4_start(_net_iface);
-    
-    /* DHCP is sometimes taking over a minute to complete. Not sure if this is
-     * a network issue, or a hardware issue (though lack of packet errors seems
-     * to show that it is not hardware related). */
-    if(k_condvar_wait(&_net_ready_cond, &_net_ready_mutex, K_MSEC(300000))) {
-        LOG_ERR("DHCP failed");
-        return -1;
+#if (CONFIG_KEI_NET_LEASE_CACHE)
+    if(settings_subsys_init() || settings_load_subtree("kei/net")) {
+        LOG_ERR("Failed to load settings");
     }
+#endif /* (CONFIG_KEI_NET_LEASE_CACHE) */
 
-    LOG_INF("DHCP completed");
+    if(_net.have_cached && !_net_provisional_set(&_net.cached)) {
+        _net.boot.source = KEI_NET_ADDR_CACHED;
+    } else if(!_net_static_get(&lease) && !_net_provisional_set(&lease)) {
+        _net.boot.source = KEI_NET_ADDR_STATIC;
+    }
 
-    return 0;
-}
+    if(_net.boot.source != KEI_NET_ADDR_NONE) {
+        char buf[NET_IPV4_ADDR_LEN];
 
-#if (CONFIG_SNTP)
-int kei_net_sntp(time_t *time_s, unsigned *time_us) {
-    int ret = 0;
+        _net.boot.addr_ms = k_uptime_get_32();
+        LOG_INF("Using %s address %s until DHCP completes",
+                (_net.boot.source == KEI_NET_ADDR_CACHED) ? "cached" : "static",
+                net_addr_ntop(AF_INET, &_net.provisional, buf, sizeof(buf)));
+    }
 
-    struct sntp_ctx    sntp;
-    struct sntp_time   sntp_time;
-    struct sockaddr_in sntp_addr;
+    LOG_INF("Starting DHCP");
+    net_dhcpv4_start(_net_iface);
 
-    /* TODO: Make configurable */
-#  define NTP_PORT 123
-#  define NTP_ADDR "129.6.15.29"
+    return (_net.boot.source != KEI_NET_ADDR_NONE) ? 0 : -1;
+}
 
-    sntp_addr.sin_family = AF_INET;
-    sntp_addr.sin_port   = htons(NTP_PORT);
-    net_addr_pton(AF_INET, NTP_ADDR, &sntp_addr.sin_addr);
+void kei_net_get_boot(kei_net_boot_t *boot) {
+    *boot = _net.boot;
+}
 
-    ret = sntp_init(&sntp, (struct sockaddr *)&sntp_addr, sizeof(sntp_addr));
-    if(ret < 0) {
-        LOG_ERR("SNTP init failed: %d", ret);
-        goto sntp_end;
-    }
 
-    int attempts = 0;
-    while(++attempts < 6) {
-        LOG_INF("Querying SNTP");
-        ret = sntp_query(&sntp, 5000, &sntp_time);
-        if(ret < 0) {
-            LOG_ERR("SNTP request failed: %d", ret);
-        } else {
-            break;
-        }
-    }
-    if(attempts == 6) {
-        goto sntp_end;
+/**
+ * @brief Get interface statistics
+ *
+ * @return 0 on success, -1 if not available
+ */
+static int _net_stats_get(struct net_stats *stats) {
+    if(!_net_iface ||
+       net_mgmt(NET_REQUEST_STATS_GET_ALL, _net_iface, stats, sizeof(*stats))) {
+        memset(stats, 0, sizeof(*stats));
+        return -1;
     }
+    return 0;
+}
 
-    LOG_INF("SNTP complete");
+static void _net_snapshot(_net_snap_t *snap) {
+    struct net_stats   stats;
+    kei_stream_stats_t stream;
+
+    _net_stats_get(&stats);
+    kei_stream_get_stats(&stream);
+
+    snap->uptime   = k_uptime_get();
+    snap->pkts_tx  = stats.ipv4.sent;
+    snap->pkts_rx  = stats.ipv4.recv;
+    snap->bytes_tx = stats.bytes.sent;
+    snap->bytes_rx = stats.bytes.received;
+    snap->errors   = stats.ipv4.drop + stats.processing_error;
+    snap->records  = stream.records;
+    snap->dgrams   = stream.dgrams;
+}
 
-    if(time_s) {
-        *time_s  = (time_t)sntp_time.seconds;
-    }
-    if(time_us) {
-        *time_us = (unsigned)(((float)sntp_time.fraction * 1000000) / ((1ULL << 32) - 1));
-    }
 
-sntp_end:
-    sntp_close(&sntp);
 
-    return ret;
-}
-#endif /* (CONFIG_SNTP) */
+/*
+ * COMMAND HANDLERS
+ */
+
+static const char * const _addr_src_names[KEI_NET_ADDR_MAX] = {
+    [KEI_NET_ADDR_NONE]   = "none",
+    [KEI_NET_ADDR_CACHED] = "cached",
+    [KEI_NET_ADDR_STATIC] = "static",
+    [KEI_NET_ADDR_DHCP]   = "DHCP",
+};
 
 static int _cmdhdlr_net_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_net_rate(const struct shell *sh, size_t argc, char **argv);
 
 SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_net,
     SHELL_CMD(info, NULL, "Print network info.", _cmdhdlr_net_info),
+    SHELL_CMD(rate, NULL, "Print packet and byte rates [over seconds].", _cmdhdlr_net_rate),
     SHELL_SUBCMD_SET_END
 );
 
@@ -191,8 +337,126 @@ static int _cmdhdlr_net_info(const struct shell *sh, size_t argc, char **argv) {
     ARG_UNUSED(argc);
     ARG_UNUSED(argv);
 
-    shell_print(sh, "test");
+    if(!_net_iface) {
+        shell_print(sh, "No interface");
+        return -1;
+    }
+
+    char buf[NET_IPV4_ADDR_LEN];
+
+    struct net_linkaddr *ll = net_if_get_link_addr(_net_iface);
+    shell_print(sh, "Link: %s, carrier: %s, MAC: %02x:%02x:%02x:%02x:%02x:%02x",
+                net_if_is_up(_net_iface) ? "up" : "down",
+                net_if_flag_is_set(_net_iface, NET_IF_LOWER_UP) ? "yes" : "no",
+                ll->addr[0], ll->addr[1], ll->addr[2], ll->addr[3], ll->addr[4], ll->addr[5]);
+
+    struct net_if_ipv4 *ipv4 = _net_iface->config.ip.ipv4;
+    for(unsigned i = 0; ipv4 && (i < NET_IF_MAX_IPV4_ADDR); i++) {
+        if(!ipv4->unicast[i].is_used) {
+            continue;
+        }
+        shell_print(sh, "Address: %s (%s)",
+                    net_addr_ntop(AF_INET, &ipv4->unicast[i].address.in_addr, buf, sizeof(buf)),
+                    (ipv4->unicast[i].addr_type == NET_ADDR_DHCP) ? "DHCP" : "static");
+    }
+    if(ipv4) {
+        shell_print(sh, "Netmask: %s", net_addr_ntop(AF_INET, &ipv4->netmask, buf, sizeof(buf)));
+        shell_print(sh, "Gateway: %s", net_addr_ntop(AF_INET, &ipv4->gw, buf, sizeof(buf)));
+    }
+    shell_print(sh, "DHCP: %s, lease: %u s, server: %s",
+                net_dhcpv4_state_name(_net_iface->config.dhcpv4.state),
+                _net_iface->config.dhcpv4.lease_time,
+                net_addr_ntop(AF_INET, &_net_iface->config.dhcpv4.server_id, buf, sizeof(buf)));
+
+    kei_stream_stats_t stream;
+    kei_stream_get_stats(&stream);
+    shell_print(sh, "Boot: %s address at %u ms, services at %u ms, DHCP at %u ms, "
+                "first datagram at %u ms", _addr_src_names[_net.boot.source], _net.boot.addr_ms,
+                _net.boot.services_ms, _net.boot.dhcp_ms, stream.first_ms);
+
+    struct net_stats stats;
+    if(_net_stats_get(&stats)) {
+        shell_print(sh, "Interface statistics not available");
+    } else {
+        shell_print(sh, "IPv4 packets sent: %u, received: %u, dropped: %u",
+                    stats.ipv4.sent, stats.ipv4.recv, stats.ipv4.drop);
+        shell_print(sh, "Bytes sent: %u, received: %u, processing errors: %u",
+                    stats.bytes.sent, stats.bytes.received, stats.processing_error);
+        shell_print(sh, "IPv4 errors: header %u, length %u/%u, fragment %u, checksum %u, protocol %u",
+                    stats.ip_errors.vhlerr, stats.ip_errors.hblenerr, stats.ip_errors.lblenerr,
+                    stats.ip_errors.fragerr, stats.ip_errors.chkerr, stats.ip_errors.protoerr);
+#if (CONFIG_NET_STATISTICS_UDP)
+        shell_print(sh, "UDP sent: %u, received: %u, dropped: %u",
+                    stats.udp.sent, stats.udp.recv, stats.udp.drop);
+#endif
+    }
+
+    /* Only available if the Ethernet driver keeps its own counters */
+    struct net_stats_eth eth;
+    if(!net_mgmt(NET_REQUEST_STATS_GET_ETHERNET, _net_iface, &eth, sizeof(eth))) {
+        shell_print(sh, "Ethernet packets sent: %u, received: %u, bytes sent: %u, received: %u",
+                    eth.pkts.tx, eth.pkts.rx, eth.bytes.sent, eth.bytes.received);
+        shell_print(sh, "Ethernet errors: rx %u, tx %u, tx dropped: %u, tx timeouts: %u",
+                    eth.errors.rx_length_errors + eth.errors.rx_over_errors + eth.errors.rx_crc_errors +
+                    eth.errors.rx_frame_errors + eth.errors.rx_no_buffer_count + eth.errors.rx_missed_errors,
+                    eth.errors.tx_aborted_errors + eth.errors.tx_carrier_errors + eth.errors.tx_fifo_errors,
+                    eth.tx_dropped, eth.tx_timeout_count);
+    }
+
+    shell_print(sh, "Stream: %u subscribers, records sent: %u, datagrams sent: %u, send errors: %u",
+                stream.subscribers, stream.records, stream.dgrams, stream.send_errors);
+    shell_print(sh, "Stream: pending high-water mark: %u/%u, records dropped: %u, samples missed: %u",
+                stream.pending_hwm, CONFIG_KEI_STREAM_POOL_SIZE, stream.dropped, stream.missed);
+    shell_print(sh, "Stream: records held back by change gates: %u", stream.suppressed);
+
+    kei_cmdsrv_stats_t cmdsrv;
+    kei_cmdsrv_get_stats(&cmdsrv);
+    shell_print(sh, "Command server: %u clients, accepted: %u, rejected: %u",
+                cmdsrv.clients, cmdsrv.accepted, cmdsrv.rejected);
+    shell_print(sh, "Command server: commands: %u, failed: %u, bytes sent: %u, send errors: %u, "
+                "tx high-water mark: %u", cmdsrv.commands, cmdsrv.failed, cmdsrv.bytes,
+                cmdsrv.send_errors, cmdsrv.tx_hwm);
 
     return 0;
 }
 
+static int _cmdhdlr_net_rate(const struct shell *sh, size_t argc, char **argv) {
+    unsigned window = CONFIG_KEI_NET_RATE_WINDOW_S;
+
+    if(argc > 2) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    } else if(argc == 2) {
+        char *end;
+        window = strtoul(argv[1], &end, 10);
+        if(*end || !window || (window > CONFIG_KEI_NET_RATE_WINDOW_S)) {
+            shell_print(sh, "Interval must be 1 to %u s", CONFIG_KEI_NET_RATE_WINDOW_S);
+            return -1;
+        }
+    }
+
+    _net_snap_t old, now;
+
+    k_mutex_lock(&_net_rate_mutex, K_FOREVER);
+    if(_net_rate.count < 2) {
+        k_mutex_unlock(&_net_rate_mutex);
+        shell_print(sh, "Not enough samples yet");
+        return -1;
+    }
+    window = MIN(window, _net_rate.count - 1);
+    now = _net_rate.snaps[(_net_rate.head + NET_RATE_SLOTS - 1) % NET_RATE_SLOTS];
+    old = _net_rate.snaps[(_net_rate.head + NET_RATE_SLOTS - 1 - window) % NET_RATE_SLOTS];
+    k_mutex_unlock(&_net_rate_mutex);
+
+    uint32_t ms = MAX((uint32_t)(now.uptime - old.uptime), 1);
+
+#define NET_RATE(field) ((uint32_t)(((uint64_t)(now.field - old.field) * 1000) / ms))
+    shell_print(sh, "Over %u ms:", ms);
+    shell_print(sh, "Packets/s tx: %u, rx: %u, errors/s: %u",
+                NET_RATE(pkts_tx), NET_RATE(pkts_rx), NET_RATE(errors));
+    shell_print(sh, "Bytes/s tx: %u, rx: %u", NET_RATE(bytes_tx), NET_RATE(bytes_rx));
+    shell_print(sh, "Stream records/s: %u, datagrams/s: %u", NET_RATE(records), NET_RATE(dgrams));
+#undef NET_RATE
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/util.h>
+
+#include "interface.h"
+#include "perf.h"
+
+/* Slot 0 collects readers that were never registered */
+#define PERF_CONSUMERS (CONFIG_KEI_PERF_CONSUMERS + 1)
+
+static struct {
+    kei_perf_hist_t hist[KEI_PERF_HIST_MAX];
+
+    struct {
+        const char     *name;
+        kei_perf_hist_t depth;
+    } consumers[PERF_CONSUMERS];
+    uint8_t n_consumers;
+} _perf = {
+    .consumers   = { [0] = { .name = "other" } },
+    .n_consumers = 1
+};
+
+static const char * const _hist_names[KEI_PERF_HIST_MAX] = {
+    [KEI_PERF_ISR]  = "PRINT ISR duration",
+    [KEI_PERF_TRIG] = "TRIGGER to PRINT",
+    [KEI_PERF_AGE]  = "Sample age when read",
+};
+
+/**
+ * @brief Add a value to a histogram, with interrupts locked
+ */
+static void _hist_add(kei_perf_hist_t *hist, uint32_t value) {
+    unsigned bucket = find_msb_set(value);
+
+    unsigned key = irq_lock();
+    hist->count[MIN(bucket, KEI_PERF_BUCKETS - 1)]++;
+    if(value > hist->max) {
+        hist->max = value;
+    }
+    irq_unlock(key);
+}
+
+void kei_perf_add(kei_perf_hist_e hist, uint32_t value) {
+    if(hist < KEI_PERF_HIST_MAX) {
+        _hist_add(&_perf.hist[hist], value);
+    }
+}
+
+void kei_perf_add_depth(const kei_interface_reader_t *reader, uint32_t depth) {
+    uint8_t id = (reader->perf_id < _perf.n_consumers) ? reader->perf_id : 0;
+    _hist_add(&_perf.consumers[id].depth, depth);
+}
+
+void kei_perf_reader_register(kei_interface_reader_t *reader, const char *name) {
+    unsigned key = irq_lock();
+
+    uint8_t id;
+    for(id = 1; id < _perf.n_consumers; id++) {
+        if(!strcmp(_perf.consumers[id].name, name)) {
+            break;
+        }
+    }
+    if((id == _perf.n_consumers) && (id < PERF_CONSUMERS)) {
+        _perf.consumers[id].name = name;
+        _perf.n_consumers++;
+    }
+    reader->perf_id = (id < _perf.n_consumers) ? id : 0;
+
+    irq_unlock(key);
+}
+
+int kei_perf_get(kei_perf_hist_e hist, kei_perf_hist_t *out) {
+    if(hist >= KEI_PERF_HIST_MAX) {
+        return -1;
+    }
+
+    unsigned key = irq_lock();
+    *out = _perf.hist[hist];
+    irq_unlock(key);
+
+    return 0;
+}
+
+void kei_perf_reset(void) {
+    unsigned key = irq_lock();
+    memset(_perf.hist, 0, sizeof(_perf.hist));
+    for(unsigned i = 0; i < PERF_CONSUMERS; i++) {
+        memset(&_perf.consumers[i].depth, 0, sizeof(_perf.consumers[i].depth));
+    }
+    irq_unlock(key);
+
+    kei_interface_reset_capstats();
+    kei_interface_reset_trigstats();
+}
+
+int kei_perf_format(const kei_perf_hist_t *hist, char *buf, size_t len) {
+    unsigned first = 0, last = 0;
+    for(unsigned i = 0; i < KEI_PERF_BUCKETS; i++) {
+        if(hist->count[i]) {
+            if(!last) {
+                first = i;
+            }
+            last = i + 1;
+        }
+    }
+
+    int off = snprintf(buf, len, "%u,%u", hist->max, first);
+    for(unsigned i = first; (i < last) && (off < (int)len); i++) {
+        off += snprintf(&buf[off], len - off, ",%u", hist->count[i]);
+    }
+    return MIN(off, (int)len - 1);
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+/**
+ * @brief Print the non-empty buckets of a histogram
+ *
+ * @param cycles Whether values are in cycles, rather than samples
+ */
+static void _hist_print(const struct shell *sh, const char *name, const kei_perf_hist_t *hist, bool cycles) {
+    uint32_t total = 0;
+    for(unsigned i = 0; i < KEI_PERF_BUCKETS; i++) {
+        total += hist->count[i];
+    }
+
+    if(cycles) {
+        shell_print(sh, "%s: %u, max %u cyc (%u us)", name, total, hist->max,
+                    k_cyc_to_us_ceil32(hist->max));
+    } else {
+        shell_print(sh, "%s: %u, max %u", name, total, hist->max);
+    }
+
+    for(unsigned i = 0; i < KEI_PERF_BUCKETS; i++) {
+        if(!hist->count[i]) {
+            continue;
+        }
+
+        /* Upper bound of bucket, exclusive */
+        uint32_t bound = (i < (KEI_PERF_BUCKETS - 1)) ? (1U << i) : UINT32_MAX;
+        if(cycles) {
+            shell_print(sh, "  < %10u cyc (%8u us): %u", bound, k_cyc_to_us_ceil32(bound), hist->count[i]);
+        } else {
+            shell_print(sh, "  < %10u: %u", bound, hist->count[i]);
+        }
+    }
+}
+
+int kei_perf_cmd(const struct shell *sh, size_t argc, char **argv) {
+    if((argc == 2) && !strcmp(argv[1], "reset")) {
+        kei_perf_reset();
+        return 0;
+    } else if(argc != 1) {
+        shell_print(sh, "Unsupported arguments");
+        return -1;
+    }
+
+    kei_interface_capstats_t  cap;
+    kei_interface_trigstats_t trig;
+    kei_interface_get_capstats(&cap);
+    kei_interface_get_trigstats(&trig);
+
+    shell_print(sh, "Captured: %u, dropped: %u, torn: %u, retries: %u, trigger timeouts: %u",
+                cap.captured, cap.dropped, cap.torn, cap.retries, trig.timeouts);
+
+    for(kei_perf_hist_e i = 0; i < KEI_PERF_HIST_MAX; i++) {
+        kei_perf_hist_t hist;
+        kei_perf_get(i, &hist);
+        _hist_print(sh, _hist_names[i], &hist, true);
+    }
+
+    for(unsigned i = 0; i < _perf.n_consumers; i++) {
+        char name[32];
+        kei_perf_hist_t hist;
+
+        unsigned key = irq_lock();
+        hist = _perf.consumers[i].depth;
+        irq_unlock(key);
+
+        snprintf(name, sizeof(name), "Backlog when read, %s", _perf.consumers[i].name);
+        _hist_print(sh, name, &hist, false);
+    }
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+
+#include "interface.h"
+#include "perf.h"
+#include "rs232.h"
+#include "stream.h"
+#include "txbuf.h"
+
+LOG_MODULE_REGISTER(kei_rs232);
+
+#define RS232_LINE_MAX 16 /**< Maximum length of a text line */
+
+BUILD_ASSERT(CONFIG_KEI_RS232_BUF_SIZE >= (sizeof(kei_stream_hdr_t) + sizeof(kei_stream_rec_t)));
+BUILD_ASSERT(CONFIG_KEI_RS232_BUF_SIZE >= RS232_LINE_MAX);
+
+/* Buffers are sent by UART DMA */
+static struct {
+    const struct device   *dev;
+    kei_interface_reader_t reader;
+    kei_rs232_format_e     format;
+
+    kei_txbuf_t            tx;
+    uint8_t                buf[2][CONFIG_KEI_RS232_BUF_SIZE];
+
+    struct {
+        uint32_t bytes;    /**< Bytes sent */
+        uint32_t aborted;  /**< Transfers aborted */
+        uint32_t errors;   /**< Transfers that failed to start */
+    } stats;
+
+    struct k_thread thread;
+} _rs232 = {
+    .dev    = DEVICE_DT_GET(DT_NODELABEL(uart_rs232)),
+    .format = KEI_RS232_FORMAT_615
+};
+
+K_THREAD_STACK_DEFINE(_rs232_thread_stack, 1024);
+static void _rs232_thread_main(void *p1, void *p2, void *p3);
+static void _rs232_callback(const struct device *dev, struct uart_event *evt, void *user_data);
+static int _rs232_send(kei_txbuf_t *tx, const uint8_t *buf, size_t len);
+
+int kei_rs232_init(void) {
+    if(!device_is_ready(_rs232.dev)) {
+        LOG_ERR("RS-232 UART not ready");
+        return -1;
+    }
+
+    if(uart_callback_set(_rs232.dev, _rs232_callback, NULL)) {
+        LOG_ERR("RS-232 UART has no async API");
+        return -1;
+    }
+
+    kei_txbuf_init(&_rs232.tx, &_rs232.buf[0][0], CONFIG_KEI_RS232_BUF_SIZE,
+                   _rs232.format == KEI_RS232_FORMAT_BINARY, _rs232_send);
+
+    k_thread_create(&_rs232.thread, _rs232_thread_stack, K_THREAD_STACK_SIZEOF(_rs232_thread_stack),
+                    _rs232_thread_main, NULL, NULL, NULL, 8, 0, K_NO_WAIT);
+    k_thread_name_set(&_rs232.thread, "kei_rs232");
+
+    LOG_INF("RS-232 init done");
+
+    return 0;
+}
+
+int kei_rs232_set_format(kei_rs232_format_e format) {
+    if(format >= KEI_RS232_FORMAT_MAX) {
+        return -1;
+    }
+
+    /* Takes effect with a new buffer, started by the next sample */
+    _rs232.format = format;
+    return 0;
+}
+
+int kei_rs232_configure(uint32_t baud, bool flow_ctrl) {
+    struct uart_config cfg;
+
+    if(uart_config_get(_rs232.dev, &cfg)) {
+        return -1;
+    }
+
+    cfg.baudrate  = baud;
+    cfg.flow_ctrl = flow_ctrl ? UART_CFG_FLOW_CTRL_RTS_CTS : UART_CFG_FLOW_CTRL_NONE;
+
+    if(uart_configure(_rs232.dev, &cfg)) {
+        LOG_ERR("Failed to configure RS-232 UART");
+        return -1;
+    }
+
+    return 0;
+}
+
+uint32_t kei_rs232_get_lost(void) {
+    return kei_txbuf_get_lost(&_rs232.tx) + _rs232.reader.dropped;
+}
+
+static void _rs232_callback(const struct device *dev, struct uart_event *evt, void *user_data) {
+    ARG_UNUSED(dev);
+    ARG_UNUSED(user_data);
+
+    switch(evt->type) {
+        case UART_TX_DONE:
+            _rs232.stats.bytes += evt->data.tx.len;
+            kei_txbuf_done(&_rs232.tx);
+            break;
+        case UART_TX_ABORTED:
+            _rs232.stats.bytes += evt->data.tx.len;
+            _rs232.stats.aborted++;
+            kei_txbuf_done(&_rs232.tx);
+            break;
+        default:
+            break;
+    }
+}
+
+static int _rs232_send(kei_txbuf_t *tx, const uint8_t *buf, size_t len) {
+    ARG_UNUSED(tx);
+
+    if(uart_tx(_rs232.dev, buf, len, SYS_FOREVER_US)) {
+        _rs232.stats.errors++;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Format a reading as a fixed-width line, with the digits as shown on
+ * the instrument's display
+ *
+ * @return Length of line
+ */
+static size_t _fmt_615(const kei_interface_sample_t *sample, char *buf, size_t len) {
+    const kei_interface_rawdata_t *raw = &sample->raw;
+    int n;
+
+    if(raw->flags & KEI_DATAFLAG_OVERLOAD) {
+        n = snprintf(buf, len, "%c OVERLOAD \r\n", (raw->value < 0) ? '-' : '+');
+    } else {
+        /* One least-significant digit is 10^(sensitivity - 4) */
+        static const unsigned pow10[] = { 10000, 1000, 100, 10 };
+        unsigned mag = abs(raw->value);
+        unsigned div = pow10[raw->sensitivity & 0x3];
+        unsigned dec = 4 - (raw->sensitivity & 0x3);
+        char     mant[12];
+
+        snprintf(mant, sizeof(mant), "%u.%0*u", mag / div, dec, mag % div);
+        n = snprintf(buf, len, "%c%6sE%+03d\r\n",
+                     (raw->value < 0) ? '-' : '+', mant, sample->data.range);
+    }
+
+    return MIN((size_t)n, len - 1);
+}
+
+/**
+ * @brief Add a sample to the buffer being filled
+ */
+static void _rs232_add(const kei_interface_sample_t *sample) {
+    uint8_t entry[MAX(sizeof(kei_stream_rec_t), RS232_LINE_MAX)];
+    size_t  len;
+    bool    binary = (_rs232.format == KEI_RS232_FORMAT_BINARY);
+
+    if(binary) {
+        kei_stream_encode(sample, (kei_stream_rec_t *)entry);
+        len = sizeof(kei_stream_rec_t);
+    } else {
+        len = _fmt_615(sample, (char *)entry, sizeof(entry));
+    }
+
+    kei_txbuf_add(&_rs232.tx, binary, entry, len);
+}
+
+static void _rs232_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    kei_interface_reader_init(&_rs232.reader);
+    kei_perf_reader_register(&_rs232.reader, "rs232");
+
+    while(1) {
+        kei_interface_wait_sample(_rs232.reader.next - 1, CONFIG_KEI_RS232_POLL_MS);
+
+        kei_interface_sample_t sample;
+        while(!kei_interface_read(&_rs232.reader, &sample)) {
+            _rs232_add(&sample);
+        }
+
+        /* Send whatever has been collected as soon as the previous transfer
+         * is done, so the line is kept busy without waiting for buffers to
+         * fill */
+        kei_txbuf_flush(&_rs232.tx);
+    }
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static const char * const _format_names[KEI_RS232_FORMAT_MAX] = {
+    [KEI_RS232_FORMAT_615]    = "615",
+    [KEI_RS232_FORMAT_BINARY] = "bin",
+};
+
+static int _cmdhdlr_rs232_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_rs232_format(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_rs232_line(const struct shell *sh, size_t argc, char **argv);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_rs232,
+    SHELL_CMD(info, NULL, "Print RS-232 output statistics", _cmdhdlr_rs232_info),
+    SHELL_CMD(format, NULL, "Get/set RS-232 output format (615, bin)", _cmdhdlr_rs232_format),
+    SHELL_CMD(line, NULL, "Get/set RS-232 line settings: [baud] [rtscts|none]", _cmdhdlr_rs232_line),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kei_rs232, &_subcmd_rs232, "RS-232 output subcommands", NULL);
+
+static int _cmdhdlr_rs232_info(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    shell_print(sh, "Format: %s, buffers: 2x%u bytes, busy: %s",
+                _format_names[_rs232.format], CONFIG_KEI_RS232_BUF_SIZE,
+                _rs232.tx.busy ? "yes" : "no");
+    shell_print(sh, "Samples queued: %u, bytes sent: %u",
+                _rs232.tx.stats.samples, _rs232.stats.bytes);
+    shell_print(sh, "Samples dropped: %u, lost in failed transfers: %u, missed: %u",
+                _rs232.tx.stats.dropped, _rs232.tx.stats.failed, _rs232.reader.dropped);
+    shell_print(sh, "Transfers aborted: %u, failed: %u",
+                _rs232.stats.aborted, _rs232.stats.errors);
+
+    return 0;
+}
+
+static int _cmdhdlr_rs232_format(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        shell_print(sh, "Format: %s", _format_names[_rs232.format]);
+        return 0;
+    } else if(argc > 2) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    for(kei_rs232_format_e format = 0; format < KEI_RS232_FORMAT_MAX; format++) {
+        if(!strcmp(argv[1], _format_names[format])) {
+            return kei_rs232_set_format(format);
+        }
+    }
+
+    shell_print(sh, "Unsupported format");
+    return -1;
+}
+
+static int _cmdhdlr_rs232_line(const struct shell *sh, size_t argc, char **argv) {
+    struct uart_config cfg;
+
+    if(uart_config_get(_rs232.dev, &cfg)) {
+        shell_print(sh, "Failed to get line settings");
+        return -1;
+    }
+
+    if(argc == 1) {
+        shell_print(sh, "Baud: %u, flow control: %s", cfg.baudrate,
+                    (cfg.flow_ctrl == UART_CFG_FLOW_CTRL_RTS_CTS) ? "rtscts" : "none");
+        return 0;
+    } else if(argc > 3) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    char *end;
+    unsigned long baud = strtoul(argv[1], &end, 10);
+    if(*end || !baud) {
+        shell_print(sh, "Invalid baud rate");
+        return -1;
+    }
+
+    bool flow_ctrl = (cfg.flow_ctrl == UART_CFG_FLOW_CTRL_RTS_CTS);
+    if(argc == 3) {
+        if(!strcmp(argv[2], "rtscts")) {
+            flow_ctrl = true;
+        } else if(!strcmp(argv[2], "none")) {
+            flow_ctrl = false;
+        } else {
+            shell_print(sh, "Unsupported flow control");
+            return -1;
+        }
+    }
+
+    return kei_rs232_configure(baud, flow_ctrl);
+}
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#include "interface.h"
+#include "stats.h"
+
+/*
+ * Statistics are accumulated in counts of the least-significant digit at
+ * sensitivity 0 (100 micro-units), which keeps every reading within +/-2e6.
+ * Exact sums of the differences from the first reading of the window, and
+ * of their squares, are kept, and mean and variance are only derived from
+ * them when summarizing. Over STATS_WINDOW_MAX readings, the sum stays
+ * below 2^38 and the sum of squares below 2^63.
+ */
+
+#define STATS_COUNT_UU    100    /**< Micro-units per count */
+#define STATS_WINDOW_MAX  65535  /**< Maximum number of readings per window */
+
+typedef struct {
+    uint32_t count;
+    uint32_t overloads;
+    int8_t   range;
+    uint8_t  flags;
+    int32_t  base;      /**< First reading, in counts */
+    int64_t  sum;       /**< Sum of differences from base, in counts */
+    uint64_t sum_sq;    /**< Sum of squared differences from base, in counts^2 */
+    int32_t  min;       /**< In counts */
+    int32_t  max;       /**< In counts */
+    uint64_t start;     /**< Timestamp of first reading, in cycles */
+} _stats_acc_t;
+
+K_MUTEX_DEFINE(_stats_lock);
+
+static struct {
+    uint32_t          window_samples;
+    uint64_t          window_cyc;
+
+    uint32_t          index;
+    _stats_acc_t      acc;
+    kei_stats_t       last;
+} _stats = {
+    .window_samples = CONFIG_KEI_STATS_WINDOW_SAMPLES
+};
+
+static uint32_t _isqrt64(uint64_t value) {
+    uint64_t root = 0;
+    uint64_t bit  = 1ULL << 62;
+
+    while(bit > value) {
+        bit >>= 2;
+    }
+    while(bit) {
+        if(value >= (root + bit)) {
+            value -= root + bit;
+            root   = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+/**
+ * @brief Divide, rounding to nearest
+ */
+static int64_t _div_round(int64_t num, uint32_t den) {
+    return (num + ((num < 0) ? -(int64_t)(den / 2) : (int64_t)(den / 2))) / (int64_t)den;
+}
+
+/**
+ * @brief Compute reported statistics from an accumulator
+ */
+static void _stats_summarize(const _stats_acc_t *acc, kei_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->count     = acc->count;
+    stats->overloads = acc->overloads;
+    stats->range     = acc->range;
+    stats->flags     = acc->flags;
+
+    if(!acc->count) {
+        return;
+    }
+
+    uint32_t n = acc->count;
+
+    stats->mean = (acc->base * STATS_COUNT_UU) + _div_round(acc->sum * STATS_COUNT_UU, n);
+    stats->min  = acc->min * STATS_COUNT_UU;
+    stats->max  = acc->max * STATS_COUNT_UU;
+
+    if(n > 1) {
+        /* Sum of squared differences from the mean is sum_sq - sum^2 / n,
+         * with sum = q * n + r expanded so sum^2 is never formed */
+        int64_t  q  = acc->sum / n;
+        int64_t  r  = acc->sum % n;
+        uint64_t m2 = acc->sum_sq - (uint64_t)((q * q * n) + (2 * q * r) + ((r * r) / n));
+
+        /* counts^2 -> micro-units^2, split so scaling cannot overflow */
+        uint64_t scale = STATS_COUNT_UU * STATS_COUNT_UU;
+        stats->variance = ((m2 / (n - 1)) * scale) + (((m2 % (n - 1)) * scale) / (n - 1));
+        stats->stddev   = _isqrt64(stats->variance);
+    }
+}
+
+/**
+ * @brief Complete the window in progress. Must be called with lock held.
+ */
+static void _stats_complete(void) {
+    if(!_stats.acc.count && !_stats.acc.overloads) {
+        return;
+    }
+
+    _stats_summarize(&_stats.acc, &_stats.last);
+    _stats.last.index = ++_stats.index;
+
+    memset(&_stats.acc, 0, sizeof(_stats.acc));
+}
+
+void kei_stats_push(const kei_interface_sample_t *sample) {
+    const kei_interface_data_t *data = &sample->data;
+
+    k_mutex_lock(&_stats_lock, K_FOREVER);
+    _stats_acc_t *acc = &_stats.acc;
+
+    /* Window boundaries */
+    if(_stats.window_samples) {
+        if((acc->count + acc->overloads) >= _stats.window_samples) {
+            _stats_complete();
+        }
+    } else if((acc->count || acc->overloads) &&
+              ((sample->timestamp - acc->start) >= _stats.window_cyc)) {
+        _stats_complete();
+    }
+    if((acc->count + acc->overloads) >= STATS_WINDOW_MAX) {
+        acc->flags |= KEI_STATS_FLAG_FULL;
+        _stats_complete();
+    }
+
+    if(data->flags & KEI_DATAFLAG_OVERLOAD) {
+        if(!acc->count && !acc->overloads) {
+            acc->start = sample->timestamp;
+        }
+        acc->overloads++;
+        goto stats_push_end;
+    }
+
+    /* Readings at different ranges cannot be combined */
+    if(acc->count && (data->range != acc->range)) {
+        acc->flags |= KEI_STATS_FLAG_PARTIAL;
+        _stats_complete();
+    }
+
+    int32_t x = data->value / STATS_COUNT_UU;
+
+    if(!acc->count) {
+        if(!acc->overloads) {
+            acc->start = sample->timestamp;
+        }
+        acc->range = data->range;
+        acc->base  = x;
+        acc->min   = x;
+        acc->max   = x;
+    } else {
+        acc->min   = MIN(acc->min, x);
+        acc->max   = MAX(acc->max, x);
+    }
+
+    int64_t d = (int64_t)x - acc->base;
+    acc->count++;
+    acc->sum    += d;
+    acc->sum_sq += d * d;
+
+stats_push_end:
+    k_mutex_unlock(&_stats_lock);
+}
+
+int kei_stats_get(kei_stats_t *last, kei_stats_t *current) {
+    k_mutex_lock(&_stats_lock, K_FOREVER);
+
+    if(last) {
+        *last = _stats.last;
+    }
+    if(current) {
+        _stats_summarize(&_stats.acc, current);
+        current->index = _stats.index + 1;
+    }
+
+    int ret = _stats.index ? 0 : -1;
+
+    k_mutex_unlock(&_stats_lock);
+
+    return ret;
+}
+
+int kei_stats_set_window(uint32_t samples, uint32_t time_ms) {
+    if((!samples == !time_ms) || (samples > STATS_WINDOW_MAX)) {
+        return -1;
+    }
+
+    k_mutex_lock(&_stats_lock, K_FOREVER);
+
+    _stats.window_samples = samples;
+    _stats.window_cyc     = k_ms_to_cyc_ceil64(time_ms);
+    memset(&_stats.acc, 0, sizeof(_stats.acc));
+
+    k_mutex_unlock(&_stats_lock);
+
+    return 0;
+}
+
+void kei_stats_reset(void) {
+    k_mutex_lock(&_stats_lock, K_FOREVER);
+
+    _stats.index = 0;
+    memset(&_stats.acc,  0, sizeof(_stats.acc));
+    memset(&_stats.last, 0, sizeof(_stats.last));
+
+    k_mutex_unlock(&_stats_lock);
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static void _stats_print(const struct shell *sh, const char *name, const kei_stats_t *stats) {
+    shell_print(sh, "%s window #%u%s%s: %u readings, %u overloaded, range 10^%+d",
+                name, stats->index,
+                (stats->flags & KEI_STATS_FLAG_PARTIAL) ? " (partial)" : "",
+                (stats->flags & KEI_STATS_FLAG_FULL)    ? " (full)"    : "",
+                stats->count, stats->overloads, stats->range);
+    if(!stats->count) {
+        return;
+    }
+    shell_print(sh, "  mean: %d uU, min: %d uU, max: %d uU",
+                stats->mean, stats->min, stats->max);
+    shell_print(sh, "  variance: %llu uU^2, stddev: %u uU",
+                (unsigned long long)stats->variance, stats->stddev);
+}
+
+int kei_stats_cmd(const struct shell *sh, size_t argc, char **argv) {
+    if((argc == 2) && !strcmp(argv[1], "reset")) {
+        kei_stats_reset();
+        return 0;
+    } else if((argc == 4) && !strcmp(argv[1], "window")) {
+        uint32_t value = strtoul(argv[3], NULL, 10);
+        int      ret   = -1;
+        if(!strcmp(argv[2], "samples")) {
+            ret = kei_stats_set_window(value, 0);
+        } else if(!strcmp(argv[2], "time")) {
+            ret = kei_stats_set_window(0, value);
+        }
+        if(ret) {
+            shell_print(sh, "Invalid window");
+        }
+        return ret;
+    } else if(argc != 1) {
+        shell_print(sh, "Unsupported arguments");
+        return -1;
+    }
+
+    kei_stats_t last, current;
+    kei_stats_get(&last, &current);
+
+    if(_stats.window_samples) {
+        shell_print(sh, "Window: %u readings", _stats.window_samples);
+    } else {
+        shell_print(sh, "Window: %u ms", (uint32_t)k_cyc_to_ms_floor64(_stats.window_cyc));
+    }
+    if(last.index) {
+        _stats_print(sh, "Last", &last);
+    }
+    _stats_print(sh, "Current", &current);
+
+    return 0;
+}
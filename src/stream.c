@@ -0,0 +1,551 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "codec.h"
+#include "filter.h"
+#include "gate.h"
+#include "interface.h"
+#include "perf.h"
+#include "stream.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(kei_stream);
+
+#define STREAM_BATCH_MAX 64
+BUILD_ASSERT(CONFIG_KEI_STREAM_BATCH <= STREAM_BATCH_MAX);
+
+#define STREAM_DGRAM_MAX (sizeof(kei_stream_hdr_t) + (STREAM_BATCH_MAX * sizeof(kei_stream_rec_t)))
+
+/**< Datagram buffer, allocated from the pool */
+typedef struct {
+    void              *fifo_reserved; /**< Used by k_fifo */
+    struct sockaddr_in addr;          /**< Destination */
+    uint8_t            count;         /**< Number of records in datagram */
+    uint16_t           len;           /**< Length of datagram, once queued */
+    uint8_t            data[STREAM_DGRAM_MAX];
+} _stream_dgram_t;
+
+K_MEM_SLAB_DEFINE_STATIC(_stream_pool, sizeof(_stream_dgram_t), CONFIG_KEI_STREAM_POOL_SIZE, 4);
+
+typedef struct {
+    struct sockaddr_in addr;
+    int64_t            expires;     /**< Uptime at which subscription lapses, 0 if slot unused */
+    uint32_t           dgram_seq;   /**< Sequence number of next datagram */
+    _stream_dgram_t   *batch;       /**< Datagram currently being filled, if any */
+    int64_t            batch_start; /**< Uptime at which first record was added to batch */
+    uint32_t           dropped;     /**< Records dropped due to buffer exhaustion */
+    kei_filter_t       filter;      /**< Filter chain applied to this subscriber's records */
+    kei_gate_t         gate;        /**< Change gate applied after the filter chain */
+    bool               compress;    /**< Send sample blocks rather than records */
+    kei_codec_t        codec;       /**< Encoder of batch, if compressing */
+} _stream_sub_t;
+
+static struct {
+    int                    sock;
+    kei_interface_reader_t reader;
+
+    struct k_fifo          pending;     /**< Datagrams ready to be sent */
+    unsigned               n_pending;
+
+    unsigned               batch;       /**< Records per datagram */
+    unsigned               flush_ms;    /**< Maximum time a record may wait in a batch */
+
+    _stream_sub_t          subs[CONFIG_KEI_STREAM_MAX_SUBS];
+
+    kei_stream_stats_t     stats;
+
+    struct k_thread thread;
+} _stream;
+
+K_THREAD_STACK_DEFINE(_stream_thread_stack, 2048);
+static void _stream_thread_main(void *p1, void *p2, void *p3);
+static void _stream_batch_queue(_stream_sub_t *sub);
+
+int kei_stream_init(void) {
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(CONFIG_KEI_STREAM_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    k_fifo_init(&_stream.pending);
+    _stream.batch    = CONFIG_KEI_STREAM_BATCH;
+    _stream.flush_ms = CONFIG_KEI_STREAM_FLUSH_MS;
+
+    _stream.sock = zsock_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(_stream.sock < 0) {
+        LOG_ERR("Failed to create socket: %d", errno);
+        return -1;
+    }
+
+    if(zsock_bind(_stream.sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERR("Failed to bind socket: %d", errno);
+        zsock_close(_stream.sock);
+        return -1;
+    }
+
+    k_thread_create(&_stream.thread, _stream_thread_stack, K_THREAD_STACK_SIZEOF(_stream_thread_stack),
+                    _stream_thread_main, NULL, NULL, NULL, 7, 0, K_NO_WAIT);
+    k_thread_name_set(&_stream.thread, "kei_stream");
+
+    LOG_INF("Streaming on UDP port %u", CONFIG_KEI_STREAM_PORT);
+
+    return 0;
+}
+
+/**
+ * @brief Handle a subscription request
+ */
+static void _stream_request(void) {
+    char               buf[8 + KEI_FILTER_SPEC_MAX + KEI_GATE_SPEC_MAX];
+    struct sockaddr_in from;
+    socklen_t          fromlen = sizeof(from);
+
+    ssize_t len = zsock_recvfrom(_stream.sock, buf, sizeof(buf) - 1, ZSOCK_MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &fromlen);
+    if((len <= 0) || (from.sin_family != AF_INET)) {
+        return;
+    }
+    buf[len] = '\0';
+    while(len && ((buf[len - 1] == '\n') || (buf[len - 1] == '\r') || (buf[len - 1] == ' '))) {
+        buf[--len] = '\0';
+    }
+
+    _stream_sub_t *sub  = NULL;
+    _stream_sub_t *free = NULL;
+    for(unsigned i = 0; i < CONFIG_KEI_STREAM_MAX_SUBS; i++) {
+        _stream_sub_t *s = &_stream.subs[i];
+        if(!s->expires) {
+            if(!free) {
+                free = s;
+            }
+        } else if((s->addr.sin_addr.s_addr == from.sin_addr.s_addr) &&
+                  (s->addr.sin_port        == from.sin_port)) {
+            sub = s;
+        }
+    }
+
+    const char *resp = "OK";
+    bool        compress = !strncmp(buf, "SUBZ", 4);
+    if(!strncmp(buf, "SUB", 3) &&
+       ((buf[3 + compress] == '\0') || (buf[3 + compress] == ' '))) {
+        /* A renewal without spec keeps the subscriber's filter chain and
+         * gate, one with a spec only restarts them if they changed */
+        kei_filter_t filter = { 0 };
+        kei_gate_t   gate   = { 0 };
+        char         rest[KEI_FILTER_SPEC_MAX];
+        char        *arg    = &buf[3 + compress];
+        bool         spec   = (*arg == ' ');
+        if(spec && (kei_gate_parse(&gate, arg + 1, rest, sizeof(rest)) ||
+                    kei_filter_parse(&filter, rest))) {
+            resp = "ERR";
+            goto request_resp;
+        }
+
+        if(!sub) {
+            if(!free) {
+                resp = "FULL";
+                goto request_resp;
+            }
+            sub = free;
+            memset(sub, 0, sizeof(*sub));
+            sub->addr = from;
+        }
+        if(spec && !kei_filter_equal(&sub->filter, &filter)) {
+            sub->filter = filter;
+        }
+        if(spec && !kei_gate_equal(&sub->gate, &gate)) {
+            sub->gate = gate;
+        }
+        if(sub->compress != compress) {
+            _stream_batch_queue(sub);
+            sub->compress = compress;
+        }
+        sub->expires = k_uptime_get() + (CONFIG_KEI_STREAM_LEASE_S * 1000);
+    } else if(!strcmp(buf, "UNSUB")) {
+        if(sub) {
+            /* Any batch in progress is flushed to the subscriber first */
+            sub->expires = -1;
+        }
+    } else {
+        resp = "ERR";
+    }
+
+request_resp:
+    zsock_sendto(_stream.sock, resp, strlen(resp), ZSOCK_MSG_DONTWAIT,
+                 (struct sockaddr *)&from, fromlen);
+}
+
+/**
+ * @brief Queue subscriber's current batch for sending
+ */
+static void _stream_batch_queue(_stream_sub_t *sub) {
+    _stream_dgram_t *dgram = sub->batch;
+    if(!dgram) {
+        return;
+    }
+
+    kei_stream_hdr_t *hdr = (kei_stream_hdr_t *)dgram->data;
+    hdr->magic   = sys_cpu_to_le16(KEI_STREAM_MAGIC);
+    hdr->version = sub->compress ? KEI_STREAM_VERSION_CODEC : KEI_STREAM_VERSION;
+    hdr->count   = dgram->count;
+    dgram->len   = sizeof(*hdr) +
+                   (sub->compress ? sub->codec.len : (dgram->count * sizeof(kei_stream_rec_t)));
+    hdr->seq     = sys_cpu_to_le32(sub->dgram_seq++);
+    dgram->addr  = sub->addr;
+
+    k_fifo_put(&_stream.pending, dgram);
+    sub->batch = NULL;
+
+    if(++_stream.n_pending > _stream.stats.pending_hwm) {
+        _stream.stats.pending_hwm = _stream.n_pending;
+    }
+}
+
+/**
+ * @brief Get timestamp of a sample, in microseconds
+ *
+ * @return true if the timestamp is UTC, false if it is time since boot
+ */
+static bool _stream_time(const kei_interface_sample_t *sample, uint64_t *timestamp) {
+    if(kei_time_to_utc(sample->timestamp, timestamp)) {
+        *timestamp = k_cyc_to_us_floor64(sample->timestamp);
+        return false;
+    }
+    return true;
+}
+
+void kei_stream_encode(const kei_interface_sample_t *sample, kei_stream_rec_t *rec) {
+    const kei_interface_data_t *data = &sample->data;
+
+    uint64_t timestamp;
+    uint8_t  flags = data->flags;
+    if(_stream_time(sample, &timestamp)) {
+        flags |= KEI_STREAM_RECFLAG_UTC;
+    }
+
+    rec->seq         = sys_cpu_to_le32(sample->seq);
+    rec->timestamp   = sys_cpu_to_le64(timestamp);
+    rec->value       = sys_cpu_to_le32(data->value);
+    rec->range       = data->range;
+    rec->sensitivity = sample->raw.sensitivity;
+    rec->flags       = flags;
+    rec->mode        = sample->mode;
+}
+
+uint32_t kei_stream_get_lost(void) {
+    return _stream.stats.dropped + _stream.reader.dropped;
+}
+
+void kei_stream_get_stats(kei_stream_stats_t *stats) {
+    *stats = _stream.stats;
+    stats->missed = _stream.reader.dropped;
+
+    stats->subscribers = 0;
+    for(unsigned i = 0; i < CONFIG_KEI_STREAM_MAX_SUBS; i++) {
+        if(_stream.subs[i].expires > 0) {
+            stats->subscribers++;
+        }
+    }
+}
+
+/**
+ * @brief Add a sample to a compressing subscriber's batch
+ *
+ * @param sub Subscriber
+ * @param sample Sample, after filtering
+ * @param recflags KEI_STREAM_RECFLAG_* to add to the sample's flags
+ */
+static void _stream_add_block(_stream_sub_t *sub, const kei_interface_sample_t *sample, uint8_t recflags) {
+    kei_codec_sample_t enc = {
+        .seq         = sample->seq,
+        .value       = sample->data.value,
+        .range       = sample->data.range,
+        .sensitivity = sample->raw.sensitivity,
+        .flags       = sample->data.flags | recflags
+    };
+    uint8_t flags = _stream_time(sample, &enc.time) ? KEI_CODEC_FLAG_UTC : 0;
+    uint8_t mode  = sample->mode;
+
+    /* Time base and mode are per block */
+    if(sub->batch && ((flags != sub->codec.flags) || (mode != sub->codec.mode))) {
+        _stream_batch_queue(sub);
+    }
+
+    for(unsigned attempt = 0; attempt < 2; attempt++) {
+        if(!sub->batch) {
+            if(k_mem_slab_alloc(&_stream_pool, (void **)&sub->batch, K_NO_WAIT)) {
+                sub->batch = NULL;
+                sub->dropped++;
+                _stream.stats.dropped++;
+                return;
+            }
+            sub->batch->count = 0;
+            sub->batch_start  = k_uptime_get();
+            kei_codec_enc_init(&sub->codec, &sub->batch->data[sizeof(kei_stream_hdr_t)],
+                               STREAM_DGRAM_MAX - sizeof(kei_stream_hdr_t), flags, mode);
+        }
+
+        if(!kei_codec_enc_add(&sub->codec, &enc)) {
+            break;
+        }
+        _stream_batch_queue(sub);
+    }
+
+    if(++sub->batch->count >= _stream.batch) {
+        _stream_batch_queue(sub);
+    }
+}
+
+/**
+ * @brief Filter and gate sample, and add the resulting record to every
+ * subscriber's batch
+ */
+static void _stream_add(const kei_interface_sample_t *sample) {
+    kei_stream_rec_t unfiltered;
+    bool             encoded = false;
+
+    for(unsigned i = 0; i < CONFIG_KEI_STREAM_MAX_SUBS; i++) {
+        _stream_sub_t *sub = &_stream.subs[i];
+        if(sub->expires <= 0) {
+            continue;
+        }
+
+        const kei_interface_sample_t *in = sample;
+        kei_interface_sample_t        out;
+        if(sub->filter.n_stages) {
+            out = *sample;
+            if(kei_filter_apply(&sub->filter, &out)) {
+                continue;
+            }
+            in = &out;
+        }
+
+        /* Held back readings are never encoded */
+        int gated = kei_gate_apply(&sub->gate, in);
+        if(gated < 0) {
+            _stream.stats.suppressed++;
+            continue;
+        }
+        uint8_t recflags = (sub->filter.n_stages ? KEI_STREAM_RECFLAG_FILTERED : 0) |
+                           ((gated == KEI_GATE_HEARTBEAT) ? KEI_STREAM_RECFLAG_HEARTBEAT : 0);
+
+        kei_stream_rec_t  marked;
+        kei_stream_rec_t *rec = &unfiltered;
+        if(sub->compress) {
+            _stream_add_block(sub, in, recflags);
+            continue;
+        } else if(recflags) {
+            kei_stream_encode(in, &marked);
+            marked.flags |= recflags;
+            rec = &marked;
+        } else if(!encoded) {
+            kei_stream_encode(sample, &unfiltered);
+            encoded = true;
+        }
+
+        if(!sub->batch) {
+            if(k_mem_slab_alloc(&_stream_pool, (void **)&sub->batch, K_NO_WAIT)) {
+                sub->batch = NULL;
+                sub->dropped++;
+                _stream.stats.dropped++;
+                continue;
+            }
+            sub->batch->count = 0;
+            sub->batch_start  = k_uptime_get();
+        }
+
+        _stream_dgram_t *dgram = sub->batch;
+        memcpy(&dgram->data[sizeof(kei_stream_hdr_t) + (dgram->count * sizeof(*rec))],
+               rec, sizeof(*rec));
+        if(++dgram->count >= _stream.batch) {
+            _stream_batch_queue(sub);
+        }
+    }
+}
+
+/**
+ * @brief Queue batches that have waited for the flush interval, and expire
+ * lapsed subscriptions
+ *
+ * @return Time until the next batch needs to be flushed, in ms
+ */
+static int _stream_service(void) {
+    int64_t now  = k_uptime_get();
+    int     next = CONFIG_KEI_STREAM_POLL_MS;
+
+    for(unsigned i = 0; i < CONFIG_KEI_STREAM_MAX_SUBS; i++) {
+        _stream_sub_t *sub = &_stream.subs[i];
+        if(!sub->expires) {
+            continue;
+        }
+
+        if(sub->batch) {
+            int64_t remain = (sub->batch_start + _stream.flush_ms) - now;
+            if((remain <= 0) || (sub->expires < 0) || (sub->expires <= now)) {
+                _stream_batch_queue(sub);
+            } else if(remain < next) {
+                next = remain;
+            }
+        }
+
+        if((sub->expires < 0) || (sub->expires <= now)) {
+            LOG_INF("Subscription ended, %u records dropped", sub->dropped);
+            sub->expires = 0;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * @brief Send pending datagrams, until the network stack stops accepting them
+ */
+static void _stream_send(void) {
+    _stream_dgram_t *dgram;
+    while((dgram = k_fifo_peek_head(&_stream.pending)) != NULL) {
+        ssize_t ret = zsock_sendto(_stream.sock, dgram->data, dgram->len, ZSOCK_MSG_DONTWAIT,
+                                   (struct sockaddr *)&dgram->addr, sizeof(dgram->addr));
+        if((ret < 0) && ((errno == EAGAIN) || (errno == ENOMEM))) {
+            /* Try again next time around */
+            return;
+        }
+
+        if(ret < 0) {
+            _stream.stats.send_errors++;
+        } else {
+            if(!_stream.stats.dgrams) {
+                _stream.stats.first_ms = k_uptime_get_32();
+            }
+            _stream.stats.dgrams++;
+            _stream.stats.records += dgram->count;
+        }
+
+        k_fifo_get(&_stream.pending, K_NO_WAIT);
+        _stream.n_pending--;
+        k_mem_slab_free(&_stream_pool, (void *)dgram);
+    }
+}
+
+static void _stream_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    kei_interface_reader_init(&_stream.reader);
+    kei_perf_reader_register(&_stream.reader, "stream");
+
+    struct zsock_pollfd pfd = {
+        .fd     = _stream.sock,
+        .events = ZSOCK_POLLIN
+    };
+
+    int timeout = CONFIG_KEI_STREAM_POLL_MS;
+
+    while(1) {
+        if((zsock_poll(&pfd, 1, timeout) > 0) &&
+           (pfd.revents & ZSOCK_POLLIN)) {
+            _stream_request();
+        }
+
+        kei_interface_sample_t sample;
+        while(!kei_interface_read(&_stream.reader, &sample)) {
+            _stream_add(&sample);
+        }
+
+        timeout = _stream_service();
+
+        _stream_send();
+    }
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static int _cmdhdlr_stream_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_stream_batch(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_stream_flush(const struct shell *sh, size_t argc, char **argv);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_stream,
+    SHELL_CMD(info, NULL, "Print subscribers and streaming statistics", _cmdhdlr_stream_info),
+    SHELL_CMD(batch, NULL, "Get/set number of records per datagram", _cmdhdlr_stream_batch),
+    SHELL_CMD(flush, NULL, "Get/set maximum time a record is held back, in ms", _cmdhdlr_stream_flush),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kei_stream, &_subcmd_stream, "UDP streaming subcommands", NULL);
+
+static int _cmdhdlr_stream_info(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    shell_print(sh, "Port: %u, batch: %u, flush: %u ms",
+                CONFIG_KEI_STREAM_PORT, _stream.batch, _stream.flush_ms);
+    shell_print(sh, "Records sent: %u, datagrams sent: %u, send errors: %u",
+                _stream.stats.records, _stream.stats.dgrams, _stream.stats.send_errors);
+    shell_print(sh, "Pending high-water mark: %u/%u, samples missed: %u, held back by gates: %u",
+                _stream.stats.pending_hwm, CONFIG_KEI_STREAM_POOL_SIZE, _stream.reader.dropped,
+                _stream.stats.suppressed);
+
+    for(unsigned i = 0; i < CONFIG_KEI_STREAM_MAX_SUBS; i++) {
+        _stream_sub_t *sub = &_stream.subs[i];
+        if(sub->expires <= 0) {
+            continue;
+        }
+
+        char addr[NET_IPV4_ADDR_LEN];
+        char spec[KEI_FILTER_SPEC_MAX];
+        char gate[KEI_GATE_SPEC_MAX];
+        kei_filter_format(&sub->filter, spec, sizeof(spec));
+        kei_gate_format(&sub->gate, gate, sizeof(gate));
+        shell_print(sh, "  %s:%u - datagrams: %u, dropped: %u, filter: %s, gate: %s%s",
+                    net_addr_ntop(AF_INET, &sub->addr.sin_addr, addr, sizeof(addr)),
+                    ntohs(sub->addr.sin_port), sub->dgram_seq, sub->dropped, spec, gate,
+                    sub->compress ? ", compressed" : "");
+        if(sub->gate.enabled) {
+            shell_print(sh, "    held back by gate: %u", sub->gate.suppressed);
+        }
+    }
+
+    return 0;
+}
+
+static int _cmdhdlr_stream_batch(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        shell_print(sh, "Records per datagram: %u", _stream.batch);
+    } else if(argc == 2) {
+        unsigned batch = strtoul(argv[1], NULL, 10);
+        if((batch < 1) || (batch > STREAM_BATCH_MAX)) {
+            shell_print(sh, "Batch size must be between 1 and %u", STREAM_BATCH_MAX);
+            return -1;
+        }
+        _stream.batch = batch;
+    } else {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _cmdhdlr_stream_flush(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        shell_print(sh, "Flush interval: %u ms", _stream.flush_ms);
+    } else if(argc == 2) {
+        _stream.flush_ms = strtoul(argv[1], NULL, 10);
+    } else {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+
+#include "timebase.h"
+
+/* The 32-bit cycle counter wraps every ~67 s at 64 MHz. Timestamps are
+ * extended to 64 bits by tracking the last extended value, which is kept
+ * fresh by a timer well within half a wrap period. */
+#define TIME_REFRESH_MS 10000
+
+/**< UTC reference, and the corrections applied to the cycle counter from it
+ * on. UTC at a given cycle count is
+ *   utc_ns + elapsed + elapsed * rate_ppb + min(elapsed, slew_ns) * slew_ppb
+ * with elapsed being the nanoseconds counted since cycles. */
+typedef struct {
+    uint64_t cycles;     /**< Cycle count at which utc_ns was valid */
+    uint64_t utc_ns;     /**< UTC reference, 0 if not yet set */
+    int32_t  rate_ppb;   /**< Frequency correction of the cycle counter */
+    int32_t  slew_ppb;   /**< Additional correction while slewing */
+    uint64_t slew_ns;    /**< Counted nanoseconds from cycles on to slew over */
+} _time_ref_t;
+
+static struct {
+    uint64_t    last;    /**< Most recent extended cycle count */
+    _time_ref_t ref;
+
+    struct k_timer refresh_timer;
+} _time;
+
+uint64_t kei_time_extend(uint32_t cycles) {
+#if defined(CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER)
+    uint64_t now = k_cycle_get_64();
+    return now - (uint32_t)((uint32_t)now - cycles);
+#else
+    unsigned key = irq_lock();
+
+    /* cycles may have been captured before the last extension took place,
+     * in which case the delta is negative. */
+    int32_t  delta = (int32_t)(cycles - (uint32_t)_time.last);
+    uint64_t ext   = _time.last + delta;
+    if(delta > 0) {
+        _time.last = ext;
+    }
+
+    irq_unlock(key);
+
+    return ext;
+#endif
+}
+
+uint64_t kei_time_cycles(void) {
+#if defined(CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER)
+    return k_cycle_get_64();
+#else
+    return kei_time_extend(k_cycle_get_32());
+#endif
+}
+
+/**
+ * @brief Convert cycles to nanoseconds, without overflowing on long intervals
+ */
+static uint64_t _cyc_to_ns(uint64_t cycles) {
+    uint32_t hz = sys_clock_hw_cycles_per_sec();
+    return ((cycles / hz) * NSEC_PER_SEC) + (((cycles % hz) * NSEC_PER_SEC) / hz);
+}
+
+/**
+ * @brief Get a parts-per-billion fraction of an interval
+ */
+static int64_t _scale_ppb(uint64_t ns, int32_t ppb) {
+    return ((int64_t)(ns / NSEC_PER_SEC) * ppb) +
+           (((int64_t)(ns % NSEC_PER_SEC) * ppb) / (int64_t)NSEC_PER_SEC);
+}
+
+static uint64_t _ref_to_utc(const _time_ref_t *ref, uint64_t cycles) {
+    if(cycles >= ref->cycles) {
+        uint64_t ns = _cyc_to_ns(cycles - ref->cycles);
+        return ref->utc_ns + ns + _scale_ppb(ns, ref->rate_ppb) +
+               _scale_ppb(MIN(ns, ref->slew_ns), ref->slew_ppb);
+    }
+
+    /* Slewing before the reference is not tracked, the error is bounded by
+     * the slew rate over however long ago the reference was moved */
+    uint64_t ns = _cyc_to_ns(ref->cycles - cycles);
+    return ref->utc_ns - ns - _scale_ppb(ns, ref->rate_ppb);
+}
+
+static void _ref_get(_time_ref_t *ref) {
+    unsigned key = irq_lock();
+    *ref = _time.ref;
+    irq_unlock(key);
+}
+
+static void _ref_set(const _time_ref_t *ref) {
+    unsigned key = irq_lock();
+    _time.ref = *ref;
+    irq_unlock(key);
+}
+
+/**
+ * @brief Move the reference to now, keeping UTC continuous, so corrections
+ * can be changed from here on
+ */
+static void _ref_rebase(_time_ref_t *ref) {
+    uint64_t now = kei_time_cycles();
+
+    if(ref->utc_ns && (now > ref->cycles)) {
+        uint64_t elapsed = _cyc_to_ns(now - ref->cycles);
+        ref->utc_ns  = _ref_to_utc(ref, now);
+        ref->slew_ns = (ref->slew_ns > elapsed) ? (ref->slew_ns - elapsed) : 0;
+    }
+    ref->cycles = now;
+}
+
+void kei_time_set_utc(uint64_t cycles, uint64_t utc_ns) {
+    _time_ref_t ref;
+    _ref_get(&ref);
+
+    ref.cycles   = cycles;
+    ref.utc_ns   = utc_ns;
+    ref.slew_ppb = 0;
+    ref.slew_ns  = 0;
+
+    _ref_set(&ref);
+}
+
+void kei_time_set_rate(int32_t rate_ppb) {
+    _time_ref_t ref;
+    _ref_get(&ref);
+
+    _ref_rebase(&ref);
+    ref.rate_ppb = rate_ppb;
+
+    _ref_set(&ref);
+}
+
+void kei_time_slew(int64_t offset_ns, uint32_t max_ppb) {
+    _time_ref_t ref;
+    _ref_get(&ref);
+
+    _ref_rebase(&ref);
+    if(!offset_ns || !max_ppb) {
+        ref.slew_ppb = 0;
+        ref.slew_ns  = 0;
+    } else {
+        uint64_t abs_ns = (offset_ns < 0) ? -offset_ns : offset_ns;
+        ref.slew_ppb = (offset_ns < 0) ? -(int32_t)max_ppb : (int32_t)max_ppb;
+        ref.slew_ns  = ((abs_ns / max_ppb) * NSEC_PER_SEC) +
+                       (((abs_ns % max_ppb) * NSEC_PER_SEC) / max_ppb);
+    }
+
+    _ref_set(&ref);
+}
+
+void kei_time_get_discipline(kei_time_discipline_t *disc) {
+    _time_ref_t ref;
+    _ref_get(&ref);
+
+    uint64_t elapsed = _cyc_to_ns(kei_time_cycles() - ref.cycles);
+    uint64_t left    = (ref.slew_ns > elapsed) ? (ref.slew_ns - elapsed) : 0;
+
+    disc->rate_ppb     = ref.rate_ppb;
+    disc->slew_ppb     = left ? ref.slew_ppb : 0;
+    disc->slew_left_ns = _scale_ppb(left, ref.slew_ppb);
+}
+
+int kei_time_to_utc_ns(uint64_t cycles, uint64_t *utc_ns) {
+    _time_ref_t ref;
+    _ref_get(&ref);
+
+    if(ref.utc_ns == 0) {
+        return -1;
+    }
+
+    *utc_ns = _ref_to_utc(&ref, cycles);
+
+    return 0;
+}
+
+int kei_time_to_utc(uint64_t cycles, uint64_t *utc_us) {
+    uint64_t utc_ns;
+    if(kei_time_to_utc_ns(cycles, &utc_ns)) {
+        return -1;
+    }
+
+    *utc_us = utc_ns / NSEC_PER_USEC;
+
+    return 0;
+}
+
+static void _refresh_timer_expiry(struct k_timer *timer) {
+    ARG_UNUSED(timer);
+
+    kei_time_cycles();
+}
+
+static int _time_init(const struct device *dev) {
+    ARG_UNUSED(dev);
+
+    k_timer_init(&_time.refresh_timer, _refresh_timer_expiry, NULL);
+    k_timer_start(&_time.refresh_timer, K_MSEC(TIME_REFRESH_MS), K_MSEC(TIME_REFRESH_MS));
+
+    return 0;
+}
+SYS_INIT(_time_init, APPLICATION, 0);
@@ -0,0 +1,487 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/shell/shell.h>
+
+#include "timebase.h"
+#include "timesync.h"
+
+LOG_MODULE_REGISTER(kei_timesync);
+
+#define NTP_PORT         123
+#define NTP_UNIX_OFFSET  2208988800UL /**< Seconds from 1900 to 1970 */
+#define NTP_VERSION      4
+#define NTP_MODE_CLIENT  3
+#define NTP_MODE_SERVER  4
+#define NTP_LI_ALARM     3            /**< Server clock not synchronized */
+
+#define TIMESYNC_RETRY_S     8        /**< Poll interval until first synchronized */
+#define TIMESYNC_FILTER_LEN  8        /**< Samples to pick the least delayed from */
+#define TIMESYNC_HIST_LEN    8        /**< Samples used to estimate the frequency error over */
+#define TIMESYNC_RATE_MAX    500000   /**< Largest frequency correction, in ppb */
+#define TIMESYNC_SERVER_LEN  24       /**< Longest "<address>:<port>" */
+
+/* All fields are naturally aligned, so no packing is needed */
+typedef struct {
+    uint8_t  li_vn_mode;
+    uint8_t  stratum;
+    int8_t   poll;
+    int8_t   precision;
+    uint32_t root_delay;
+    uint32_t root_dispersion;
+    uint32_t ref_id;
+    uint32_t ref_ts[2];
+    uint32_t orig_ts[2];
+    uint32_t rx_ts[2];
+    uint32_t tx_ts[2];
+} _ntp_pkt_t;
+
+BUILD_ASSERT(sizeof(_ntp_pkt_t) == 48);
+
+/**< Result of one exchange with a server */
+typedef struct {
+    uint64_t cycles;     /**< Local timestamp of reply */
+    uint64_t server_ns;  /**< Server time at cycles, in ns since the UNIX epoch */
+    int64_t  delay_ns;   /**< Round-trip delay */
+    int64_t  offset_ns;  /**< Offset not yet being corrected for, at cycles */
+} _ts_sample_t;
+
+static struct {
+    int                sock;
+
+    struct sockaddr_in servers[CONFIG_KEI_TIMESYNC_MAX_SERVERS];
+    unsigned           n_servers;
+
+    _ts_sample_t       filter[TIMESYNC_FILTER_LEN];
+    unsigned           n_filter;
+    unsigned           filter_head;
+
+    _ts_sample_t       hist[TIMESYNC_HIST_LEN]; /**< Samples used, for frequency estimation */
+    unsigned           n_hist;
+    unsigned           hist_head;
+
+    uint64_t           last_cycles;  /**< Timestamp of last sample used */
+    unsigned           step_pending; /**< Consecutive samples beyond the step threshold */
+
+    kei_timesync_status_t status;
+
+    struct k_thread    thread;
+} _ts = {
+    .sock = -1
+};
+K_MUTEX_DEFINE(_ts_mutex);
+K_SEM_DEFINE(_ts_wake, 0, 1);
+
+K_THREAD_STACK_DEFINE(_ts_thread_stack, 2048);
+static void _ts_thread_main(void *p1, void *p2, void *p3);
+
+int kei_timesync_init(void) {
+    if(!_ts.n_servers && kei_timesync_set_servers(CONFIG_KEI_TIMESYNC_SERVERS)) {
+        LOG_ERR("Invalid server list");
+        return -1;
+    }
+
+    _ts.sock = zsock_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(_ts.sock < 0) {
+        LOG_ERR("Failed to create socket: %d", errno);
+        return -1;
+    }
+
+    k_thread_create(&_ts.thread, _ts_thread_stack, K_THREAD_STACK_SIZEOF(_ts_thread_stack),
+                    _ts_thread_main, NULL, NULL, NULL, 9, 0, K_NO_WAIT);
+    k_thread_name_set(&_ts.thread, "kei_timesync");
+
+    return 0;
+}
+
+int kei_timesync_set_servers(const char *spec) {
+    struct sockaddr_in servers[CONFIG_KEI_TIMESYNC_MAX_SERVERS];
+    unsigned           n = 0;
+
+    while(*spec) {
+        char   buf[TIMESYNC_SERVER_LEN];
+        size_t len = strcspn(spec, " ,");
+
+        if(len) {
+            if((len >= sizeof(buf)) || (n == CONFIG_KEI_TIMESYNC_MAX_SERVERS)) {
+                return -1;
+            }
+            memcpy(buf, spec, len);
+            buf[len] = '\0';
+
+            unsigned long port = NTP_PORT;
+            char *colon = strchr(buf, ':');
+            if(colon) {
+                char *end;
+                *colon = '\0';
+                port   = strtoul(colon + 1, &end, 10);
+                if(*end || !port || (port > UINT16_MAX)) {
+                    return -1;
+                }
+            }
+
+            memset(&servers[n], 0, sizeof(servers[n]));
+            servers[n].sin_family = AF_INET;
+            servers[n].sin_port   = htons(port);
+            if(net_addr_pton(AF_INET, buf, &servers[n].sin_addr)) {
+                return -1;
+            }
+            n++;
+        }
+
+        spec += len;
+        if(*spec) {
+            spec++;
+        }
+    }
+
+    if(!n) {
+        return -1;
+    }
+
+    k_mutex_lock(&_ts_mutex, K_FOREVER);
+    memcpy(_ts.servers, servers, n * sizeof(servers[0]));
+    _ts.n_servers = n;
+    k_mutex_unlock(&_ts_mutex);
+
+    return 0;
+}
+
+void kei_timesync_get_status(kei_timesync_status_t *status) {
+    k_mutex_lock(&_ts_mutex, K_FOREVER);
+    *status = _ts.status;
+    k_mutex_unlock(&_ts_mutex);
+
+    kei_time_discipline_t disc;
+    kei_time_get_discipline(&disc);
+    status->rate_ppb     = disc.rate_ppb;
+    status->slew_left_ns = disc.slew_left_ns;
+}
+
+/**
+ * @brief Convert an NTP timestamp to nanoseconds since the UNIX epoch
+ */
+static uint64_t _ntp_to_ns(const uint32_t ts[2]) {
+    uint32_t sec  = ntohl(ts[0]);
+    uint32_t frac = ntohl(ts[1]);
+
+    /* Seconds wrap in 2036, times that would be before 1968 are taken to be
+     * in the following era */
+    uint64_t unix_s = (sec & 0x80000000) ? (sec - NTP_UNIX_OFFSET)
+                                         : ((uint64_t)sec + (1ULL << 32) - NTP_UNIX_OFFSET);
+
+    return (unix_s * NSEC_PER_SEC) + (((uint64_t)frac * NSEC_PER_SEC) >> 32);
+}
+
+/**
+ * @brief Exchange one request and reply with a server
+ *
+ * @return 0 on success, -1 on timeout or invalid reply
+ */
+static int _ts_query(const struct sockaddr_in *server, _ts_sample_t *sample) {
+    _ntp_pkt_t pkt;
+
+    /* Drop late replies to earlier requests */
+    while(zsock_recv(_ts.sock, &pkt, sizeof(pkt), ZSOCK_MSG_DONTWAIT) > 0) {
+    }
+
+    pkt = (_ntp_pkt_t){
+        .li_vn_mode = (NTP_VERSION << 3) | NTP_MODE_CLIENT
+    };
+
+    /* The server echoes the transmit timestamp, which only serves to match
+     * the reply to this request */
+    uint32_t nonce[2] = { htonl(_ts.status.polls), htonl(k_cycle_get_32()) };
+    memcpy(pkt.tx_ts, nonce, sizeof(nonce));
+
+    uint64_t t1 = kei_time_cycles();
+    if(zsock_sendto(_ts.sock, &pkt, sizeof(pkt), 0, (const struct sockaddr *)server,
+                    sizeof(*server)) < 0) {
+        return -1;
+    }
+    _ts.status.polls++;
+
+    int64_t deadline = k_uptime_get() + CONFIG_KEI_TIMESYNC_TIMEOUT_MS;
+    while(1) {
+        int64_t remain = deadline - k_uptime_get();
+        if(remain <= 0) {
+            return -1;
+        }
+
+        struct zsock_pollfd pfd = {
+            .fd     = _ts.sock,
+            .events = ZSOCK_POLLIN
+        };
+        if(zsock_poll(&pfd, 1, (int)remain) <= 0) {
+            continue;
+        }
+
+        struct sockaddr_in from;
+        socklen_t          fromlen = sizeof(from);
+        ssize_t len = zsock_recvfrom(_ts.sock, &pkt, sizeof(pkt), ZSOCK_MSG_DONTWAIT,
+                                     (struct sockaddr *)&from, &fromlen);
+        uint64_t t4 = kei_time_cycles();
+
+        if((len < (ssize_t)sizeof(pkt)) ||
+           (from.sin_addr.s_addr != server->sin_addr.s_addr) ||
+           ((pkt.li_vn_mode & 0x07) != NTP_MODE_SERVER) ||
+           ((pkt.li_vn_mode >> 6) == NTP_LI_ALARM) ||
+           !pkt.stratum || (pkt.stratum > 15) ||
+           memcmp(pkt.orig_ts, nonce, sizeof(nonce))) {
+            continue;
+        }
+
+        uint64_t t2 = _ntp_to_ns(pkt.rx_ts);
+        uint64_t t3 = _ntp_to_ns(pkt.tx_ts);
+
+        /* Time spent in the server does not count towards the delay */
+        int64_t delay = (int64_t)k_cyc_to_ns_floor64(t4 - t1) - (int64_t)(t3 - t2);
+
+        sample->cycles    = t4;
+        sample->delay_ns  = MAX(delay, 0);
+        sample->server_ns = t3 + (sample->delay_ns / 2);
+        _ts.status.replies++;
+
+        return 0;
+    }
+}
+
+/**
+ * @brief Set the time outright
+ */
+static void _ts_step(const _ts_sample_t *sample) {
+    kei_time_set_utc(sample->cycles, sample->server_ns);
+
+    /* Keep the system clock roughly in step too */
+    struct timespec ts = {
+        .tv_sec  = sample->server_ns / NSEC_PER_SEC,
+        .tv_nsec = sample->server_ns % NSEC_PER_SEC
+    };
+    if(clock_settime(CLOCK_REALTIME, &ts)) {
+        LOG_ERR("Failed to set system time");
+    }
+
+    _ts.n_filter     = 0;
+    _ts.n_hist       = 0;
+    _ts.last_cycles  = sample->cycles;
+    _ts.step_pending = 0;
+
+    k_mutex_lock(&_ts_mutex, K_FOREVER);
+    _ts.status.synced    = true;
+    _ts.status.offset_ns = sample->offset_ns;
+    _ts.status.delay_ns  = sample->delay_ns;
+    _ts.status.last_ms   = k_uptime_get_32();
+    _ts.status.steps++;
+    k_mutex_unlock(&_ts_mutex);
+
+    LOG_INF("Time set, UNIX time %llu.%06u", (unsigned long long)(sample->server_ns / NSEC_PER_SEC),
+            (unsigned)((sample->server_ns % NSEC_PER_SEC) / NSEC_PER_USEC));
+}
+
+/**
+ * @brief Feed a sample to the discipline
+ */
+static void _ts_update(_ts_sample_t *sample) {
+    uint64_t local;
+    if(kei_time_to_utc_ns(sample->cycles, &local)) {
+        sample->offset_ns = 0;
+        _ts_step(sample);
+        return;
+    }
+
+    /* What is already being slewed out does not count */
+    kei_time_discipline_t disc;
+    kei_time_get_discipline(&disc);
+    sample->offset_ns = (int64_t)(sample->server_ns - local) - disc.slew_left_ns;
+
+    /* Only step if the offset persists, rather than for a single outlier */
+    int64_t step_ns = (int64_t)CONFIG_KEI_TIMESYNC_STEP_MS * NSEC_PER_MSEC;
+    if((sample->offset_ns > step_ns) || (sample->offset_ns < -step_ns)) {
+        if(++_ts.step_pending >= 2) {
+            LOG_WRN("Offset %lld ms, stepping", (long long)(sample->offset_ns / NSEC_PER_MSEC));
+            _ts_step(sample);
+        }
+        return;
+    }
+    _ts.step_pending = 0;
+
+    _ts.filter[_ts.filter_head] = *sample;
+    _ts.filter_head = (_ts.filter_head + 1) % TIMESYNC_FILTER_LEN;
+    _ts.n_filter    = MIN(_ts.n_filter + 1, TIMESYNC_FILTER_LEN);
+
+    /* Delay adds to the uncertainty of the offset, so go by the least
+     * delayed sample, as long as it is newer than the last one used */
+    const _ts_sample_t *best = NULL;
+    for(unsigned i = 0; i < _ts.n_filter; i++) {
+        if(!best || (_ts.filter[i].delay_ns < best->delay_ns)) {
+            best = &_ts.filter[i];
+        }
+    }
+    if(best->cycles <= _ts.last_cycles) {
+        return;
+    }
+
+    /* The crystal's frequency error follows from how far the server's clock
+     * advanced against the cycle counter, over the span of recent samples.
+     * A long span averages out the jitter of individual samples. */
+    _ts.hist[_ts.hist_head] = *best;
+    _ts.hist_head = (_ts.hist_head + 1) % TIMESYNC_HIST_LEN;
+    _ts.n_hist    = MIN(_ts.n_hist + 1, TIMESYNC_HIST_LEN);
+
+    const _ts_sample_t *oldest =
+        &_ts.hist[(_ts.hist_head + TIMESYNC_HIST_LEN - _ts.n_hist) % TIMESYNC_HIST_LEN];
+    uint64_t span_us = k_cyc_to_us_floor64(best->cycles - oldest->cycles);
+    if(span_us >= ((uint64_t)CONFIG_KEI_TIMESYNC_POLL_S * USEC_PER_SEC)) {
+        int64_t diff_ns = (int64_t)(best->server_ns - oldest->server_ns) -
+                          (int64_t)(span_us * NSEC_PER_USEC);
+        int64_t rate    = (diff_ns * (int64_t)USEC_PER_SEC) / (int64_t)span_us;
+
+        kei_time_set_rate((int32_t)CLAMP(rate, -TIMESYNC_RATE_MAX, TIMESYNC_RATE_MAX));
+    }
+
+    kei_time_get_discipline(&disc);
+    kei_time_slew(disc.slew_left_ns + best->offset_ns, CONFIG_KEI_TIMESYNC_SLEW_PPM * 1000);
+    _ts.last_cycles = best->cycles;
+
+    k_mutex_lock(&_ts_mutex, K_FOREVER);
+    _ts.status.offset_ns = best->offset_ns;
+    _ts.status.delay_ns  = best->delay_ns;
+    _ts.status.last_ms   = k_uptime_get_32();
+    k_mutex_unlock(&_ts_mutex);
+
+    LOG_DBG("Offset %lld ns, delay %lld ns", (long long)best->offset_ns, (long long)best->delay_ns);
+}
+
+/**
+ * @brief Query all servers, and use the least delayed reply
+ */
+static void _ts_poll(void) {
+    struct sockaddr_in servers[CONFIG_KEI_TIMESYNC_MAX_SERVERS];
+    unsigned           n_servers;
+
+    k_mutex_lock(&_ts_mutex, K_FOREVER);
+    memcpy(servers, _ts.servers, sizeof(servers));
+    n_servers = _ts.n_servers;
+    k_mutex_unlock(&_ts_mutex);
+
+    _ts_sample_t best  = { 0 };
+    bool         valid = false;
+    for(unsigned i = 0; i < n_servers; i++) {
+        _ts_sample_t sample;
+        if(_ts_query(&servers[i], &sample)) {
+            continue;
+        }
+        if(!valid || (sample.delay_ns < best.delay_ns)) {
+            best  = sample;
+            valid = true;
+        }
+    }
+
+    if(!valid) {
+        LOG_WRN("No reply from any server");
+        return;
+    }
+
+    _ts_update(&best);
+}
+
+static void _ts_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    while(1) {
+        _ts_poll();
+        k_sem_take(&_ts_wake, K_SECONDS(_ts.status.synced ? CONFIG_KEI_TIMESYNC_POLL_S
+                                                         : TIMESYNC_RETRY_S));
+    }
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static int _cmdhdlr_timesync_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_timesync_servers(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_timesync_poll(const struct shell *sh, size_t argc, char **argv);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_timesync,
+    SHELL_CMD(info, NULL, "Print time discipline state", _cmdhdlr_timesync_info),
+    SHELL_CMD(servers, NULL, "Get/set SNTP servers: [<addr>[:<port>] ...]", _cmdhdlr_timesync_servers),
+    SHELL_CMD(poll, NULL, "Poll servers now", _cmdhdlr_timesync_poll),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kei_timesync, &_subcmd_timesync, "Time discipline subcommands", NULL);
+
+static int _cmdhdlr_timesync_info(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    kei_timesync_status_t status;
+    kei_timesync_get_status(&status);
+
+    uint64_t utc_ns;
+    if(kei_time_to_utc_ns(kei_time_cycles(), &utc_ns)) {
+        shell_print(sh, "Not synchronized");
+    } else {
+        shell_print(sh, "UNIX time: %llu.%09u, last update %u ms ago",
+                    (unsigned long long)(utc_ns / NSEC_PER_SEC), (unsigned)(utc_ns % NSEC_PER_SEC),
+                    k_uptime_get_32() - status.last_ms);
+    }
+
+    shell_print(sh, "Offset: %lld ns, delay: %lld ns",
+                (long long)status.offset_ns, (long long)status.delay_ns);
+    shell_print(sh, "Frequency correction: %d ppb, slew left: %lld ns",
+                status.rate_ppb, (long long)status.slew_left_ns);
+    shell_print(sh, "Polls: %u, replies: %u, steps: %u", status.polls, status.replies, status.steps);
+
+    return 0;
+}
+
+static int _cmdhdlr_timesync_servers(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        k_mutex_lock(&_ts_mutex, K_FOREVER);
+        for(unsigned i = 0; i < _ts.n_servers; i++) {
+            char buf[NET_IPV4_ADDR_LEN];
+            shell_print(sh, "%s:%u",
+                        net_addr_ntop(AF_INET, &_ts.servers[i].sin_addr, buf, sizeof(buf)),
+                        ntohs(_ts.servers[i].sin_port));
+        }
+        k_mutex_unlock(&_ts_mutex);
+        return 0;
+    }
+
+    char spec[CONFIG_KEI_TIMESYNC_MAX_SERVERS * TIMESYNC_SERVER_LEN] = "";
+    size_t len = 0;
+    for(size_t i = 1; (i < argc) && (len < sizeof(spec)); i++) {
+        len += snprintf(&spec[len], sizeof(spec) - len, "%s ", argv[i]);
+    }
+
+    if((len >= sizeof(spec)) || kei_timesync_set_servers(spec)) {
+        shell_print(sh, "Invalid server list");
+        return -1;
+    }
+
+    k_sem_give(&_ts_wake);
+
+    return 0;
+}
+
+static int _cmdhdlr_timesync_poll(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(sh);
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    k_sem_give(&_ts_wake);
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "stream.h"
+#include "txbuf.h"
+
+/* Records per frame are counted in a u8 */
+#define TXBUF_FRAME_MAX (sizeof(kei_stream_hdr_t) + (UINT8_MAX * sizeof(kei_stream_rec_t)))
+
+void kei_txbuf_init(kei_txbuf_t *tx, uint8_t *buf, size_t size, bool binary,
+                    kei_txbuf_send_t send) {
+    memset(tx, 0, sizeof(*tx));
+    tx->buf[0] = buf;
+    tx->buf[1] = buf + size;
+    tx->size   = size;
+    tx->binary = binary;
+    tx->send   = send;
+}
+
+/**
+ * @brief Whether the buffer being filled holds any samples
+ */
+static bool _txbuf_pending(const kei_txbuf_t *tx) {
+    return tx->count[tx->fill];
+}
+
+/**
+ * @brief Hand the buffer being filled to the transport, if it is idle
+ *
+ * @return 0 if handed over, -1 if the transport is still busy
+ */
+static int _txbuf_swap(kei_txbuf_t *tx) {
+    if(tx->busy) {
+        return -1;
+    }
+
+    uint8_t *buf   = tx->buf[tx->fill];
+    size_t   len   = tx->len[tx->fill];
+    uint16_t count = tx->count[tx->fill];
+
+    if(tx->binary) {
+        kei_stream_hdr_t *hdr = (kei_stream_hdr_t *)buf;
+        hdr->magic   = sys_cpu_to_le16(KEI_STREAM_MAGIC);
+        hdr->version = KEI_STREAM_VERSION;
+        hdr->count   = count;
+        hdr->seq     = sys_cpu_to_le32(tx->frame_seq++);
+    }
+
+    tx->fill ^= 1;
+    tx->len[tx->fill]   = 0;
+    tx->count[tx->fill] = 0;
+    compiler_barrier();
+    tx->busy = true;
+
+    if(tx->send(tx, buf, len)) {
+        /* The buffer is lost, but the next one can still go out */
+        tx->busy          = false;
+        tx->stats.failed += count;
+    }
+
+    return 0;
+}
+
+int kei_txbuf_add(kei_txbuf_t *tx, bool binary, const void *entry, size_t len) {
+    /* Format changes take effect with a new buffer */
+    if(binary != tx->binary) {
+        if(_txbuf_pending(tx) && _txbuf_swap(tx)) {
+            tx->stats.dropped++;
+            return -1;
+        }
+        tx->len[tx->fill]   = 0;
+        tx->count[tx->fill] = 0;
+        tx->binary          = binary;
+    }
+
+    bool full = (tx->len[tx->fill] + len) > tx->size;
+    if(binary) {
+        full |= (tx->len[tx->fill] + len) > TXBUF_FRAME_MAX;
+    }
+    if(full && _txbuf_swap(tx)) {
+        /* Transport is not keeping up, and both buffers are full */
+        tx->stats.dropped++;
+        return -1;
+    }
+
+    if(binary && !tx->len[tx->fill]) {
+        tx->len[tx->fill] = sizeof(kei_stream_hdr_t);
+    }
+    memcpy(&tx->buf[tx->fill][tx->len[tx->fill]], entry, len);
+    tx->len[tx->fill] += len;
+    tx->count[tx->fill]++;
+    tx->stats.samples++;
+
+    return 0;
+}
+
+void kei_txbuf_flush(kei_txbuf_t *tx) {
+    if(_txbuf_pending(tx)) {
+        _txbuf_swap(tx);
+    }
+}
+
+void kei_txbuf_done(kei_txbuf_t *tx) {
+    tx->busy = false;
+}
+
+uint32_t kei_txbuf_get_lost(const kei_txbuf_t *tx) {
+    return tx->stats.dropped + tx->stats.failed;
+}
@@ -1,15 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/usb/usb_device.h>
 
+#include "gate.h"
+#include "interface.h"
+#include "perf.h"
+#include "stream.h"
+#include "txbuf.h"
+#include "usb.h"
+
 LOG_MODULE_REGISTER(kei_usb);
 
+#define USB_LINE_MAX 64 /**< Maximum length of a CSV line */
+
+BUILD_ASSERT(CONFIG_KEI_USB_BUF_SIZE >= (sizeof(kei_stream_hdr_t) + sizeof(kei_stream_rec_t)));
+BUILD_ASSERT(CONFIG_KEI_USB_BUF_SIZE >= USB_LINE_MAX);
+
+/* Buffers are drained by the UART interrupt */
+static struct {
+    const struct device   *dev;
+    kei_interface_reader_t reader;
+    kei_usb_format_e       format;
+
+    kei_txbuf_t            tx;
+    uint8_t                buf[2][CONFIG_KEI_USB_BUF_SIZE];
+    const uint8_t         *tx_data;   /**< Buffer being drained */
+    size_t                 tx_len;
+    size_t                 tx_off;    /**< Offset into buffer being drained */
+    volatile bool          draining;  /**< Set once the above describe a buffer handed over */
+
+    kei_gate_t             gate;      /**< Change gate, readings held back are never encoded */
+
+    struct {
+        uint32_t bytes;    /**< Bytes sent */
+        uint32_t offline;  /**< Samples not sent as no host had the port open */
+    } stats;
+
+    struct k_thread thread;
+} _usb = {
+    .dev    = DEVICE_DT_GET(DT_NODELABEL(cdc_acm_uart0)),
+    .format = KEI_USB_FORMAT_BINARY
+};
+
+/* Gate is applied by the worker thread, and set from the shell */
+K_MUTEX_DEFINE(_usb_gate_lock);
+
+K_THREAD_STACK_DEFINE(_usb_thread_stack, 1024);
+static void _usb_thread_main(void *p1, void *p2, void *p3);
+static void _usb_isr(const struct device *dev, void *user_data);
+static int _usb_send(kei_txbuf_t *tx, const uint8_t *buf, size_t len);
+
 int kei_usb_init(void) {
+    if(!device_is_ready(_usb.dev)) {
+        LOG_ERR("CDC ACM device not ready");
+        return -1;
+    }
+
     if(usb_enable(NULL)) {
         LOG_ERR("Failed to init USB");
         return -1;
     }
 
+    if(kei_gate_parse(&_usb.gate, CONFIG_KEI_USB_GATE, NULL, 0)) {
+        LOG_WRN("Invalid CONFIG_KEI_USB_GATE, not gating");
+    }
+
+    kei_txbuf_init(&_usb.tx, &_usb.buf[0][0], CONFIG_KEI_USB_BUF_SIZE,
+                   _usb.format == KEI_USB_FORMAT_BINARY, _usb_send);
+    uart_irq_callback_user_data_set(_usb.dev, _usb_isr, NULL);
+
+    k_thread_create(&_usb.thread, _usb_thread_stack, K_THREAD_STACK_SIZEOF(_usb_thread_stack),
+                    _usb_thread_main, NULL, NULL, NULL, 8, 0, K_NO_WAIT);
+    k_thread_name_set(&_usb.thread, "kei_usb");
+
     LOG_INF("USB init done");
 
     return 0;
 }
+
+int kei_usb_set_format(kei_usb_format_e format) {
+    if(format >= KEI_USB_FORMAT_MAX) {
+        return -1;
+    }
+
+    /* Takes effect with a new buffer, started by the next sample */
+    _usb.format = format;
+    return 0;
+}
+
+kei_usb_format_e kei_usb_get_format(void) {
+    return _usb.format;
+}
+
+int kei_usb_set_gate(const char *spec) {
+    kei_gate_t gate;
+    if(kei_gate_parse(&gate, spec, NULL, 0)) {
+        return -1;
+    }
+
+    k_mutex_lock(&_usb_gate_lock, K_FOREVER);
+    _usb.gate = gate;
+    k_mutex_unlock(&_usb_gate_lock);
+
+    return 0;
+}
+
+int kei_usb_get_gate(char *buf, size_t len) {
+    k_mutex_lock(&_usb_gate_lock, K_FOREVER);
+    int ret = kei_gate_format(&_usb.gate, buf, len);
+    k_mutex_unlock(&_usb_gate_lock);
+
+    return ret;
+}
+
+uint32_t kei_usb_get_lost(void) {
+    return kei_txbuf_get_lost(&_usb.tx) + _usb.reader.dropped;
+}
+
+static void _usb_isr(const struct device *dev, void *user_data) {
+    ARG_UNUSED(user_data);
+
+    while(uart_irq_update(dev) && uart_irq_is_pending(dev)) {
+        if(!uart_irq_tx_ready(dev)) {
+            break;
+        }
+
+        /* The buffers may be marked busy before a handover is complete,
+         * so only the drain state set up by _usb_send() is trusted here */
+        if(!_usb.draining) {
+            uart_irq_tx_disable(dev);
+            break;
+        }
+
+        if(_usb.tx_off >= _usb.tx_len) {
+            _usb.draining = false;
+            kei_txbuf_done(&_usb.tx);
+            uart_irq_tx_disable(dev);
+            break;
+        }
+
+        int n = uart_fifo_fill(dev, &_usb.tx_data[_usb.tx_off], _usb.tx_len - _usb.tx_off);
+        if(n <= 0) {
+            break;
+        }
+        _usb.tx_off      += n;
+        _usb.stats.bytes += n;
+    }
+}
+
+static int _usb_send(kei_txbuf_t *tx, const uint8_t *buf, size_t len) {
+    ARG_UNUSED(tx);
+
+    _usb.tx_data = buf;
+    _usb.tx_len  = len;
+    _usb.tx_off  = 0;
+    compiler_barrier();
+    _usb.draining = true;
+    uart_irq_tx_enable(_usb.dev);
+
+    return 0;
+}
+
+/**
+ * @brief Add a sample to the buffer being filled
+ *
+ * @param sample Sample
+ * @param recflags KEI_STREAM_RECFLAG_* to add to the sample's flags
+ */
+static void _usb_add(const kei_interface_sample_t *sample, uint8_t recflags) {
+    uint8_t  entry[MAX(sizeof(kei_stream_rec_t), USB_LINE_MAX)];
+    size_t   len;
+    bool     binary = (_usb.format == KEI_USB_FORMAT_BINARY);
+
+    if(binary) {
+        kei_stream_encode(sample, (kei_stream_rec_t *)entry);
+        ((kei_stream_rec_t *)entry)->flags |= recflags;
+        len = sizeof(kei_stream_rec_t);
+    } else {
+        kei_stream_rec_t rec;
+        kei_stream_encode(sample, &rec);
+        rec.flags |= recflags;
+        len = snprintf((char *)entry, sizeof(entry), "%u,%llu,%d,%d,%u\r\n",
+                       sample->seq, (unsigned long long)sys_le64_to_cpu(rec.timestamp),
+                       sample->data.value, sample->data.range, rec.flags);
+        len = MIN(len, sizeof(entry) - 1);
+    }
+
+    kei_txbuf_add(&_usb.tx, binary, entry, len);
+}
+
+static void _usb_thread_main(void *p1, void *p2, void *p3) {
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    kei_interface_reader_init(&_usb.reader);
+    kei_perf_reader_register(&_usb.reader, "usb");
+
+    while(1) {
+        kei_interface_wait_sample(_usb.reader.next - 1, CONFIG_KEI_USB_FLUSH_MS);
+
+        uint32_t dtr = 0;
+        uart_line_ctrl_get(_usb.dev, UART_LINE_CTRL_DTR, &dtr);
+
+        k_mutex_lock(&_usb_gate_lock, K_FOREVER);
+        kei_interface_sample_t sample;
+        while(!kei_interface_read(&_usb.reader, &sample)) {
+            if(!dtr) {
+                _usb.stats.offline++;
+                continue;
+            }
+            int gated = kei_gate_apply(&_usb.gate, &sample);
+            if(gated >= 0) {
+                _usb_add(&sample, (gated == KEI_GATE_HEARTBEAT) ? KEI_STREAM_RECFLAG_HEARTBEAT : 0);
+            }
+        }
+        k_mutex_unlock(&_usb_gate_lock);
+
+        /* Hand over whatever has been collected as soon as the previous
+         * buffer is done, which batches samples only as far as needed */
+        if(dtr) {
+            kei_txbuf_flush(&_usb.tx);
+        }
+    }
+}
+
+
+
+/*
+ * COMMAND HANDLERS
+ */
+
+static const char * const _format_names[KEI_USB_FORMAT_MAX] = {
+    [KEI_USB_FORMAT_BINARY] = "bin",
+    [KEI_USB_FORMAT_CSV]    = "csv",
+};
+
+static int _cmdhdlr_usb_info(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_usb_format(const struct shell *sh, size_t argc, char **argv);
+static int _cmdhdlr_usb_gate(const struct shell *sh, size_t argc, char **argv);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_subcmd_usb,
+    SHELL_CMD(info, NULL, "Print USB data channel statistics", _cmdhdlr_usb_info),
+    SHELL_CMD(format, NULL, "Get/set USB data format (bin, csv)", _cmdhdlr_usb_format),
+    SHELL_CMD(gate, NULL, "Get/set change gate, e.g. \"db:500,hb:10000\", or \"none\"\n"
+                          "  Items: change, db:<uU>, dbrel:<ppm>, hb:<ms>",
+                          _cmdhdlr_usb_gate),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kei_usb, &_subcmd_usb, "USB data channel subcommands", NULL);
+
+static int _cmdhdlr_usb_info(const struct shell *sh, size_t argc, char **argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    uint32_t dtr = 0;
+    uart_line_ctrl_get(_usb.dev, UART_LINE_CTRL_DTR, &dtr);
+
+    shell_print(sh, "Host connected: %s, format: %s, buffers: 2x%u bytes",
+                dtr ? "yes" : "no", _format_names[_usb.format], CONFIG_KEI_USB_BUF_SIZE);
+    shell_print(sh, "Samples queued: %u, bytes sent: %u",
+                _usb.tx.stats.samples, _usb.stats.bytes);
+    shell_print(sh, "Samples dropped: %u, while disconnected: %u, missed: %u",
+                _usb.tx.stats.dropped, _usb.stats.offline, _usb.reader.dropped);
+
+    char gate[KEI_GATE_SPEC_MAX];
+    kei_usb_get_gate(gate, sizeof(gate));
+    shell_print(sh, "Gate: %s, samples held back: %u", gate, _usb.gate.suppressed);
+
+    return 0;
+}
+
+static int _cmdhdlr_usb_format(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        shell_print(sh, "Format: %s", _format_names[_usb.format]);
+        return 0;
+    } else if(argc > 2) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    for(kei_usb_format_e format = 0; format < KEI_USB_FORMAT_MAX; format++) {
+        if(!strcmp(argv[1], _format_names[format])) {
+            return kei_usb_set_format(format);
+        }
+    }
+
+    shell_print(sh, "Unsupported format");
+    return -1;
+}
+
+static int _cmdhdlr_usb_gate(const struct shell *sh, size_t argc, char **argv) {
+    if(argc == 1) {
+        char gate[KEI_GATE_SPEC_MAX];
+        kei_usb_get_gate(gate, sizeof(gate));
+        shell_print(sh, "Gate: %s", gate);
+        return 0;
+    } else if(argc > 2) {
+        shell_print(sh, "Too many arguments!");
+        return -1;
+    }
+
+    if(kei_usb_set_gate(argv[1])) {
+        shell_print(sh, "Invalid gate spec, e.g. \"db:500,hb:10000\"");
+        return -1;
+    }
+
+    return 0;
+}
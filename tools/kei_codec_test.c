@@ -0,0 +1,341 @@
+/*
+ * Host round-trip tests for the sample block encoding
+ *
+ * Encodes sample sequences covering state changes, sequence gaps, timestamp
+ * steps, exponent changes and extreme values, decodes them again and checks
+ * every field comes back unchanged. Also checks that adding to a full block
+ * leaves it untouched.
+ *
+ * Build and run:
+ *   cc -O2 -Wall -Iinc -o kei_codec_test tools/kei_codec_test.c src/codec.c
+ *   ./kei_codec_test
+ *
+ * Exits non-zero if any test fails.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define BLOCK_SIZE 2048
+
+static unsigned _failed;
+
+#define CHECK(cond, ...)                                    \
+    do {                                                    \
+        if(!(cond)) {                                       \
+            printf("FAIL %s:%d: ", __func__, __LINE__);     \
+            printf(__VA_ARGS__);                            \
+            printf("\n");                                   \
+            _failed++;                                      \
+            return -1;                                      \
+        }                                                   \
+    } while(0)
+
+static bool _sample_eq(const kei_codec_sample_t *a, const kei_codec_sample_t *b) {
+    return (a->seq         == b->seq)         &&
+           (a->time        == b->time)        &&
+           (a->value       == b->value)       &&
+           (a->range       == b->range)       &&
+           (a->sensitivity == b->sensitivity) &&
+           (a->flags       == b->flags);
+}
+
+/**
+ * @brief Decode a block and compare it against the samples it should hold
+ */
+static int _verify(const uint8_t *buf, size_t len, uint8_t flags, uint8_t mode,
+                   const kei_codec_sample_t *samples, size_t count) {
+    kei_codec_t        dec;
+    kei_codec_sample_t out;
+
+    CHECK(!kei_codec_dec_init(&dec, buf, len), "header rejected");
+    CHECK((dec.flags == flags) && (dec.mode == mode), "flags %u mode %u", dec.flags, dec.mode);
+    CHECK(dec.count == count, "count %u, expected %zu", dec.count, count);
+
+    for(size_t i = 0; i < count; i++) {
+        CHECK(!kei_codec_dec_next(&dec, &out), "sample %zu corrupt", i);
+        CHECK(_sample_eq(&out, &samples[i]),
+              "sample %zu: seq %u time %llu value %d range %d sens %u flags %u, "
+              "expected seq %u time %llu value %d range %d sens %u flags %u", i,
+              out.seq, (unsigned long long)out.time, out.value, out.range,
+              out.sensitivity, out.flags, samples[i].seq,
+              (unsigned long long)samples[i].time, samples[i].value, samples[i].range,
+              samples[i].sensitivity, samples[i].flags);
+    }
+    CHECK(kei_codec_dec_next(&dec, &out) == 1, "samples past end");
+    CHECK(dec.len == len, "consumed %zu of %zu bytes", dec.len, len);
+
+    return 0;
+}
+
+/**
+ * @brief Encode samples into one block and check they decode unchanged
+ */
+static int _roundtrip(const kei_codec_sample_t *samples, size_t count) {
+    static uint8_t buf[BLOCK_SIZE];
+    kei_codec_t    enc;
+
+    CHECK(!kei_codec_enc_init(&enc, buf, sizeof(buf), KEI_CODEC_FLAG_UTC, 3), "init failed");
+    for(size_t i = 0; i < count; i++) {
+        CHECK(!kei_codec_enc_add(&enc, &samples[i]), "sample %zu did not fit", i);
+    }
+
+    return _verify(buf, enc.len, KEI_CODEC_FLAG_UTC, 3, samples, count);
+}
+
+static int _test_empty(void) {
+    uint8_t     buf[KEI_CODEC_HDR_SIZE];
+    kei_codec_t enc;
+
+    CHECK(kei_codec_enc_init(&enc, buf, sizeof(buf) - 1, 0, 0), "undersized buffer accepted");
+    CHECK(!kei_codec_enc_init(&enc, buf, sizeof(buf), 0, 1), "init failed");
+    return _verify(buf, enc.len, 0, 1, NULL, 0);
+}
+
+static int _test_state(void) {
+    static const kei_codec_sample_t samples[] = {
+        { 1, 1000, 1234500, -9, 1, 0 },
+        { 2, 2000, 1234600, -9, 1, 0 },
+        { 3, 3000, 1234600, -6, 1, 0 }, /* range */
+        { 4, 4000, 1234000, -6, 2, 0 }, /* sensitivity */
+        { 5, 5000,       0,  0, 2, 1 }, /* flags (overload) */
+        { 6, 6000,       0,  0, 2, 1 },
+        { 7, 7000, 1234000, -6, 2, 0 }, /* flags back */
+        { 8, 8000, 1234000,  6, 0, 0 }, /* range sign */
+        { 9, 9000, 1234000,  6, 0, 0 },
+    };
+    return _roundtrip(samples, ARRAY_SIZE(samples));
+}
+
+static int _test_seq(void) {
+    static const kei_codec_sample_t samples[] = {
+        { 0xfffffffd, 100, 100, -9, 0, 0 },
+        { 0xfffffffe, 200, 100, -9, 0, 0 },
+        { 0xffffffff, 300, 100, -9, 0, 0 },
+        { 0x00000000, 400, 100, -9, 0, 0 }, /* wrap, no gap */
+        { 0x00000005, 500, 100, -9, 0, 0 }, /* gap */
+        { 0xfffffff0, 600, 100, -9, 0, 0 }, /* backwards */
+        { 0x00000010, 700, 100, -9, 0, 0 }, /* gap across wrap */
+        { 0x00000010, 800, 100, -9, 0, 0 }, /* repeated */
+        { 0x80000010, 900, 100, -9, 0, 0 },
+    };
+    return _roundtrip(samples, ARRAY_SIZE(samples));
+}
+
+static int _test_time(void) {
+    static const kei_codec_sample_t samples[] = {
+        { 1, 1700000000000000ULL, 5, 0, 0, 0 },
+        { 2, 1700000000000000ULL, 5, 0, 0, 0 }, /* zero delta */
+        { 3, 1700000000000000ULL, 5, 0, 0, 0 },
+        { 4, 1700000000100000ULL, 5, 0, 0, 0 }, /* steady */
+        { 5, 1700000000200000ULL, 5, 0, 0, 0 },
+        { 6, 1700000000300000ULL, 5, 0, 0, 0 },
+        { 7, 1700000000300000ULL, 5, 0, 0, 0 }, /* zero delta after steady */
+        { 8, 1700003600300000ULL, 5, 0, 0, 0 }, /* step forward */
+        { 9, 1699999999000000ULL, 5, 0, 0, 0 }, /* step back */
+        { 10, 0,                  5, 0, 0, 0 },
+        { 11, UINT64_MAX,         5, 0, 0, 0 },
+        { 12, 0,                  5, 0, 0, 0 },
+    };
+    return _roundtrip(samples, ARRAY_SIZE(samples));
+}
+
+static int _test_exp(void) {
+    static const kei_codec_sample_t samples[] = {
+        { 1, 10,    1000000, 0, 0, 0 }, /* exp 6 */
+        { 2, 20,    3000000, 0, 0, 0 },
+        { 3, 30,    1500000, 0, 0, 0 }, /* down to exp 5 */
+        { 4, 40,    1234567, 0, 0, 0 }, /* down to exp 0 */
+        { 5, 50,    1234570, 0, 0, 0 }, /* exp 0 kept */
+        { 6, 60,          0, 0, 0, 0 },
+        { 7, 70, 1000000000, 0, 0, 0 }, /* exp 9 */
+        { 8, 80,        100, 0, 0, 0 },
+        { 9, 90,       -100, 0, 0, 0 },
+        { 10, 100,   -12300, 0, 0, 0 },
+        { 11, 110,        7, 0, 0, 0 },
+    };
+    return _roundtrip(samples, ARRAY_SIZE(samples));
+}
+
+static int _test_extremes(void) {
+    static const kei_codec_sample_t samples[] = {
+        { 1, 1, INT32_MAX,   0, 0, 0 },
+        { 2, 2, INT32_MIN,   0, 0, 0 }, /* largest negative delta */
+        { 3, 3, INT32_MAX,   0, 0, 0 }, /* largest positive delta */
+        { 4, 4, INT32_MIN,   0, 0, 0 },
+        { 5, 5, INT32_MIN,   0, 0, 0 },
+        { 6, 6, 2000000000,  0, 0, 0 },
+        { 7, 7, -2000000000, 0, 0, 0 },
+        { 8, 8, INT32_MAX,   INT8_MIN, 15, 0xff },
+        { 9, 9, INT32_MIN,   INT8_MAX, 15, 0xff },
+    };
+    return _roundtrip(samples, ARRAY_SIZE(samples));
+}
+
+/**
+ * @brief Fill blocks until an add fails, checking the failed add left the
+ * block as it was and the block still decodes
+ */
+static int _fill(size_t size, const kei_codec_sample_t *(*gen)(unsigned i)) {
+    uint8_t            *buf   = malloc(size);
+    uint8_t            *copy  = malloc(size);
+    kei_codec_sample_t *added = malloc(sizeof(*added) * (UINT16_MAX + 1));
+    kei_codec_t         enc, before;
+    unsigned            n = 0;
+    int                 ret = -1;
+
+    if(!buf || !copy || !added) {
+        printf("FAIL %s: out of memory\n", __func__);
+        _failed++;
+        goto fill_end;
+    }
+
+    memset(buf, 0xa5, size);
+    if(kei_codec_enc_init(&enc, buf, size, 0, 2)) {
+        printf("FAIL %s: init failed\n", __func__);
+        _failed++;
+        goto fill_end;
+    }
+
+    while(1) {
+        const kei_codec_sample_t *sample = gen(n);
+
+        before = enc;
+        memcpy(copy, buf, size);
+        if(kei_codec_enc_add(&enc, sample)) {
+            break;
+        }
+        added[n++] = *sample;
+    }
+
+    if(memcmp(&before, &enc, sizeof(enc)) || memcmp(copy, buf, size)) {
+        printf("FAIL %s: block changed by failed add after %u samples\n", __func__, n);
+        _failed++;
+        goto fill_end;
+    }
+    ret = _verify(buf, enc.len, 0, 2, added, n);
+
+fill_end:
+    free(buf);
+    free(copy);
+    free(added);
+    return ret;
+}
+
+static const kei_codec_sample_t *_gen_varied(unsigned i) {
+    static kei_codec_sample_t sample;
+
+    /* Mixes state changes, gaps and time steps, so the failing add can be
+     * any kind of sample */
+    sample.seq         = 0xfffffff0 + i + ((i % 5) ? 0 : 3 * i);
+    sample.time        = 1000000ULL * i + ((i % 7) ? 0 : 123456);
+    sample.value       = (i % 11) ? (int32_t)(i * 104729) : INT32_MIN;
+    sample.range       = -(int)(i / 9);
+    sample.sensitivity = (i / 4) % 4;
+    sample.flags       = !(i % 13);
+
+    return &sample;
+}
+
+static const kei_codec_sample_t *_gen_steady(unsigned i) {
+    static kei_codec_sample_t sample;
+
+    sample.seq         = i + 1;
+    sample.time        = 100000ULL * i;
+    sample.value       = 1000;
+    sample.range       = -9;
+    sample.sensitivity = 0;
+    sample.flags       = 0;
+
+    return &sample;
+}
+
+static int _test_full(void) {
+    /* Every size from too small for one sample up, so the block runs out at
+     * every possible point within a sample */
+    for(size_t size = KEI_CODEC_HDR_SIZE; size < 256; size++) {
+        if(_fill(size, _gen_varied)) {
+            printf("  block size %zu\n", size);
+            return -1;
+        }
+    }
+
+    /* Runs out of sample count rather than space */
+    return _fill((size_t)UINT16_MAX * 4, _gen_steady);
+}
+
+static int _test_random(void) {
+    static kei_codec_sample_t samples[BLOCK_SIZE];
+    static uint8_t            buf[BLOCK_SIZE * 4];
+    uint32_t                  rnd = 1;
+
+    for(unsigned round = 0; round < 2000; round++) {
+        kei_codec_t        enc;
+        kei_codec_sample_t prev  = { 0 };
+        unsigned           count = 1 + (round % 200);
+
+        for(unsigned i = 0; i < count; i++) {
+            kei_codec_sample_t *s = &samples[i];
+
+            rnd = (rnd * 1103515245) + 12345;
+            *s  = prev;
+            s->seq  += (rnd & 0x700) ? 1 : (rnd >> 8);
+            s->time += (rnd & 0x3000) ? 100000 : (rnd >> 4);
+            switch((rnd >> 16) & 7) {
+                case 0:  s->value = (int32_t)rnd;              break;
+                case 1:  s->value = (int32_t)((uint32_t)s->value + ((rnd >> 20) * 1000)); break;
+                case 2:  s->range = (int8_t)(rnd >> 24);       break;
+                case 3:  s->sensitivity = (rnd >> 24) & 0x0f;  break;
+                case 4:  s->flags = (uint8_t)(rnd >> 24);      break;
+                default: s->value = (int32_t)((uint32_t)s->value + ((rnd >> 20) & 0xf) - 8); break;
+            }
+            prev = *s;
+        }
+
+        CHECK(!kei_codec_enc_init(&enc, buf, sizeof(buf), 0, 0), "init failed");
+        for(unsigned i = 0; i < count; i++) {
+            CHECK(!kei_codec_enc_add(&enc, &samples[i]), "round %u sample %u did not fit", round, i);
+        }
+        if(_verify(buf, enc.len, 0, 0, samples, count)) {
+            printf("  round %u\n", round);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int       (*run)(void);
+} _tests[] = {
+    { "empty",    _test_empty    },
+    { "state",    _test_state    },
+    { "seq",      _test_seq      },
+    { "time",     _test_time     },
+    { "exp",      _test_exp      },
+    { "extremes", _test_extremes },
+    { "full",     _test_full     },
+    { "random",   _test_random   },
+};
+
+int main(void) {
+    for(size_t i = 0; i < ARRAY_SIZE(_tests); i++) {
+        int ret = _tests[i].run();
+        printf("%-8s %s\n", _tests[i].name, ret ? "FAIL" : "ok");
+    }
+
+    if(_failed) {
+        printf("%u failed\n", _failed);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/*
+ * Host decoder for data log and event record dumps
+ *
+ * Decodes the response to LOG:DUMP? or EVENT:DUMP? (with or without its
+ * "#<n><length>" block header), or a raw copy of the log partition, and prints
+ * all readings as CSV. For event records, the page column holds the event
+ * number, and the page size given must be the record size.
+ *
+ * Build:
+ *   cc -O2 -Iinc -o kei_decode tools/kei_decode.c src/codec.c
+ *
+ * Usage:
+ *   kei_decode <dump file> [page or record size]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+/* See inc/datalog.h */
+#define DATALOG_MAGIC      0x474c364b
+#define DATALOG_HDR_SIZE   16
+#define DATALOG_PAGE_SIZE  2048
+
+/* See inc/event.h */
+#define EVENT_MAGIC        0x5645364b
+#define EVENT_HDR_SIZE     24
+
+static uint32_t _le32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint16_t _le16(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t _crc32_ieee(uint32_t crc, const uint8_t *buf, size_t len) {
+    crc = ~crc;
+    while(len--) {
+        crc ^= *buf++;
+        for(unsigned i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Decode and print a single page
+ *
+ * @return Number of readings, -1 if the page is invalid
+ */
+static int _page_decode(const uint8_t *page, size_t page_size) {
+    size_t hdr_size;
+    if(_le32(page) == DATALOG_MAGIC) {
+        hdr_size = DATALOG_HDR_SIZE;
+    } else if(_le32(page) == EVENT_MAGIC) {
+        hdr_size = EVENT_HDR_SIZE;
+    } else {
+        return -1;
+    }
+
+    /* Both headers start with magic, number and length, and end with the CRC */
+    uint32_t page_seq = _le32(&page[4]);
+    uint16_t len      = _le16(&page[8]);
+    if((page_size < hdr_size) || (len > (page_size - hdr_size))) {
+        fprintf(stderr, "Page %u: invalid length\n", page_seq);
+        return -1;
+    }
+
+    uint32_t crc = _crc32_ieee(0, page, hdr_size - 4);
+    crc = _crc32_ieee(crc, &page[hdr_size], len);
+    if(crc != _le32(&page[hdr_size - 4])) {
+        fprintf(stderr, "Page %u: CRC mismatch\n", page_seq);
+        return -1;
+    }
+
+    kei_codec_t codec;
+    if(kei_codec_dec_init(&codec, &page[hdr_size], len)) {
+        fprintf(stderr, "Page %u: invalid block\n", page_seq);
+        return -1;
+    }
+
+    kei_codec_sample_t sample;
+    int                n = 0;
+    int                ret;
+    while(!(ret = kei_codec_dec_next(&codec, &sample))) {
+        printf("%u,%u,%llu,%d,%u,%d,%d,%u,%u\n", page_seq, sample.seq,
+               (unsigned long long)sample.time, !!(codec.flags & KEI_CODEC_FLAG_UTC),
+               codec.mode, sample.value, sample.range, sample.sensitivity, sample.flags);
+        n++;
+    }
+    if(ret < 0) {
+        fprintf(stderr, "Page %u: corrupt after %d readings\n", page_seq, n);
+    }
+
+    return n;
+}
+
+int main(int argc, char **argv) {
+    if((argc < 2) || (argc > 3)) {
+        fprintf(stderr, "Usage: %s <dump file> [page or record size]\n", argv[0]);
+        return 1;
+    }
+
+    size_t page_size = (argc == 3) ? strtoul(argv[2], NULL, 0) : DATALOG_PAGE_SIZE;
+    if(page_size <= DATALOG_HDR_SIZE) {
+        fprintf(stderr, "Invalid page size\n");
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if(!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    /* Skip IEEE 488.2 definite length block header, if present */
+    int c = fgetc(file);
+    if(c == '#') {
+        int digits = fgetc(file) - '0';
+        if((digits < 1) || (digits > 9)) {
+            fprintf(stderr, "Invalid block header\n");
+            return 1;
+        }
+        fseek(file, digits, SEEK_CUR);
+    } else {
+        ungetc(c, file);
+    }
+
+    uint8_t *page = malloc(page_size);
+    if(!page) {
+        return 1;
+    }
+
+    printf("page,seq,time_us,utc,mode,value_uu,range,sensitivity,flags\n");
+
+    unsigned pages = 0, bad = 0, readings = 0;
+    while(fread(page, 1, page_size, file) == page_size) {
+        int n = _page_decode(page, page_size);
+        if(n < 0) {
+            bad++;
+        } else {
+            pages++;
+            readings += n;
+        }
+    }
+
+    fprintf(stderr, "%u readings in %u pages, %u pages skipped\n", readings, pages, bad);
+
+    free(page);
+    fclose(file);
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Host SNTP stand-in, for testing the time discipline
+ *
+ * Answers SNTP requests with the host clock, optionally offset, and running
+ * at an optional frequency error from the moment it starts, so stepping,
+ * slewing and drift estimation can be watched with 'kei_timesync info'.
+ *
+ * Build:
+ *   cc -O2 -o kei_sntpd tools/kei_sntpd.c
+ *
+ * Usage:
+ *   kei_sntpd [-p port] [-o offset ms] [-f frequency error ppm]
+ *
+ * then point the board at it, e.g. for the native_posix build:
+ *   kei_timesync servers 192.0.2.2:12300
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NTP_UNIX_OFFSET 2208988800ULL
+#define NTP_PKT_LEN     48
+
+static int64_t _offset_ns;
+static double  _freq_ppm;
+static int64_t _start_ns;
+
+static int64_t _host_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the time served, in ns since the UNIX epoch
+ */
+static int64_t _served_ns(void) {
+    int64_t now = _host_ns();
+    return now + _offset_ns + (int64_t)((double)(now - _start_ns) * _freq_ppm / 1e6);
+}
+
+static void _put_be32(uint8_t *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static void _put_ntp(uint8_t *buf, int64_t ns) {
+    uint64_t sec  = (ns / 1000000000) + NTP_UNIX_OFFSET;
+    uint64_t frac = ((uint64_t)(ns % 1000000000) << 32) / 1000000000;
+    _put_be32(buf, (uint32_t)sec);
+    _put_be32(&buf[4], (uint32_t)frac);
+}
+
+int main(int argc, char **argv) {
+    int port = 12300;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:o:f:")) != -1) {
+        switch(opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            _offset_ns = (int64_t)(atof(optarg) * 1e6);
+            break;
+        case 'f':
+            _freq_ppm = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-o offset ms] [-f frequency error ppm]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    if((sock < 0) || bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        return 1;
+    }
+
+    _start_ns = _host_ns();
+    fprintf(stderr, "Serving on UDP port %d, offset %lld ns, frequency error %.3f ppm\n",
+            port, (long long)_offset_ns, _freq_ppm);
+
+    while(1) {
+        uint8_t            pkt[NTP_PKT_LEN];
+        struct sockaddr_in from;
+        socklen_t          fromlen = sizeof(from);
+
+        ssize_t len = recvfrom(sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&from, &fromlen);
+        int64_t rx  = _served_ns();
+        if((len < NTP_PKT_LEN) || ((pkt[0] & 0x07) != 3)) {
+            continue;
+        }
+
+        /* Echo the client's transmit timestamp as originate timestamp */
+        memcpy(&pkt[24], &pkt[40], 8);
+
+        pkt[0] = (0 << 6) | (4 << 3) | 4; /* No leap warning, version 4, server */
+        pkt[1] = 1;                       /* Stratum */
+        pkt[2] = 6;                       /* Poll */
+        pkt[3] = -20;                     /* Precision, ~1 us */
+        memset(&pkt[4], 0, 8);            /* Root delay and dispersion */
+        memcpy(&pkt[12], "LOCL", 4);      /* Reference ID */
+        _put_ntp(&pkt[16], rx);
+        _put_ntp(&pkt[32], rx);
+        _put_ntp(&pkt[40], _served_ns());
+
+        sendto(sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&from, fromlen);
+    }
+}